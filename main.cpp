@@ -48,14 +48,15 @@ struct Pixel
 int get_int(fstream& stream, int offset, int bytes)
 {
     stream.seekg(offset);
-    int result = 0;
-    int base = 1;
+    // Unsigned, so the last byte cannot overflow
+    unsigned int result = 0;
+    unsigned int base = 1;
     for (int i = 0; i < bytes; i++)
     {   
         result = result + stream.get() * base;
         base = base * 256;
     }
-    return result;
+    return static_cast<int>(result);
 }
 
 /**
@@ -240,496 +241,9935 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 //
 #include <algorithm>
 #include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
-vector<vector<Pixel>> process_01 (vector<vector<Pixel>> image_file)
-/**
- * Adds a vignette to the image
- * @param image_file The image file to be editted
- */
-{
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
+// Memory mapping is only available on POSIX systems, other platforms
+// fall back to reading the whole file in a single bulk read.
+// Directory listing uses dirent and glob on POSIX and the Win32 API on Windows
+// Peak memory comes from getrusage on POSIX and GetProcessMemoryInfo on Windows
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/resource.h>
+#define IMAGE_HAVE_MMAP 1
+#define IMAGE_HAVE_DIRENT 1
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#endif
 
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
-    {
-        for (int x = 0; x < file_width; x++)
-        {
-            Pixel rgb = image_file[y][x];
+//
+// Allocation counting
+// Replaces the global operator new so benchmarks and statistics can see
+// how many allocations an operation makes. Counting is only switched on
+// for --bench, --stats, --trace and menu option 12, otherwise every
+// allocation pays one relaxed load of allocation_counting and nothing else.
+// Each thread counts its own allocations, so a call only sees the ones it
+// made even while other threads run, and parallel_rows() hands what its
+// workers allocate back to the thread that called it.
+//
 
-            // Calculates vignette gradient
-            double dist_y = 1 - pow(2*abs(.5 - static_cast<double>(y)/static_cast<double>(file_height-1)),1.5);
-            double dist_x = 1 - pow(2*abs(.5 - static_cast<double>(x)/static_cast<double>(file_width-1)),1.5);
-            
-            // Applies the gradient
-            rgb.red = static_cast<int>(round(rgb.red * dist_y * dist_x));
-            rgb.green = static_cast<int>(round(rgb.green * dist_y * dist_x));
-            rgb.blue = static_cast<int>(round(rgb.blue * dist_y * dist_x));
-            image_file[y][x] = rgb;
-        }
+atomic<bool> allocation_counting(false);
+thread_local long long thread_allocations = 0;
+thread_local long long thread_allocated_bytes = 0;
+
+void* operator new(size_t size)
+{
+    if (allocation_counting.load(memory_order_relaxed))
+    {
+        thread_allocations++;
+        thread_allocated_bytes += static_cast<long long>(size);
     }
-    cout << "Executed Process 01: Add Vignette" << endl;
-    return image_file;
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL)
+    {
+        throw bad_alloc();
+    }
+    return memory;
 }
 
-vector<vector<Pixel>> process_02 (vector<vector<Pixel>> image_file, double scaling)
-/**
- * Makes a high contrast version of the image
- * If the average RGB value of the image is 
- * greater than 170, colors will be pushed brighter
- * and vice versa for lower than 90
- * @param image_file The image file to be editted
- * @param scaling Strength of the effect on the image
- */
+// GCC cannot tell that these match the operator new above
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* memory) noexcept
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
+    free(memory);
+}
 
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
-    {
-        for (int x = 0; x < file_width; x++)
-        {
-            Pixel rgb = image_file[y][x];
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
 
-            // Calculates average brights and sets contrast levels
-            double average = static_cast<double>(rgb.red + rgb.green + rgb.blue)/3;
-            
-            // Increases contrast of the image
-            if (average > 170)
-            {
-                rgb.red = static_cast<int>(round(255 - (255 - rgb.red)*scaling));
-                rgb.green = static_cast<int>(round(255 - (255 - rgb.green)*scaling));
-                rgb.blue = static_cast<int>(round(255 - (255 - rgb.blue)*scaling));
-            } else if (average < 90)
-            {
-                rgb.red = static_cast<int>(round(rgb.red*scaling));
-                rgb.green = static_cast<int>(round(rgb.green*scaling));
-                rgb.blue = static_cast<int>(round(rgb.blue*scaling));
-            }
-            // Applies the changes to the image file
-            image_file[y][x] = rgb;
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
 
-        }
-    }
-    cout << "Executed Process 02: Claredon by factor of " << scaling << endl;
-    return image_file;
-}
+//
+// Instrumentation
+// Records the wall time, pixels, bytes allocated and peak memory of every
+// read, filter and write, for a summary table or a Chrome trace file
+// (chrome://tracing or ui.perfetto.dev). Recording is off unless asked
+// for, and then a TraceScope and an allocation each cost one relaxed load
+// of a flag.
+//
 
+// One timed call
+struct TraceEvent
+{
+    const char* category;   // read, filter or write
+    const char* name;       // Function that ran
+    double start;           // Seconds since recording started
+    double duration;        // Seconds
+    long long pixels;       // Pixels read, filtered or written
+    long long allocations;  // Allocations the call made, on its thread or its parallel_rows() workers
+    long long bytes;        // Bytes those allocations asked for
+    long long peak_rss;     // Peak resident memory of the process afterwards
+    int thread;             // Small number for the thread it ran on
+};
 
-vector<vector<Pixel>> process_03 (vector<vector<Pixel>> image_file)
+atomic<bool> instrumentation_enabled(false);
+mutex trace_lock;
+vector<TraceEvent> trace_events;
+chrono::steady_clock::time_point trace_origin = chrono::steady_clock::now();
+
+long long peak_rss_bytes()
 /**
- * Changes the image to greyscale
- * @param image_file The image file to be editted
+ * Gets the most memory the process has had resident
+ * @return bytes, 0 if the platform cannot tell
  */
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
     {
-        for (int x = 0; x < file_width; x++)
-        {
-            Pixel rgb = image_file[y][x];
-
-            // Calculates average greyscale value
-            int grey_val = (rgb.red + rgb.green + rgb.blue)/3;
-            
-            // Applies the gradient
-            rgb.red = grey_val;
-            rgb.green = grey_val;
-            rgb.blue = grey_val;
-            image_file[y][x] = rgb;
-
-        }
+        return 0;
     }
-    cout << "Executed Process 03: Greyscale" << endl;
-    return image_file;
+#ifdef __APPLE__
+    return static_cast<long long>(usage.ru_maxrss);
+#else
+    return static_cast<long long>(usage.ru_maxrss) * 1024;
+#endif
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+    return static_cast<long long>(counters.PeakWorkingSetSize);
+#else
+    return 0;
+#endif
 }
 
-
-vector<vector<Pixel>> process_04 (vector<vector<Pixel>> image_file)
+int trace_thread_number()
 /**
- * Rotates the image by 90 degrees
- * @param image_file The image file to be editted
+ * Numbers threads in the order they first record something
  */
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-
-    // Creates a new image that is rotated
-    vector<vector<Pixel>> rotated_image (file_width, 
-                                        vector<Pixel> (file_height)); 
-
-    // Loops through the pixels in image
-    // Looping through the dimensions of the
-    // new image and copying the old image
-    for (int y = 0; y < file_height; y++)
+    static atomic<int> next_thread(0);
+    static thread_local int number = -1;
+    if (number < 0)
     {
-        for (int x = 0; x < file_width; x++)
-        {
-            Pixel rgb = image_file[y][x];
-            rotated_image[x][file_height-y-1] = rgb;
-
-        }
+        number = next_thread.fetch_add(1);
     }
-    cout << "Executed Process 04: Rotate 90 Degrees" << endl;
-    return rotated_image;
+    return number;
 }
 
-
-vector<vector<Pixel>> process_05 (vector<vector<Pixel>> image_file, int turns)
+void start_instrumentation()
 /**
- * Rotates the image multiple times
- * @param image_file The image file to be editted
- * @param turns The number of times the image will be rotated
+ * Clears anything recorded and starts recording
  */
 {
+    lock_guard<mutex> lock(trace_lock);
+    trace_events.clear();
+    trace_origin = chrono::steady_clock::now();
+    allocation_counting.store(true);
+    instrumentation_enabled.store(true);
+}
 
-    cout << "Rotating 90 degrees " << turns << " times" << endl;
-    vector<vector<Pixel>> rotated_image  = image_file;
-    int num_turns = turns;
-
-    // If the image is being turned 0 times, or 360 times, we will return the 
-    // original image without turning
-    if (turns % 4 == 0 || turns == 0) 
-    {
-        return rotated_image;
-    } 
+void stop_instrumentation()
+{
+    instrumentation_enabled.store(false);
+    allocation_counting.store(false);
+}
 
-    // This will count down turns and call process 04 for each count down
-    while (turns != 0)
+/**
+ * Records the call it is declared in, from construction to destruction
+ * Does nothing when recording is off
+ */
+class TraceScope
+{
+public:
+    TraceScope(const char* category, const char* name, long long pixels = 0)
+        : active(instrumentation_enabled.load(memory_order_relaxed))
     {
-        // Converts counterclockwise turns to clockwise turns
-        while (turns < 0)
+        if (!active)
         {
-            turns = turns + 4;
-        }
-        // Reduces number of turns for huge numbers
-        while (turns >= 5)
-        {
-            turns = turns - 4;
+            return;
         }
-        // Applies the number of turns after reducing to minimum
-        // number of clockwise turns
-        if (turns < 5)
+        event.category = category;
+        event.name = name;
+        event.pixels = pixels;
+        event.allocations = thread_allocations;
+        event.bytes = thread_allocated_bytes;
+        start = chrono::steady_clock::now();
+    }
+    ~TraceScope()
+    {
+        if (!active)
         {
-            rotated_image  = process_04(rotated_image);
-            turns--;
+            return;
         }
-        
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        event.allocations = thread_allocations - event.allocations;
+        event.bytes = thread_allocated_bytes - event.bytes;
+        event.peak_rss = peak_rss_bytes();
+        event.thread = trace_thread_number();
+        event.duration = chrono::duration<double>(end - start).count();
+        lock_guard<mutex> lock(trace_lock);
+        event.start = chrono::duration<double>(start - trace_origin).count();
+        trace_events.push_back(event);
     }
-    cout << "Executed Process 05: Rotated 90 Degrees " << num_turns << " times" << endl;
-    return rotated_image;
+    // For calls that only know their size at the end, such as reads
+    void set_pixels(long long pixels) { event.pixels = pixels; }
+
+private:
+    bool active;
+    TraceEvent event;
+    chrono::steady_clock::time_point start;
+};
+
+vector<TraceEvent> recorded_events()
+/**
+ * Copies the events recorded so far, in the order they finished
+ */
+{
+    lock_guard<mutex> lock(trace_lock);
+    return trace_events;
 }
 
-vector<vector<Pixel>> process_06 (vector<vector<Pixel>> image_file, float scale_x, float scale_y)
+void print_instrumentation_summary(ostream& out)
 /**
- * Scales the image larger or smaller
- * @param image_file Image that will be scaled
- * @param scale_x Amount to scale the image by on the x axis
- * @param scale_y Amount to scale the image by on the y axis
+ * Prints one row per function recorded, in the order each first finished
+ * Calls made inside another recorded call, such as the geometric steps
+ * of a pipeline, also count towards the outer one
+ * @param out Stream to print the table to
  */
 {
-    // Prevents dividing by zero
-    if (scale_x == 0 || scale_y == 0)
+    vector<TraceEvent> events = recorded_events();
+    struct Row
     {
-        cout << "Cannot scale by 0. 0 value will default to 1." << endl;
-        if (scale_x == 0)
+        const char* category;
+        const char* name;
+        int calls;
+        double seconds;
+        double longest;
+        long long pixels;
+        long long allocations;
+        long long bytes;
+        long long peak_rss;
+    };
+    vector<Row> rows;
+    for (size_t e = 0; e < events.size(); e++)
+    {
+        const TraceEvent& event = events[e];
+        size_t r = 0;
+        while (r < rows.size() && !(strcmp(rows[r].category, event.category) == 0 && strcmp(rows[r].name, event.name) == 0))
         {
-            scale_x = 1;
+            r++;
         }
-        if (scale_y == 0)
+        if (r == rows.size())
         {
-            scale_y = 1;
+            Row row = {event.category, event.name, 0, 0, 0, 0, 0, 0, 0};
+            rows.push_back(row);
         }
+        Row& row = rows[r];
+        row.calls++;
+        row.seconds += event.duration;
+        row.longest = max(row.longest, event.duration);
+        row.pixels += event.pixels;
+        row.allocations += event.allocations;
+        row.bytes += event.bytes;
+        row.peak_rss = max(row.peak_rss, event.peak_rss);
     }
 
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-    // Creates a new vector that is the size of the scaled image
-    int scaled_height = static_cast<int>(round(file_height * scale_y));
-    int scaled_width = static_cast<int>(round(file_width * scale_x));
-    vector<vector<Pixel>> scaled_image (scaled_height, 
-                                        vector<Pixel> (scaled_width)); 
+    char line[200];
+    snprintf(line, sizeof(line), "%-8s %-24s %6s %11s %11s %10s %9s %12s %10s",
+             "stage", "function", "calls", "total ms", "longest ms", "Mpixel/s", "allocs", "alloc bytes", "peak MB");
+    out << line << '\n';
+    for (size_t r = 0; r < rows.size(); r++)
+    {
+        const Row& row = rows[r];
+        double rate = row.seconds > 0 ? row.pixels / row.seconds / 1e6 : 0;
+        snprintf(line, sizeof(line), "%-8s %-24s %6d %11.3f %11.3f %10.1f %9lld %12lld %10.1f",
+                 row.category, row.name, row.calls, row.seconds * 1e3, row.longest * 1e3, rate,
+                 row.allocations, row.bytes, row.peak_rss / (1024.0 * 1024.0));
+        out << line << '\n';
+    }
+    if (rows.empty())
+    {
+        out << "Nothing recorded" << '\n';
+    }
+}
 
-    // Loops over the newly created blank image
-    for (int y = 0; y < scaled_height; y++)
+bool write_chrome_trace(const string& path)
+/**
+ * Writes the recorded events as Chrome trace JSON
+ * @param path File to write
+ * @return True if successful and false otherwise
+ */
+{
+    vector<TraceEvent> events = recorded_events();
+    ofstream out(path.c_str());
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t e = 0; e < events.size(); e++)
     {
-        for (int x = 0; x < scaled_width; x++)
-        {
-            // Estimates the closest old pixel and copies 
-            // to the resized version
-            int descaled_height = static_cast<int>(round(y/scale_y));
-            int descaled_width = static_cast<int>(round(x/scale_x));
+        const TraceEvent& event = events[e];
+        char line[400];
+        // Names are fixed strings, so they need no escaping
+        snprintf(line, sizeof(line),
+                 "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"args\":{\"pixels\":%lld,\"allocations\":%lld,\"bytes\":%lld,\"peak_rss\":%lld}}",
+                 e == 0 ? "" : ",", event.name, event.category, event.thread, event.start * 1e6, event.duration * 1e6,
+                 event.pixels, event.allocations, event.bytes, event.peak_rss);
+        out << line;
+    }
+    out << "\n]}\n";
+    return out.good();
+}
 
-            // Preventing this from rounding up over out of bounds
-            while (descaled_height > file_height-1){
-                descaled_height--;
-            }
-            while (descaled_width > file_width-1){
-                descaled_width--;
-            }
-            Pixel rgb = image_file[descaled_height][descaled_width];
-            scaled_image[y][x] = rgb;
 
-        }
-    }    
-    cout << "Executed Process 06: Scaled image " << scale_x << " by " << scale_y << endl;
-    return scaled_image;
-}
+// Size of the BMP file header plus the BITMAPINFOHEADER
+const int BMP_MIN_HEADER_SIZE = 54;
+
+// Size of the BMP file header plus the BITMAPV4HEADER that 32 bit files
+// use to mark their fourth channel as alpha
+const int BMP_V4_HEADER_SIZE = 122;
+
+// Size of the BMP file header plus the largest DIB header, BITMAPV5HEADER
+const int BMP_MAX_HEADER_SIZE = 138;
+
+// 8 bit files follow their DIB header with a palette of 256 colours,
+// write_bmp() gives single channel images one that maps each value to its grey
+const int BMP_GREY_PALETTE_SIZE = 256 * 4;
+const int BMP_GREY_HEADER_SIZE = BMP_MIN_HEADER_SIZE + BMP_GREY_PALETTE_SIZE;
+
+// Compression methods for uncompressed pixels
+const int BMP_BI_RGB = 0;
+const int BMP_BI_BITFIELDS = 3;
+const int BMP_BI_ALPHABITFIELDS = 6;
 
-vector<vector<Pixel>> process_07 (vector<vector<Pixel>> image_file)
 /**
- * Changes the high contrast black and white
- * @param image_file The image file to be editted
+ * Read only view of the whole contents of a file
+ * Uses a memory mapping when available so no bytes are copied,
+ * otherwise the file is loaded with one bulk read
  */
+class FileBuffer
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
+public:
+    FileBuffer() : mapped_data(NULL), mapped_size(0) {}
+    ~FileBuffer() { close(); }
 
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
+    bool open(const string& filename);
+    void close();
+
+    const unsigned char* data() const
     {
-        for (int x = 0; x < file_width; x++)
-        {
-            Pixel rgb = image_file[y][x];
+        return mapped_data != NULL ? mapped_data : (bytes.empty() ? NULL : &bytes[0]);
+    }
+    size_t size() const
+    {
+        return mapped_data != NULL ? mapped_size : bytes.size();
+    }
 
-            // Calculates average greyscale value
+private:
+    // Copying would double unmap the file
+    FileBuffer(const FileBuffer&);
+    FileBuffer& operator=(const FileBuffer&);
+
+    unsigned char* mapped_data;     // Start of the memory mapping, NULL if not mapped
+    size_t mapped_size;             // Length of the memory mapping
+    vector<unsigned char> bytes;    // File contents when it could not be mapped
+};
+
+bool FileBuffer::open(const string& filename)
+/**
+ * Maps or reads the file into memory
+ * @param filename The file to open
+ * @return True if the file contents are available
+ */
+{
+    close();
+
+#ifdef IMAGE_HAVE_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            // Pixels are decoded front to back, let the kernel read ahead
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+            mapped_data = static_cast<unsigned char*>(map);
+            mapped_size = info.st_size;
+        }
+    }
+    ::close(fd);
+    if (mapped_data != NULL)
+    {
+        return true;
+    }
+#endif
+
+    // Fall back to a single bulk read of the file
+    ifstream stream(filename.c_str(), ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    streamoff length = stream.tellg();
+    if (length <= 0)
+    {
+        return false;
+    }
+    bytes.resize(static_cast<size_t>(length));
+    stream.seekg(0, ios::beg);
+    stream.read(reinterpret_cast<char*>(&bytes[0]), length);
+    if (stream.gcount() != length)
+    {
+        bytes.clear();
+        return false;
+    }
+    return true;
+}
+
+void FileBuffer::close()
+/**
+ * Releases the mapping or the buffered bytes
+ */
+{
+#ifdef IMAGE_HAVE_MMAP
+    if (mapped_data != NULL)
+    {
+        munmap(mapped_data, mapped_size);
+    }
+#endif
+    mapped_data = NULL;
+    mapped_size = 0;
+    bytes.clear();
+}
+
+int get_int(const unsigned char* buffer, int offset, int bytes)
+/**
+ * Gets a little endian integer from a buffer in memory
+ * Same as get_int() but without seeking a stream
+ * @param buffer The buffer holding the file
+ * @param offset The offset at which to read the integer
+ * @param bytes  The number of bytes to read
+ * @return the integer starting at the given offset
+ */
+{
+    unsigned int result = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        result = result | (static_cast<unsigned int>(buffer[offset + i]) << (i * 8));
+    }
+    return static_cast<int>(result);
+}
+
+// Image properties read from the BMP and DIB headers
+struct BmpHeader
+{
+    long long file_size;    // Size of the BMP file in bytes, as stored in the header
+    int start;              // Offset of the pixel array
+    int width;              // Width in pixels
+    int height;             // Height in pixels
+    int bits_per_pixel;     // 8 for grey, 24 for BGR, 32 for BGRA
+    int scanline_size;      // Bytes of pixel data in a row
+    int padding;            // Bytes added to each row for 4 byte alignment
+    bool alpha;             // The fourth byte of 32 bit pixels is alpha
+    bool grey;              // 8 bit pixels index a palette of greys, so each is its own grey
+};
+
+bool parse_bmp_header(const unsigned char* buffer, size_t size, long long file_length, BmpHeader& header)
+/**
+ * Reads and validates the headers at the start of a BMP file
+ * Uses the same offsets and size check as read_image()
+ * @param buffer      The first bytes of the file
+ * @param size        The number of bytes in the buffer
+ * @param file_length The length of the whole file
+ * @param header      Filled with the image properties
+ * @return True if this is a valid image that can be decoded
+ */
+{
+    if (buffer == NULL || size < static_cast<size_t>(BMP_MIN_HEADER_SIZE)
+        || buffer[0] != 'B' || buffer[1] != 'M')
+    {
+        return false;
+    }
+
+    // Get the image properties
+    header.file_size = static_cast<unsigned int>(get_int(buffer, 2, 4));
+    header.start = get_int(buffer, 10, 4);
+    header.width = get_int(buffer, 18, 4);
+    header.height = get_int(buffer, 22, 4);
+    header.bits_per_pixel = get_int(buffer, 28, 2);
+    int dib_size = get_int(buffer, 14, 4);
+    int compression = get_int(buffer, 30, 4);
+
+    // Only uncompressed BGR and BGRA pixels and 8 bit greys are supported, and
+    // top down images (negative height) are rejected like read_image() does
+    if ((header.bits_per_pixel != 8 && header.bits_per_pixel != 24 && header.bits_per_pixel != 32)
+        || header.width <= 0 || header.height <= 0 || header.start < BMP_MIN_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    // 32 bit pixels can describe their layout with masks, which follow the
+    // BITMAPINFOHEADER or sit inside the larger headers at the same offset
+    // The fourth byte only holds alpha when a mask says so, otherwise it is unused
+    header.alpha = false;
+    if (compression == BMP_BI_BITFIELDS || compression == BMP_BI_ALPHABITFIELDS)
+    {
+        int masks = compression == BMP_BI_ALPHABITFIELDS || dib_size >= 56 ? 4 : 3;
+        if (header.bits_per_pixel != 32 || size < static_cast<size_t>(54 + masks * 4)
+            || header.start < 14 + max(dib_size, 40) + (dib_size == 40 ? masks * 4 : 0)
+            || get_int(buffer, 54, 4) != 0x00FF0000 || get_int(buffer, 58, 4) != 0x0000FF00
+            || get_int(buffer, 62, 4) != 0x000000FF)
+        {
+            return false;
+        }
+        int alpha_mask = masks == 4 ? get_int(buffer, 66, 4) : 0;
+        if (alpha_mask != 0 && alpha_mask != static_cast<int>(0xFF000000))
+        {
+            return false;
+        }
+        header.alpha = alpha_mask != 0;
+    } else if (compression != BMP_BI_RGB)
+    {
+        return false;
+    }
+
+    // 8 bit files are only read when their palette is the ramp of greys
+    // write_bmp() uses, where a pixel value is its own grey
+    header.grey = header.bits_per_pixel == 8;
+    if (header.grey)
+    {
+        int colours = get_int(buffer, 46, 4);
+        colours = colours == 0 ? 256 : colours;
+        int palette = 14 + dib_size;
+        if (colours > 256 || dib_size < 40 || header.start < palette + colours * 4
+            || size < static_cast<size_t>(palette + colours * 4))
+        {
+            return false;
+        }
+        for (int i = 0; i < colours; i++)
+        {
+            const unsigned char* entry = buffer + palette + i * 4;
+            if (entry[0] != i || entry[1] != i || entry[2] != i)
+            {
+                return false;
+            }
+        }
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    long long scanline_size = static_cast<long long>(header.width) * (header.bits_per_pixel / 8);
+    long long padding = 0;
+    if (scanline_size % 4 != 0)
+    {
+        padding = 4 - scanline_size % 4;
+    }
+
+    // Not a valid image if the header size does not match the pixel array,
+    // or if the file is shorter than the header claims
+    // Note: files of 4GB and more can only store their size modulo 2^32
+    long long expected_size = header.start + (scanline_size + padding) * header.height;
+    if (header.file_size != (expected_size & 0xFFFFFFFFLL) || file_length < expected_size)
+    {
+        return false;
+    }
+
+    header.scanline_size = static_cast<int>(scanline_size);
+    header.padding = static_cast<int>(padding);
+    return true;
+}
+
+bool read_bmp_header(const unsigned char* buffer, size_t size, BmpHeader& header)
+/**
+ * Reads and validates the headers of a BMP file held in memory
+ * @param buffer The buffer holding the whole file
+ * @param size   The number of bytes in the buffer
+ * @param header Filled with the image properties
+ * @return True if this is a valid image that can be decoded
+ */
+{
+    return parse_bmp_header(buffer, size, static_cast<long long>(size), header);
+}
+
+vector<vector<Pixel>> read_image_fast(string filename)
+/**
+ * Reads the BMP image specified and returns the resulting image as a vector
+ * Produces the same image as read_image(), but maps the whole file
+ * once and decodes it a scan line at a time instead of seeking per pixel
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels, empty if invalid
+ */
+{
+    FileBuffer file;
+    BmpHeader header;
+    if (!file.open(filename) || !read_bmp_header(file.data(), file.size(), header))
+    {
+        return {};
+    }
+
+    int width = header.width;
+    int height = header.height;
+    int bytes_per_pixel = header.bits_per_pixel / 8;
+    int row_bytes = header.scanline_size + header.padding;
+    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+
+    // BMP files store pixels from bottom to top in blue, green, red order
+    const unsigned char* scanline = file.data() + header.start;
+    for (int i = height - 1; i >= 0; i--)
+    {
+        const unsigned char* source = scanline;
+        Pixel* row = &image[i][0];
+        for (int j = 0; j < width; j++)
+        {
+            // Grey files hold one value per pixel
+            row[j].blue = source[0];
+            row[j].green = source[header.grey ? 0 : 1];
+            row[j].red = source[header.grey ? 0 : 2];
+
+            // We are ignoring the alpha channel if there is one
+            source += bytes_per_pixel;
+        }
+        scanline += row_bytes;
+    }
+    return image;
+}
+
+// Byte offsets of the channels inside an interleaved pixel
+// Note: BMP files store pixels in blue, green, red order
+const int CHANNEL_BLUE = 0;
+const int CHANNEL_GREEN = 1;
+const int CHANNEL_RED = 2;
+const int CHANNEL_ALPHA = 3;    // Only in images with 4 channels
+
+// Pixel with transparency, alpha 0 is clear and 255 is opaque
+struct PixelRGBA
+{
+    int red;
+    int green;
+    int blue;
+    int alpha;
+};
+
+/**
+ * Window onto a rectangle of an image's pixels, nothing is copied
+ * Rows keep the stride of the image they come from, so a view is an
+ * origin, an extent and a stride, and is only valid while the image is
+ */
+struct ImageView
+{
+    unsigned char* data;    // First channel of the top left pixel
+    int width;              // Width in pixels
+    int height;             // Height in pixels
+    int channels;           // Bytes per pixel
+    int stride;             // Bytes from the start of one row to the next
+
+    bool empty() const { return width <= 0 || height <= 0; }
+    unsigned char* row(int y) const { return data + static_cast<ptrdiff_t>(y) * stride; }
+    unsigned char* pixel(int y, int x) const { return row(y) + x * channels; }
+};
+
+// Read only version of ImageView
+struct ConstImageView
+{
+    const unsigned char* data;
+    int width;
+    int height;
+    int channels;
+    int stride;
+
+    bool empty() const { return width <= 0 || height <= 0; }
+    const unsigned char* row(int y) const { return data + static_cast<ptrdiff_t>(y) * stride; }
+    const unsigned char* pixel(int y, int x) const { return row(y) + x * channels; }
+};
+
+/**
+ * Image stored in a single contiguous buffer with 8 bit channels
+ * Pixels are interleaved in blue, green, red order like a BMP scan line
+ * and every row starts at a multiple of four bytes (stride), so
+ * rows can be copied to and from a BMP file without any conversion
+ * Images with 4 channels add straight (not premultiplied) alpha
+ * Images with 1 channel hold only greys, they come from greyscale_into()
+ * and are meant for writing out, the filters expect 3 or 4 channels
+ * Row 0 is the top of the image, same as vector<vector<Pixel>>
+ */
+struct Image
+{
+    // Note: padding bytes at the end of each row are kept zero
+    int width;                      // Width in pixels
+    int height;                     // Height in pixels
+    int channels;                   // Bytes per pixel
+    int stride;                     // Bytes from the start of one row to the next
+    vector<unsigned char> data;     // All rows, top to bottom
+
+    Image() : width(0), height(0), channels(3), stride(0) {}
+    Image(int image_width, int image_height, int image_channels = 3) : width(0), height(0), channels(3), stride(0)
+    {
+        resize(image_width, image_height, image_channels);
+    }
+
+    void resize(int image_width, int image_height, int image_channels = 3)
+    /**
+     * Changes the size, reusing the buffer when it is big enough
+     * Pixels are left as they were in the buffer, the caller writes them,
+     * but the padding of every row is cleared when the layout changes
+     */
+    {
+        bool same = image_width == width && image_height == height && image_channels == channels;
+        width = image_width;
+        height = image_height;
+        channels = image_channels;
+        stride = (width * channels + 3) / 4 * 4;
+        data.resize(static_cast<size_t>(stride) * height);
+        int row_bytes = width * channels;
+        if (!same && stride > row_bytes)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                memset(row(y) + row_bytes, 0, stride - row_bytes);
+            }
+        }
+    }
+
+    bool empty() const { return width <= 0 || height <= 0; }
+    size_t pixel_count() const { return static_cast<size_t>(width) * height; }
+
+    // Row views, pointing at the first channel of the first pixel
+    unsigned char* row(int y) { return &data[static_cast<size_t>(y) * stride]; }
+    const unsigned char* row(int y) const { return &data[static_cast<size_t>(y) * stride]; }
+
+    // Pixel views, index with CHANNEL_BLUE, CHANNEL_GREEN and CHANNEL_RED
+    unsigned char* pixel(int y, int x) { return row(y) + x * channels; }
+    const unsigned char* pixel(int y, int x) const { return row(y) + x * channels; }
+
+    Pixel get_pixel(int y, int x) const
+    {
+        const unsigned char* p = pixel(y, x);
+        Pixel rgb = {p[CHANNEL_RED], p[CHANNEL_GREEN], p[CHANNEL_BLUE]};
+        return rgb;
+    }
+    void set_pixel(int y, int x, const Pixel& rgb)
+    {
+        // Same narrowing to a byte that write_image() does
+        unsigned char* p = pixel(y, x);
+        p[CHANNEL_RED] = static_cast<unsigned char>(rgb.red);
+        p[CHANNEL_GREEN] = static_cast<unsigned char>(rgb.green);
+        p[CHANNEL_BLUE] = static_cast<unsigned char>(rgb.blue);
+    }
+
+    // Views of a rectangle, which must lie inside the image
+    ImageView view(int x, int y, int view_width, int view_height)
+    {
+        ImageView window = {pixel(y, x), view_width, view_height, channels, stride};
+        return window;
+    }
+    ConstImageView view(int x, int y, int view_width, int view_height) const
+    {
+        ConstImageView window = {pixel(y, x), view_width, view_height, channels, stride};
+        return window;
+    }
+
+    bool has_alpha() const { return channels == 4; }
+    PixelRGBA get_rgba(int y, int x) const
+    {
+        const unsigned char* p = pixel(y, x);
+        PixelRGBA rgba = {p[CHANNEL_RED], p[CHANNEL_GREEN], p[CHANNEL_BLUE], has_alpha() ? p[CHANNEL_ALPHA] : 255};
+        return rgba;
+    }
+    void set_rgba(int y, int x, const PixelRGBA& rgba)
+    {
+        // Images without alpha keep only the colour
+        unsigned char* p = pixel(y, x);
+        p[CHANNEL_RED] = static_cast<unsigned char>(rgba.red);
+        p[CHANNEL_GREEN] = static_cast<unsigned char>(rgba.green);
+        p[CHANNEL_BLUE] = static_cast<unsigned char>(rgba.blue);
+        if (has_alpha())
+        {
+            p[CHANNEL_ALPHA] = static_cast<unsigned char>(rgba.alpha);
+        }
+    }
+};
+
+/**
+ * Image stored as three separate red, green and blue planes
+ * Useful for filters that work on one channel at a time
+ */
+struct PlanarImage
+{
+    int width;                      // Width in pixels
+    int height;                     // Height in pixels
+    int stride;                     // Bytes from the start of one plane row to the next
+    vector<unsigned char> red;      // Red plane, top to bottom
+    vector<unsigned char> green;    // Green plane, top to bottom
+    vector<unsigned char> blue;     // Blue plane, top to bottom
+
+    PlanarImage() : width(0), height(0), stride(0) {}
+    PlanarImage(int image_width, int image_height)
+    {
+        resize(image_width, image_height);
+    }
+
+    void resize(int image_width, int image_height)
+    {
+        width = image_width;
+        height = image_height;
+        stride = (width + 3) / 4 * 4;
+        size_t plane_size = static_cast<size_t>(stride) * height;
+        red.resize(plane_size);
+        green.resize(plane_size);
+        blue.resize(plane_size);
+    }
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    // Plane row views, channel is CHANNEL_BLUE, CHANNEL_GREEN or CHANNEL_RED
+    unsigned char* row(int channel, int y)
+    {
+        vector<unsigned char>& plane = channel == CHANNEL_RED ? red : (channel == CHANNEL_GREEN ? green : blue);
+        return &plane[static_cast<size_t>(y) * stride];
+    }
+    const unsigned char* row(int channel, int y) const
+    {
+        const vector<unsigned char>& plane = channel == CHANNEL_RED ? red : (channel == CHANNEL_GREEN ? green : blue);
+        return &plane[static_cast<size_t>(y) * stride];
+    }
+};
+
+//
+// Image pool
+// Keeps the buffers of images that are finished with, so the next image
+// of about the same size takes one instead of allocating. Buffers this
+// large come straight from the operating system, so without the pool
+// every file of a batch and every temporary of a pipeline maps, zeroes
+// and unmaps fresh pages.
+//
+
+// Free buffers the pool keeps, the oldest are let go beyond this
+const size_t IMAGE_POOL_BUFFERS = 16;
+
+// Counts kept by ImagePool
+struct ImagePoolStats
+{
+    long long hits;                 // Requests met by a kept buffer, or the image's own
+    long long misses;               // Requests that allocated a new buffer
+    long long allocated_bytes;      // Bytes allocated by misses
+    long long pooled_bytes;         // Bytes in kept buffers now
+    long long peak_pooled_bytes;    // Most bytes kept at once
+    long long dropped;              // Buffers let go because the pool was full
+};
+
+/**
+ * Thread safe store of image buffers for reuse
+ * Images taken from the pool hold whatever pixels the buffer had before,
+ * only the row padding is cleared by Image::resize(), so they are for
+ * writing every pixel
+ */
+class ImagePool
+{
+public:
+    ImagePool() { memset(&stats, 0, sizeof(stats)); }
+
+    Image acquire(int width, int height, int channels = 3)
+    /**
+     * Gets an image of the given size, from a kept buffer if one fits
+     */
+    {
+        Image image;
+        resize(image, width, height, channels);
+        return image;
+    }
+
+    void resize(Image& image, int width, int height, int channels = 3)
+    /**
+     * Resizes an image, swapping its buffer for a kept one if it is too small
+     * The buffer it had goes back to the pool
+     */
+    {
+        size_t bytes = static_cast<size_t>((width * channels + 3) / 4 * 4) * max(height, 0);
+        if (image.data.capacity() >= bytes)
+        {
+            lock_guard<mutex> lock(pool_lock);
+            stats.hits++;
+        } else
+        {
+            vector<unsigned char> buffer;
+            take(buffer, bytes);
+            image.data.swap(buffer);
+            give(buffer);
+
+            // The kept buffer's rows have some other layout, so resize must clear their padding
+            image.width = 0;
+        }
+        image.resize(width, height, channels);
+    }
+
+    void release(Image& image)
+    /**
+     * Gives the buffer of an image back to the pool, the image becomes empty
+     */
+    {
+        vector<unsigned char> buffer;
+        buffer.swap(image.data);
+        image = Image();
+        give(buffer);
+    }
+
+    void clear()
+    /**
+     * Frees every kept buffer
+     */
+    {
+        lock_guard<mutex> lock(pool_lock);
+        free_buffers.clear();
+        stats.pooled_bytes = 0;
+    }
+
+    ImagePoolStats get_stats()
+    {
+        lock_guard<mutex> lock(pool_lock);
+        return stats;
+    }
+    void reset_stats()
+    {
+        lock_guard<mutex> lock(pool_lock);
+        long long pooled = stats.pooled_bytes;
+        memset(&stats, 0, sizeof(stats));
+        stats.pooled_bytes = stats.peak_pooled_bytes = pooled;
+    }
+
+private:
+    void take(vector<unsigned char>& buffer, size_t bytes)
+    /**
+     * Moves the smallest kept buffer that holds bytes into buffer, or allocates one
+     * Buffers more than twice the size asked for are not used, they would waste memory
+     */
+    {
+        {
+            lock_guard<mutex> lock(pool_lock);
+            size_t best = free_buffers.size();
+            for (size_t i = 0; i < free_buffers.size(); i++)
+            {
+                size_t capacity = free_buffers[i].capacity();
+                if (capacity >= bytes && capacity <= 2 * bytes
+                    && (best == free_buffers.size() || capacity < free_buffers[best].capacity()))
+                {
+                    best = i;
+                }
+            }
+            if (best < free_buffers.size())
+            {
+                stats.hits++;
+                stats.pooled_bytes -= free_buffers[best].capacity();
+                buffer.swap(free_buffers[best]);
+                free_buffers.erase(free_buffers.begin() + best);
+                return;
+            }
+            stats.misses++;
+            stats.allocated_bytes += bytes;
+        }
+        buffer.reserve(bytes);
+    }
+
+    void give(vector<unsigned char>& buffer)
+    /**
+     * Keeps a buffer, letting go of the oldest when the pool is full
+     */
+    {
+        if (buffer.capacity() == 0)
+        {
+            return;
+        }
+        // Declared before the lock, so a buffer let go is freed after unlocking
+        vector<unsigned char> oldest;
+        lock_guard<mutex> lock(pool_lock);
+        stats.pooled_bytes += buffer.capacity();
+        free_buffers.push_back(vector<unsigned char>());
+        free_buffers.back().swap(buffer);
+        if (free_buffers.size() > IMAGE_POOL_BUFFERS)
+        {
+            oldest.swap(free_buffers.front());
+            free_buffers.pop_front();
+            stats.pooled_bytes -= oldest.capacity();
+            stats.dropped++;
+        }
+        stats.peak_pooled_bytes = max(stats.peak_pooled_bytes, stats.pooled_bytes);
+    }
+
+    deque<vector<unsigned char> > free_buffers;
+    ImagePoolStats stats;
+    mutex pool_lock;
+};
+
+// Shared by the menu, batches and the temporaries of pipelines
+ImagePool image_pool;
+
+void print_image_pool_stats(ostream& out)
+/**
+ * Prints how often image_pool had a buffer ready and how much it keeps
+ */
+{
+    ImagePoolStats stats = image_pool.get_stats();
+    char line[200];
+    snprintf(line, sizeof(line), "Image pool: %lld hits, %lld misses, %.1f MB allocated, %.1f MB kept, %.1f MB kept at most, %lld let go",
+             stats.hits, stats.misses, stats.allocated_bytes / (1024.0 * 1024.0), stats.pooled_bytes / (1024.0 * 1024.0),
+             stats.peak_pooled_bytes / (1024.0 * 1024.0), stats.dropped);
+    out << line << endl;
+}
+
+Image to_image(const vector<vector<Pixel>>& image_file)
+/**
+ * Copies a vector of vector of Pixels into a contiguous image
+ * @param image_file The image to copy
+ * @return the same image with 8 bit interleaved channels
+ */
+{
+    if (image_file.empty() || image_file[0].empty())
+    {
+        return Image();
+    }
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+    Image image(file_width, file_height);
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            image.set_pixel(y, x, image_file[y][x]);
+        }
+    }
+    return image;
+}
+
+vector<vector<Pixel>> to_pixels(const Image& image)
+/**
+ * Copies a contiguous image into a vector of vector of Pixels
+ * @param image The image to copy
+ * @return the same image as a vector of vector of Pixels
+ */
+{
+    vector<vector<Pixel>> image_file(image.height, vector<Pixel> (image.width));
+    for (int y = 0; y < image.height; y++)
+    {
+        for (int x = 0; x < image.width; x++)
+        {
+            image_file[y][x] = image.get_pixel(y, x);
+        }
+    }
+    return image_file;
+}
+
+PlanarImage to_planar(const Image& image)
+/**
+ * Splits an interleaved image into red, green and blue planes
+ * @param image The interleaved image
+ * @return the planar copy of the image
+ */
+{
+    PlanarImage planar(image.width, image.height);
+    for (int y = 0; y < image.height; y++)
+    {
+        const unsigned char* source = image.row(y);
+        unsigned char* red = planar.row(CHANNEL_RED, y);
+        unsigned char* green = planar.row(CHANNEL_GREEN, y);
+        unsigned char* blue = planar.row(CHANNEL_BLUE, y);
+        for (int x = 0; x < image.width; x++)
+        {
+            blue[x] = source[CHANNEL_BLUE];
+            green[x] = source[CHANNEL_GREEN];
+            red[x] = source[CHANNEL_RED];
+            source += image.channels;
+        }
+    }
+    return planar;
+}
+
+Image to_interleaved(const PlanarImage& planar)
+/**
+ * Merges red, green and blue planes into an interleaved image
+ * @param planar The planar image
+ * @return the interleaved copy of the image
+ */
+{
+    Image image(planar.width, planar.height);
+    for (int y = 0; y < planar.height; y++)
+    {
+        unsigned char* target = image.row(y);
+        const unsigned char* red = planar.row(CHANNEL_RED, y);
+        const unsigned char* green = planar.row(CHANNEL_GREEN, y);
+        const unsigned char* blue = planar.row(CHANNEL_BLUE, y);
+        for (int x = 0; x < planar.width; x++)
+        {
+            target[CHANNEL_BLUE] = blue[x];
+            target[CHANNEL_GREEN] = green[x];
+            target[CHANNEL_RED] = red[x];
+            target += image.channels;
+        }
+    }
+    return image;
+}
+
+bool read_bmp_into(const string& filename, Image& image, ImagePool* pool = NULL)
+/**
+ * Reads the BMP image specified straight into a contiguous image
+ * Holds the same pixels as read_image() at a quarter of the memory
+ * 32 bit files with an alpha mask keep their alpha as a fourth channel,
+ * 8 bit grey files are expanded to three channels
+ * @param filename BMP image filename
+ * @param image    Receives the image, its buffer is reused if big enough
+ * @param pool     Where a bigger buffer comes from, NULL to allocate it
+ * @return True if the file is a valid image, otherwise the image is empty
+ */
+{
+    TraceScope trace("read", "read_bmp");
+    FileBuffer file;
+    BmpHeader header;
+    if (!file.open(filename) || !read_bmp_header(file.data(), file.size(), header))
+    {
+        image.resize(0, 0);
+        return false;
+    }
+
+    if (pool)
+    {
+        pool->resize(image, header.width, header.height, header.alpha ? 4 : 3);
+    } else
+    {
+        image.resize(header.width, header.height, header.alpha ? 4 : 3);
+    }
+    int bytes_per_pixel = header.bits_per_pixel / 8;
+    int row_bytes = header.scanline_size + header.padding;
+
+    // BMP files store pixels from bottom to top
+    const unsigned char* scanline = file.data() + header.start;
+    for (int y = header.height - 1; y >= 0; y--)
+    {
+        unsigned char* target = image.row(y);
+        if (bytes_per_pixel == image.channels)
+        {
+            // Scan line layout matches the image row, the padding stays zero
+            memcpy(target, scanline, header.scanline_size);
+        } else if (header.grey)
+        {
+            for (int x = 0; x < header.width; x++)
+            {
+                target[CHANNEL_BLUE] = target[CHANNEL_GREEN] = target[CHANNEL_RED] = scanline[x];
+                target += image.channels;
+            }
+        } else
+        {
+            // Unused fourth bytes are dropped
+            const unsigned char* source = scanline;
+            for (int x = 0; x < header.width; x++)
+            {
+                target[CHANNEL_BLUE] = source[CHANNEL_BLUE];
+                target[CHANNEL_GREEN] = source[CHANNEL_GREEN];
+                target[CHANNEL_RED] = source[CHANNEL_RED];
+                source += bytes_per_pixel;
+                target += image.channels;
+            }
+        }
+        scanline += row_bytes;
+    }
+    trace.set_pixels(image.pixel_count());
+    return true;
+}
+
+Image read_bmp(string filename)
+/**
+ * Reads the BMP image specified into a new image, see read_bmp_into()
+ * @param filename BMP image filename
+ * @return the image, empty if it is not a valid image
+ */
+{
+    Image image;
+    read_bmp_into(filename, image);
+    return image;
+}
+
+// Options for write_image_fast() and write_bmp()
+struct BmpWriteOptions
+{
+    bool whole_file;    // Assemble the whole file in memory and write it at once
+    bool preallocate;   // Reserve the final file size before writing the pixels
+
+    BmpWriteOptions() : whole_file(false), preallocate(false) {}
+};
+
+int bmp_header_size(int channels)
+/**
+ * Gets the size of the headers write_bmp() uses for an image
+ * @param channels Bytes per pixel of the image
+ * @return the offset of the pixel array
+ */
+{
+    if (channels == 1)
+    {
+        return BMP_GREY_HEADER_SIZE;
+    }
+    return channels == 4 ? BMP_V4_HEADER_SIZE : BMP_MIN_HEADER_SIZE;
+}
+
+void set_bmp_headers(unsigned char headers[], int width_pixels, int height_pixels, long long array_bytes, int channels = 3)
+/**
+ * Fills in the BMP and DIB headers exactly as write_image() does
+ * Images with alpha get a BITMAPV4HEADER with masks for 32 bit BGRA,
+ * single channel images 8 bit pixels and a palette of greys
+ * @param headers       Array of bmp_header_size(channels) bytes to set
+ * @param width_pixels  Width of the image in pixels
+ * @param height_pixels Height of the image in pixels
+ * @param array_bytes   Pixel array size in bytes, including padding
+ * @param channels      Bytes per pixel, 1, 3 or 4
+ */
+{
+    const int BMP_HEADER_SIZE = 14;
+    const int PALETTE_SIZE = channels == 1 ? BMP_GREY_PALETTE_SIZE : 0;
+    const int DIB_HEADER_SIZE = bmp_header_size(channels) - BMP_HEADER_SIZE - PALETTE_SIZE;
+    unsigned char* bmp_header = headers;
+    unsigned char* dib_header = headers + BMP_HEADER_SIZE;
+    memset(headers, 0, BMP_HEADER_SIZE + DIB_HEADER_SIZE + PALETTE_SIZE);
+
+    // Sizes of 4GB and more are stored modulo 2^32
+    int file_bytes = static_cast<int>(static_cast<unsigned int>(BMP_HEADER_SIZE + DIB_HEADER_SIZE + PALETTE_SIZE + array_bytes));
+    int stored_array_bytes = static_cast<int>(static_cast<unsigned int>(array_bytes));
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, file_bytes);       // Size of BMP file
+    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+PALETTE_SIZE); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
+    set_bytes(dib_header, 20, 4, stored_array_bytes); // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    if (channels == 4)
+    {
+        set_bytes(dib_header, 14, 2, 32);           // Number of bits per pixel
+        set_bytes(dib_header, 16, 4, BMP_BI_BITFIELDS); // Compression method, pixels described by masks
+        set_bytes(dib_header, 40, 4, 0x00FF0000);   // Red mask
+        set_bytes(dib_header, 44, 4, 0x0000FF00);   // Green mask
+        set_bytes(dib_header, 48, 4, 0x000000FF);   // Blue mask
+        set_bytes(dib_header, 52, 4, static_cast<int>(0xFF000000)); // Alpha mask
+        set_bytes(dib_header, 56, 4, 0x73524742);   // Color space, 'sRGB'
+    }
+    if (channels == 1)
+    {
+        set_bytes(dib_header, 14, 2, 8);            // Number of bits per pixel
+        set_bytes(dib_header, 32, 4, 256);          // Number of colors in the palette
+        unsigned char* palette = dib_header + DIB_HEADER_SIZE;
+        for (int i = 0; i < 256; i++)
+        {
+            // Blue, green, red and a reserved byte
+            palette[i * 4] = palette[i * 4 + 1] = palette[i * 4 + 2] = static_cast<unsigned char>(i);
+        }
+    }
+}
+
+bool open_bmp_output(fstream& stream, const string& filename, long long file_bytes, bool preallocate)
+/**
+ * Opens a BMP file for writing, optionally reserving its final size first
+ * so the file system can lay out the pixel array in one extent
+ * @param stream      The stream to open
+ * @param filename    The BMP file name to save the image to
+ * @param file_bytes  Final size of the file in bytes
+ * @param preallocate Reserve the space before writing
+ * @return True if the stream is ready for writing
+ */
+{
+    if (!preallocate)
+    {
+        stream.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+        return stream.is_open();
+    }
+
+#ifdef IMAGE_HAVE_MMAP
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    posix_fallocate(fd, 0, file_bytes);
+    ::close(fd);
+    stream.open(filename.c_str(), ios::in | ios::out | ios::binary);
+#else
+    // Extend the file by writing its last byte, then rewind
+    stream.open(filename.c_str(), ios::in | ios::out | ios::binary | ios::trunc);
+    if (stream.is_open() && file_bytes > 0)
+    {
+        stream.seekp(file_bytes - 1);
+        stream.put(0);
+        stream.seekp(0);
+    }
+#endif
+    return stream.is_open();
+}
+
+bool write_image_fast(string filename, const vector<vector<Pixel>>& image, const BmpWriteOptions& options = BmpWriteOptions())
+/**
+ * Write the input image to a BMP file name specified
+ * Produces the same file as write_image(), but assembles each padded
+ * scan line (or the whole file) in a buffer and writes it at once
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param options  Buffering and preallocation options
+ * @return True if successful and false otherwise
+ */
+{
+    if (image.empty() || image[0].empty())
+    {
+        return false;
+    }
+
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    // In 64 bits, pixel arrays can pass 2GB
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+    long long width_bytes = (static_cast<long long>(width_pixels) * 3 + 3) / 4 * 4;
+    long long array_bytes = width_bytes * height_pixels;
+    int header_bytes = bmp_header_size(3);
+    long long file_bytes = header_bytes + array_bytes;
+
+    fstream stream;
+    if (!open_bmp_output(stream, filename, file_bytes, options.preallocate))
+    {
+        return false;
+    }
+
+    // The whole file, or the headers followed by one scan line at a time
+    vector<unsigned char> buffer(static_cast<size_t>(options.whole_file ? file_bytes : width_bytes), 0);
+    size_t pos = 0;
+    if (options.whole_file)
+    {
+        set_bmp_headers(&buffer[0], width_pixels, height_pixels, array_bytes);
+        pos = header_bytes;
+    } else
+    {
+        unsigned char headers[BMP_MIN_HEADER_SIZE];
+        set_bmp_headers(headers, width_pixels, height_pixels, array_bytes);
+        stream.write(reinterpret_cast<char*>(headers), header_bytes);
+    }
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    for (int h = height_pixels - 1; h >= 0; h--)
+    {
+        unsigned char* target = &buffer[pos];
+        const Pixel* row = &image[h][0];
+        for (int w = 0; w < width_pixels; w++)
+        {
+            // Same narrowing to a byte that write_image() does
+            target[0] = static_cast<unsigned char>(row[w].blue);
+            target[1] = static_cast<unsigned char>(row[w].green);
+            target[2] = static_cast<unsigned char>(row[w].red);
+            target += 3;
+        }
+
+        // Padding bytes stay zero from when the buffer was created
+        if (options.whole_file)
+        {
+            pos += width_bytes;
+        } else
+        {
+            stream.write(reinterpret_cast<char*>(&buffer[0]), static_cast<streamsize>(width_bytes));
+        }
+    }
+    if (options.whole_file)
+    {
+        stream.write(reinterpret_cast<char*>(&buffer[0]), static_cast<streamsize>(buffer.size()));
+    }
+
+    bool written = stream.good();
+    stream.close();
+    return written;
+}
+
+bool write_bmp(string filename, const Image& image, const BmpWriteOptions& options = BmpWriteOptions())
+/**
+ * Write a contiguous image to a BMP file name specified
+ * Image rows already use the BMP scan line layout, so each row is
+ * written directly from the image buffer
+ * Images with alpha are written as 32 bit BGRA with a BITMAPV4HEADER,
+ * single channel images as 8 bit greys
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param options  Buffering and preallocation options
+ * @return True if successful and false otherwise
+ */
+{
+    TraceScope trace("write", "write_bmp", image.pixel_count());
+    if (image.empty() || (image.channels != 1 && image.channels != 3 && image.channels != 4))
+    {
+        return false;
+    }
+
+    int header_bytes = bmp_header_size(image.channels);
+    long long array_bytes = static_cast<long long>(image.stride) * image.height;
+    long long file_bytes = header_bytes + static_cast<long long>(array_bytes);
+
+    fstream stream;
+    if (!open_bmp_output(stream, filename, file_bytes, options.preallocate))
+    {
+        return false;
+    }
+
+    unsigned char headers[BMP_GREY_HEADER_SIZE];
+    set_bmp_headers(headers, image.width, image.height, array_bytes, image.channels);
+
+    if (options.whole_file)
+    {
+        // Reverse the row order into one buffer and write it at once
+        vector<unsigned char> buffer(file_bytes);
+        memcpy(&buffer[0], headers, header_bytes);
+        unsigned char* target = &buffer[header_bytes];
+        for (int h = image.height - 1; h >= 0; h--)
+        {
+            memcpy(target, image.row(h), image.stride);
+            target += image.stride;
+        }
+        stream.write(reinterpret_cast<char*>(&buffer[0]), buffer.size());
+    } else
+    {
+        // Pixel Array (Left to right, bottom to top, with padding)
+        stream.write(reinterpret_cast<char*>(headers), header_bytes);
+        for (int h = image.height - 1; h >= 0; h--)
+        {
+            stream.write(reinterpret_cast<const char*>(image.row(h)), image.stride);
+        }
+    }
+
+    bool written = stream.good();
+    stream.close();
+    return written;
+}
+
+vector<vector<Pixel>> process_01 (vector<vector<Pixel>> image_file)
+/**
+ * Adds a vignette to the image
+ * @param image_file The image file to be editted
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates vignette gradient
+            double dist_y = 1 - pow(2*abs(.5 - static_cast<double>(y)/static_cast<double>(file_height-1)),1.5);
+            double dist_x = 1 - pow(2*abs(.5 - static_cast<double>(x)/static_cast<double>(file_width-1)),1.5);
+            
+            // Applies the gradient
+            rgb.red = static_cast<int>(round(rgb.red * dist_y * dist_x));
+            rgb.green = static_cast<int>(round(rgb.green * dist_y * dist_x));
+            rgb.blue = static_cast<int>(round(rgb.blue * dist_y * dist_x));
+            image_file[y][x] = rgb;
+        }
+    }
+    cout << "Executed Process 01: Add Vignette" << endl;
+    return image_file;
+}
+
+vector<vector<Pixel>> process_02 (vector<vector<Pixel>> image_file, double scaling)
+/**
+ * Makes a high contrast version of the image
+ * If the average RGB value of the image is 
+ * greater than 170, colors will be pushed brighter
+ * and vice versa for lower than 90
+ * @param image_file The image file to be editted
+ * @param scaling Strength of the effect on the image
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates average brights and sets contrast levels
+            double average = static_cast<double>(rgb.red + rgb.green + rgb.blue)/3;
+            
+            // Increases contrast of the image
+            if (average > 170)
+            {
+                rgb.red = static_cast<int>(round(255 - (255 - rgb.red)*scaling));
+                rgb.green = static_cast<int>(round(255 - (255 - rgb.green)*scaling));
+                rgb.blue = static_cast<int>(round(255 - (255 - rgb.blue)*scaling));
+            } else if (average < 90)
+            {
+                rgb.red = static_cast<int>(round(rgb.red*scaling));
+                rgb.green = static_cast<int>(round(rgb.green*scaling));
+                rgb.blue = static_cast<int>(round(rgb.blue*scaling));
+            }
+            // Applies the changes to the image file
+            image_file[y][x] = rgb;
+
+        }
+    }
+    cout << "Executed Process 02: Claredon by factor of " << scaling << endl;
+    return image_file;
+}
+
+
+vector<vector<Pixel>> process_03 (vector<vector<Pixel>> image_file)
+/**
+ * Changes the image to greyscale
+ * @param image_file The image file to be editted
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates average greyscale value
+            int grey_val = (rgb.red + rgb.green + rgb.blue)/3;
+            
+            // Applies the gradient
+            rgb.red = grey_val;
+            rgb.green = grey_val;
+            rgb.blue = grey_val;
+            image_file[y][x] = rgb;
+
+        }
+    }
+    cout << "Executed Process 03: Greyscale" << endl;
+    return image_file;
+}
+
+
+vector<vector<Pixel>> process_04 (vector<vector<Pixel>> image_file)
+/**
+ * Rotates the image by 90 degrees
+ * @param image_file The image file to be editted
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Creates a new image that is rotated
+    vector<vector<Pixel>> rotated_image (file_width, 
+                                        vector<Pixel> (file_height)); 
+
+    // Loops through the pixels in image
+    // Looping through the dimensions of the
+    // new image and copying the old image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+            rotated_image[x][file_height-y-1] = rgb;
+
+        }
+    }
+    cout << "Executed Process 04: Rotate 90 Degrees" << endl;
+    return rotated_image;
+}
+
+
+vector<vector<Pixel>> process_05 (vector<vector<Pixel>> image_file, int turns)
+/**
+ * Rotates the image multiple times
+ * @param image_file The image file to be editted
+ * @param turns The number of times the image will be rotated
+ */
+{
+
+    cout << "Rotating 90 degrees " << turns << " times" << endl;
+    vector<vector<Pixel>> rotated_image  = image_file;
+    int num_turns = turns;
+
+    // If the image is being turned 0 times, or 360 times, we will return the 
+    // original image without turning
+    if (turns % 4 == 0 || turns == 0) 
+    {
+        return rotated_image;
+    } 
+
+    // This will count down turns and call process 04 for each count down
+    while (turns != 0)
+    {
+        // Converts counterclockwise turns to clockwise turns
+        while (turns < 0)
+        {
+            turns = turns + 4;
+        }
+        // Reduces number of turns for huge numbers
+        while (turns >= 5)
+        {
+            turns = turns - 4;
+        }
+        // Applies the number of turns after reducing to minimum
+        // number of clockwise turns
+        if (turns < 5)
+        {
+            rotated_image  = process_04(rotated_image);
+            turns--;
+        }
+        
+    }
+    cout << "Executed Process 05: Rotated 90 Degrees " << num_turns << " times" << endl;
+    return rotated_image;
+}
+
+vector<vector<Pixel>> process_06 (vector<vector<Pixel>> image_file, float scale_x, float scale_y)
+/**
+ * Scales the image larger or smaller
+ * @param image_file Image that will be scaled
+ * @param scale_x Amount to scale the image by on the x axis
+ * @param scale_y Amount to scale the image by on the y axis
+ */
+{
+    // Prevents dividing by zero
+    if (scale_x == 0 || scale_y == 0)
+    {
+        cout << "Cannot scale by 0. 0 value will default to 1." << endl;
+        if (scale_x == 0)
+        {
+            scale_x = 1;
+        }
+        if (scale_y == 0)
+        {
+            scale_y = 1;
+        }
+    }
+
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+    // Creates a new vector that is the size of the scaled image
+    int scaled_height = static_cast<int>(round(file_height * scale_y));
+    int scaled_width = static_cast<int>(round(file_width * scale_x));
+    vector<vector<Pixel>> scaled_image (scaled_height, 
+                                        vector<Pixel> (scaled_width)); 
+
+    // Loops over the newly created blank image
+    for (int y = 0; y < scaled_height; y++)
+    {
+        for (int x = 0; x < scaled_width; x++)
+        {
+            // Estimates the closest old pixel and copies 
+            // to the resized version
+            int descaled_height = static_cast<int>(round(y/scale_y));
+            int descaled_width = static_cast<int>(round(x/scale_x));
+
+            // Preventing this from rounding up over out of bounds
+            while (descaled_height > file_height-1){
+                descaled_height--;
+            }
+            while (descaled_width > file_width-1){
+                descaled_width--;
+            }
+            Pixel rgb = image_file[descaled_height][descaled_width];
+            scaled_image[y][x] = rgb;
+
+        }
+    }    
+    cout << "Executed Process 06: Scaled image " << scale_x << " by " << scale_y << endl;
+    return scaled_image;
+}
+
+vector<vector<Pixel>> process_07 (vector<vector<Pixel>> image_file)
+/**
+ * Changes the high contrast black and white
+ * @param image_file The image file to be editted
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates average greyscale value
             int grey_val = (rgb.red + rgb.green + rgb.blue)/3;
 
-            // Sets value based on average
-            if (grey_val >= 255/2)
+            // Sets value based on average
+            if (grey_val >= 255/2)
+            {
+                rgb.red = 255;
+                rgb.green = 255;
+                rgb.blue = 255;
+            } else 
+            {
+                rgb.red = 0;
+                rgb.green = 0;
+                rgb.blue = 0;
+            }
+            image_file[y][x] = rgb;
+
+        }
+    }
+    cout << "Executed Process 07: B&W" << endl;
+    return image_file;
+}
+
+vector<vector<Pixel>> process_08 (vector<vector<Pixel>> image_file, double scaling)
+/**
+ * Lightens image by the scaling factor
+ * @param image_file The image file to be editted
+ * @param scaling Strength of the effect on the image
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates lightened value with scaling factor
+            rgb.red = static_cast<int>(round(255-(255 - rgb.red)*scaling));
+            rgb.green = static_cast<int>(round(255-(255 - rgb.green)*scaling));
+            rgb.blue = static_cast<int>(round(255-(255 - rgb.blue)*scaling));
+
+            image_file[y][x] = rgb;
+
+        }
+    }
+    cout << "Executed Process 08: Lightened by factor of " << scaling << endl;
+    return image_file;
+}
+
+vector<vector<Pixel>> process_09 (vector<vector<Pixel>> image_file, double scaling)
+/**
+ * Darkens image by the scaling factor
+ * @param image_file The image file to be editted
+ * @param scaling Strength of the effect on the image
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates darkened value with scaling factor
+            rgb.red = static_cast<int>(round(rgb.red*scaling));
+            rgb.green = static_cast<int>(round(rgb.green*scaling));
+            rgb.blue = static_cast<int>(round(rgb.blue*scaling));
+
+            image_file[y][x] = rgb;
+
+        }
+    }
+    cout << "Executed Process 09: Darken by factor of " << scaling << endl;
+    return image_file;
+}
+
+vector<vector<Pixel>> process_10 (vector<vector<Pixel>> image_file)
+/**
+ * Extreme contrast, extreme satruation
+ * Black, white, RGB
+ * @param image_file The image file to be editted
+ */
+{
+    // Get the size of the image
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+
+    // Loops through the pixels in image
+    for (int y = 0; y < file_height; y++)
+    {
+        for (int x = 0; x < file_width; x++)
+        {
+            Pixel rgb = image_file[y][x];
+
+            // Calculates max values and combined values
+            vector <int> pixel_vector = {rgb.red, rgb.green, rgb.blue};
+            int max_color = distance(pixel_vector.begin(), 
+                                    max_element(pixel_vector.begin(), pixel_vector.end()));
+            int add_color = rgb.red + rgb.green + rgb.blue;
+
+            // Sets B*W values for highest contrast areas 
+            if (add_color >= 550)
+            {
+                rgb.red = 255;
+                rgb.green = 255;
+                rgb.blue = 255;
+            } else if (add_color <= 150)
+            {
+                rgb.red = 0;
+                rgb.green = 0;
+                rgb.blue = 0;                
+            } else {
+                // Sets RGB values for medium areas
+                switch (max_color) {
+                    case 0:
+                        rgb.red = 255;
+                        rgb.green = 0;
+                        rgb.blue = 0;
+                        break;  
+                    case 1:
+                        rgb.red = 0;
+                        rgb.green = 255;
+                        rgb.blue = 0;
+                        break;    
+                    case 2:
+                        rgb.red = 0;
+                        rgb.green = 0;
+                        rgb.blue = 255;  
+                        break;  
+                }
+            }
+
+            image_file[y][x] = rgb;
+
+        }
+    }
+    cout << "Executed Process 10: Black, White and RGB" << endl;
+    return image_file;
+}
+
+vector<vector<Pixel>> process_11 (const vector<vector<Pixel>>& image_file, const vector<vector<Pixel>>& layer_image, double scaling)
+{
+/**
+ * Layers one image on top of the other, using the scaling argument to blend the two
+ * Second image will be centered on the original image
+ * @param image_file The image file on the bottom
+ * @param image_file The image file layers on top
+ * @param scaling The transparency of the top image
+ */
+    // Get the size of the images
+    int file_height = image_file.size();
+    int file_width = image_file[0].size();
+    int layer_height = layer_image.size();
+    int layer_width = layer_image[0].size();
+
+    // Setting up image placement
+    // Layered image will be centered on bottom image, where it starts
+    // on the bottom image is negative if it is larger
+    int y_offset = (file_height - layer_height)/2;
+    int x_offset = (file_width - layer_width)/2;
+
+    // Crops the layer image to the same size as original image
+    // if it is larger, by only visiting the rows and columns that
+    // land on the bottom image. Removes pixels evenly from either side.
+    int first_y = max(0, -y_offset);
+    int last_y = min(layer_height, file_height - y_offset);
+    int first_x = max(0, -x_offset);
+    int last_x = min(layer_width, file_width - x_offset);
+
+    // Adds the nwe image on top of the old image using the scaling parameter
+    // to calculate transparency. Centers the layered image on top
+    vector<vector<Pixel>> layered_image = image_file;
+    for (int y = first_y; y < last_y; y++)
+    {
+        const vector<Pixel>& layer_row = layer_image[y];
+        vector<Pixel>& image_row = layered_image[y+y_offset];
+        for (int x = first_x; x < last_x; x++)
+        {
+            Pixel image_rgb = image_row[x+x_offset];
+            const Pixel& layer_rgb = layer_row[x];
+
+            image_rgb.red = image_rgb.red * (scaling) + layer_rgb.red * (1 - scaling);
+            image_rgb.green = image_rgb.green * (scaling) + layer_rgb.green * (1 - scaling);
+            image_rgb.blue = image_rgb.blue * (scaling) + layer_rgb.blue * (1 - scaling);
+
+            image_row[x+x_offset] = image_rgb;
+        }
+    }
+    cout << "Executed Process 11: Layer Images with " << scaling << " Transparency" << endl;
+    return layered_image;
+}
+
+//
+// Thread pool
+// Filters split the rows of an image into bands and run them on a shared
+// pool of worker threads. Each worker has its own queue of bands and takes
+// work from the other queues when its own runs out (work stealing).
+// Every band writes separate rows, so the result is the same as running
+// the bands one after another.
+//
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int thread_count);
+    ~ThreadPool();
+
+    // Number of threads working on a parallel_for, including the caller
+    int size() const { return static_cast<int>(threads.size()) + 1; }
+
+    void parallel_for(int count, int grain, const function<void(int, int)>& body);
+
+private:
+    // One call to parallel_for
+    struct Batch
+    {
+        const function<void(int, int)>* body;
+        int remaining;                  // Tasks not finished yet, guarded by done_lock
+        long long allocations;          // Made by the tasks, for the caller, guarded by done_lock
+        long long allocated_bytes;
+        mutex done_lock;
+        condition_variable done;
+    };
+
+    // Range [begin, end) of a batch
+    struct Task
+    {
+        Batch* batch;
+        int begin;
+        int end;
+    };
+
+    struct TaskQueue
+    {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    bool take_task(size_t index, Task& task);
+    void run_task(const Task& task);
+    void worker_loop(size_t index);
+
+    // Copying would share the worker threads
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    vector<thread> threads;
+    vector<unique_ptr<TaskQueue>> queues;   // One per worker, the last one is for callers
+    mutex sleep_lock;                       // Guards stopping, used to wake sleeping workers
+    condition_variable wake;
+    atomic<int> queued;                     // Tasks waiting in any of the queues
+    bool stopping;
+};
+
+// Set while a thread runs a task, so nested parallel loops run serially
+thread_local bool inside_pool_task = false;
+
+ThreadPool::ThreadPool(int thread_count) : queued(0), stopping(false)
+/**
+ * Starts the worker threads
+ * @param thread_count Total threads to use, including the calling thread
+ */
+{
+    int workers = max(thread_count, 1) - 1;
+    for (int i = 0; i <= workers; i++)
+    {
+        queues.push_back(unique_ptr<TaskQueue>(new TaskQueue()));
+    }
+    for (int i = 0; i < workers; i++)
+    {
+        threads.push_back(thread(&ThreadPool::worker_loop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+/**
+ * Stops and joins the worker threads
+ */
+{
+    {
+        lock_guard<mutex> lock(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
+
+bool ThreadPool::take_task(size_t index, Task& task)
+/**
+ * Takes the newest task from a queue, or steals the oldest task of another
+ * @param index The queue of the calling thread
+ * @param task  Receives the task
+ * @return True if a task was found
+ */
+{
+    for (size_t n = 0; n < queues.size(); n++)
+    {
+        TaskQueue& queue = *queues[(index + n) % queues.size()];
+        lock_guard<mutex> lock(queue.lock);
+        if (!queue.tasks.empty())
+        {
+            if (n == 0)
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run_task(const Task& task)
+/**
+ * Runs a task and signals its batch when it was the last one
+ * @param task The task to run
+ */
+{
+    bool was_inside = inside_pool_task;
+    inside_pool_task = true;
+    long long allocations = thread_allocations;
+    long long allocated_bytes = thread_allocated_bytes;
+    (*task.batch->body)(task.begin, task.end);
+    inside_pool_task = was_inside;
+
+    // Allocations belong to the caller of the batch, whichever thread ran the task
+    allocations = thread_allocations - allocations;
+    allocated_bytes = thread_allocated_bytes - allocated_bytes;
+    thread_allocations -= allocations;
+    thread_allocated_bytes -= allocated_bytes;
+
+    // The batch may be destroyed as soon as its caller sees the count reach 0,
+    // so the count is only changed while holding its lock
+    Batch* batch = task.batch;
+    lock_guard<mutex> lock(batch->done_lock);
+    batch->allocations += allocations;
+    batch->allocated_bytes += allocated_bytes;
+    batch->remaining--;
+    if (batch->remaining == 0)
+    {
+        batch->done.notify_all();
+    }
+}
+
+void ThreadPool::worker_loop(size_t index)
+/**
+ * Runs tasks until the pool is destroyed, sleeping while there are none
+ * @param index The queue owned by this worker
+ */
+{
+    while (true)
+    {
+        Task task;
+        if (take_task(index, task))
+        {
+            run_task(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(sleep_lock);
+        wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0)
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallel_for(int count, int grain, const function<void(int, int)>& body)
+/**
+ * Runs body over [0, count) in chunks of grain and waits for all of them
+ * The calling thread works on the chunks too
+ * @param count Number of items, usually rows
+ * @param grain Items per task
+ * @param body  Called with each [begin, end) chunk
+ */
+{
+    if (count <= 0)
+    {
+        return;
+    }
+    grain = max(grain, 1);
+    if (threads.empty() || inside_pool_task || count <= grain)
+    {
+        body(0, count);
+        return;
+    }
+
+    Batch batch;
+    batch.body = &body;
+    batch.remaining = (count + grain - 1) / grain;
+    batch.allocations = 0;
+    batch.allocated_bytes = 0;
+
+    // Deal out neighbouring chunks to the same queue
+    int tasks_per_queue = (batch.remaining + queues.size() - 1) / queues.size();
+    for (int t = 0; t < batch.remaining; t++)
+    {
+        Task task = {&batch, t * grain, min(count, (t + 1) * grain)};
+        TaskQueue& queue = *queues[t / tasks_per_queue];
+        lock_guard<mutex> lock(queue.lock);
+        queue.tasks.push_back(task);
+    }
+    {
+        lock_guard<mutex> lock(sleep_lock);
+        queued += batch.remaining;
+    }
+    wake.notify_all();
+
+    // Help out until there is nothing left to take, then wait for the rest
+    Task task;
+    while (take_task(queues.size() - 1, task))
+    {
+        run_task(task);
+    }
+    unique_lock<mutex> lock(batch.done_lock);
+    batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+    thread_allocations += batch.allocations;
+    thread_allocated_bytes += batch.allocated_bytes;
+}
+
+// Threads requested with set_thread_count(), 0 uses every core
+int requested_threads = 0;
+ThreadPool* shared_pool = NULL;
+mutex shared_pool_lock;
+
+void set_thread_count(int count)
+/**
+ * Sets how many threads the filters use
+ * Must not be called while a filter is running
+ * @param count Number of threads, 0 to use every core
+ */
+{
+    lock_guard<mutex> lock(shared_pool_lock);
+    delete shared_pool;
+    shared_pool = NULL;
+    requested_threads = max(count, 0);
+}
+
+ThreadPool& thread_pool()
+/**
+ * Gets the pool shared by all filters, starting it on first use
+ * @return the shared thread pool
+ */
+{
+    lock_guard<mutex> lock(shared_pool_lock);
+    if (shared_pool == NULL)
+    {
+        int count = requested_threads;
+        if (count <= 0)
+        {
+            count = max(static_cast<int>(thread::hardware_concurrency()), 1);
+        }
+        shared_pool = new ThreadPool(count);
+    }
+    return *shared_pool;
+}
+
+void parallel_rows(int rows, long long pixels_per_row, const function<void(int, int)>& body)
+/**
+ * Runs body over bands of rows on the shared thread pool
+ * Bands are small enough to balance the load but large enough
+ * that small images are not split at all
+ * @param rows           Number of rows
+ * @param pixels_per_row Work in each row, used to size the bands
+ * @param body           Called with each [begin, end) band of rows
+ */
+{
+    const long long MIN_BAND_PIXELS = 16384;
+    ThreadPool& pool = thread_pool();
+    int grain = max(rows / (pool.size() * 4), 1);
+    if (pixels_per_row > 0)
+    {
+        grain = max(grain, static_cast<int>((MIN_BAND_PIXELS + pixels_per_row - 1) / pixels_per_row));
+    }
+    pool.parallel_for(rows, grain, body);
+}
+
+//
+// SIMD kernels
+// Lighten, darken, Claredon, greyscale and alpha blending on 8 bit rows
+// with SSE2 or AVX2, picked at run time. Scaling factors are turned into
+// 16 bit fixed point multipliers that are checked against the double
+// formulas for all 256 channel values, so the vector code rounds exactly
+// like the processes.
+//
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#define IMAGE_HAVE_X86_SIMD 1
+#define IMAGE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Instruction sets the kernels can use, from slowest to fastest
+enum SimdLevel
+{
+    SIMD_NONE = 0,
+    SIMD_SSE2 = 1,
+    SIMD_AVX2 = 2
+};
+
+SimdLevel detect_simd_level()
+/**
+ * Checks which instruction sets this CPU supports
+ * @return the fastest supported level
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+// Level used by the kernels, can be lowered to compare against the scalar code
+SimdLevel active_simd_level = detect_simd_level();
+
+void set_simd_level(SimdLevel level)
+/**
+ * Limits the instruction sets the kernels use
+ * @param level Highest level to use, capped to what the CPU supports
+ */
+{
+    active_simd_level = min(level, detect_simd_level());
+}
+
+// Fixed point multipliers for the tone curves of one scaling factor
+struct ToneScale
+{
+    bool exact;             // True if both multipliers match the double formulas
+    unsigned int darken;    // round(c*scaling) == (c*darken + 32768) >> 16
+    unsigned int lighten;   // round(255-(255-c)*scaling) == 255 - (((255-c)*lighten + 32767) >> 16)
+};
+
+int fixed_darken(int c, unsigned int multiplier)
+{
+    return (c * multiplier + 32768) >> 16;
+}
+
+int fixed_lighten(int c, unsigned int multiplier)
+{
+    return 255 - static_cast<int>(((255 - c) * multiplier + 32767) >> 16);
+}
+
+ToneScale make_tone_scale(double scaling)
+/**
+ * Finds 16 bit multipliers that reproduce the rounding of process_08 and
+ * process_09 for every channel value
+ * @param scaling Strength of the effect, 0 to 1
+ * @return the multipliers, exact is false if the vector code cannot be used
+ */
+{
+    ToneScale scale = {false, 0, 0};
+    if (!(scaling >= 0 && scaling < 1))
+    {
+        return scale;
+    }
+
+    bool found_darken = false;
+    bool found_lighten = false;
+    long long nearest = static_cast<long long>(round(scaling * 65536));
+    const int candidates[] = {0, -1, 1, -2, 2};
+    for (int n = 0; n < 5; n++)
+    {
+        long long multiplier = nearest + candidates[n];
+        if (multiplier < 0 || multiplier > 65535)
+        {
+            continue;
+        }
+        bool darken_ok = !found_darken;
+        bool lighten_ok = !found_lighten;
+        for (int c = 0; c < 256 && (darken_ok || lighten_ok); c++)
+        {
+            darken_ok = darken_ok && fixed_darken(c, multiplier) == static_cast<int>(round(c*scaling));
+            lighten_ok = lighten_ok && fixed_lighten(c, multiplier) == static_cast<int>(round(255-(255 - c)*scaling));
+        }
+        if (darken_ok)
+        {
+            scale.darken = multiplier;
+            found_darken = true;
+        }
+        if (lighten_ok)
+        {
+            scale.lighten = multiplier;
+            found_lighten = true;
+        }
+    }
+    scale.exact = found_darken && found_lighten;
+    return scale;
+}
+
+// Ways of turning a colour into a grey
+enum GreyMode
+{
+    GREY_AVERAGE = 0,       // (red + green + blue) / 3, same as process_03
+    GREY_REC601,            // Luma of SD video, 0.299 red + 0.587 green + 0.114 blue
+    GREY_REC709             // Luma of HD video and sRGB, 0.2126 red + 0.7152 green + 0.0722 blue
+};
+
+// Luma weights out of 256 for blue, green and red, indexed by GreyMode
+// Each set adds up to 256 so white stays white, and a weighted sum of
+// 8 bit values fits in 16 bits, so the SIMD kernels need no wider lanes
+const int GREY_WEIGHTS[3][3] = {{0, 0, 0}, {29, 150, 77}, {19, 183, 54}};
+
+inline int grey_value(GreyMode mode, int red, int green, int blue)
+/**
+ * Gets the grey of a colour, with a multiply and shift instead of a divide for luma
+ */
+{
+    if (mode == GREY_AVERAGE)
+    {
+        return (red + green + blue)/3;
+    }
+    const int* weight = GREY_WEIGHTS[mode];
+    return (weight[0] * blue + weight[1] * green + weight[2] * red + 128) >> 8;
+}
+
+void greyscale_pixel(unsigned char* p, GreyMode mode = GREY_AVERAGE)
+{
+    int grey_val = grey_value(mode, p[CHANNEL_RED], p[CHANNEL_GREEN], p[CHANNEL_BLUE]);
+    p[CHANNEL_RED] = p[CHANNEL_GREEN] = p[CHANNEL_BLUE] = grey_val;
+}
+
+// Greys at or above which process_07 turns a pixel white
+const int BLACK_WHITE_THRESHOLD = 255/2;
+
+void black_white_pixel(unsigned char* p, int threshold)
+{
+    int grey_val = (p[CHANNEL_RED] + p[CHANNEL_GREEN] + p[CHANNEL_BLUE])/3;
+    p[CHANNEL_RED] = p[CHANNEL_GREEN] = p[CHANNEL_BLUE] = grey_val >= threshold ? 255 : 0;
+}
+
+void black_white_rgb_pixel(unsigned char* p)
+{
+    int red = p[CHANNEL_RED];
+    int green = p[CHANNEL_GREEN];
+    int blue = p[CHANNEL_BLUE];
+    int add_color = red + green + blue;
+
+    // Sets B*W values for highest contrast areas, otherwise the
+    // strongest channel wins with ties going to red, then green
+    bool red_wins = red >= green && red >= blue;
+    bool green_wins = !red_wins && green >= blue;
+    bool white = add_color >= 550;
+    bool black = add_color <= 150;
+    p[CHANNEL_RED] = white || (!black && red_wins) ? 255 : 0;
+    p[CHANNEL_GREEN] = white || (!black && green_wins) ? 255 : 0;
+    p[CHANNEL_BLUE] = white || (!black && !red_wins && !green_wins) ? 255 : 0;
+}
+
+void claredon_pixel(unsigned char* p, const ToneScale& scale)
+{
+    // Average above 170 is a sum above 510, below 90 is a sum below 270
+    int sum = p[CHANNEL_RED] + p[CHANNEL_GREEN] + p[CHANNEL_BLUE];
+    for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+    {
+        if (sum > 510)
+        {
+            p[c] = fixed_lighten(p[c], scale.lighten);
+        } else if (sum < 270)
+        {
+            p[c] = fixed_darken(p[c], scale.darken);
+        }
+    }
+}
+
+#ifdef IMAGE_HAVE_X86_SIMD
+
+// Masks selecting the lanes of a 48 byte (16 pixel) chunk that hold
+// channel 0, 1 or 2 of a pixel, as 16 bit lanes
+struct PhaseMasks
+{
+    unsigned short lanes[3][48];
+
+    PhaseMasks()
+    {
+        for (int i = 0; i < 48; i++)
+        {
+            for (int phase = 0; phase < 3; phase++)
+            {
+                lanes[phase][i] = (i % 3 == phase) ? 0xFFFF : 0;
+            }
+        }
+    }
+};
+const PhaseMasks phase_masks;
+
+// Luma weights of the channels 2, 1, 0 bytes before and 1, 2 bytes after
+// each lane of a 48 byte chunk, for each GreyMode, as 16 bit lanes
+// A lane holding green, for example, weighs the byte before as blue,
+// itself as green and the byte after as red
+struct LumaLanes
+{
+    unsigned short lanes[3][5][48];
+
+    LumaLanes()
+    {
+        for (int mode = 0; mode < 3; mode++)
+        {
+            for (int k = 0; k < 5; k++)
+            {
+                for (int i = 0; i < 48; i++)
+                {
+                    int channel = i % 3 + k - 2;
+                    lanes[mode][k][i] = channel >= 0 && channel < 3 ? GREY_WEIGHTS[mode][channel] : 0;
+                }
+            }
+        }
+    }
+};
+const LumaLanes luma_lanes;
+
+// (x*m + 32768) >> 16 on unsigned 16 bit lanes
+inline __m128i mul_round_sse2(__m128i x, __m128i m)
+{
+    __m128i hi = _mm_mulhi_epu16(x, m);
+    __m128i lo = _mm_mullo_epi16(x, m);
+    return _mm_add_epi16(hi, _mm_srli_epi16(lo, 15));
+}
+
+// (x*m + 32767) >> 16 on unsigned 16 bit lanes
+inline __m128i mul_round_down_half_sse2(__m128i x, __m128i m)
+{
+    __m128i hi = _mm_mulhi_epu16(x, m);
+    __m128i lo = _mm_mullo_epi16(x, m);
+    __m128i no_carry = _mm_cmpeq_epi16(_mm_subs_epu16(lo, _mm_set1_epi16(static_cast<short>(0x8000))), _mm_setzero_si128());
+    return _mm_add_epi16(hi, _mm_add_epi16(_mm_set1_epi16(1), no_carry));
+}
+
+inline __m128i darken_sse2(__m128i x, __m128i m)
+{
+    return mul_round_sse2(x, m);
+}
+
+inline __m128i lighten_sse2(__m128i x, __m128i m)
+{
+    __m128i max_value = _mm_set1_epi16(255);
+    return _mm_sub_epi16(max_value, mul_round_down_half_sse2(_mm_sub_epi16(max_value, x), m));
+}
+
+IMAGE_TARGET_AVX2 inline __m256i mul_round_avx2(__m256i x, __m256i m)
+{
+    __m256i hi = _mm256_mulhi_epu16(x, m);
+    __m256i lo = _mm256_mullo_epi16(x, m);
+    return _mm256_add_epi16(hi, _mm256_srli_epi16(lo, 15));
+}
+
+IMAGE_TARGET_AVX2 inline __m256i mul_round_down_half_avx2(__m256i x, __m256i m)
+{
+    __m256i hi = _mm256_mulhi_epu16(x, m);
+    __m256i lo = _mm256_mullo_epi16(x, m);
+    __m256i no_carry = _mm256_cmpeq_epi16(_mm256_subs_epu16(lo, _mm256_set1_epi16(static_cast<short>(0x8000))), _mm256_setzero_si256());
+    return _mm256_add_epi16(hi, _mm256_add_epi16(_mm256_set1_epi16(1), no_carry));
+}
+
+IMAGE_TARGET_AVX2 inline __m256i darken_avx2(__m256i x, __m256i m)
+{
+    return mul_round_avx2(x, m);
+}
+
+IMAGE_TARGET_AVX2 inline __m256i lighten_avx2(__m256i x, __m256i m)
+{
+    __m256i max_value = _mm256_set1_epi16(255);
+    return _mm256_sub_epi16(max_value, mul_round_down_half_avx2(_mm256_sub_epi16(max_value, x), m));
+}
+
+// Loads 16 bytes as 16 bit lanes
+IMAGE_TARGET_AVX2 inline __m256i load_u16_avx2(const unsigned char* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+// Stores 16 bit lanes holding values 0 to 255 as 16 bytes
+IMAGE_TARGET_AVX2 inline void store_u8_avx2(unsigned char* p, __m256i v)
+{
+    __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), packed);
+}
+
+int tone_row_sse2(unsigned char* p, int bytes, unsigned int multiplier, bool lighten)
+/**
+ * Lightens or darkens a row 16 channels at a time
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+    __m128i m = _mm_set1_epi16(static_cast<short>(multiplier));
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i*>(p + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        if (lighten)
+        {
+            lo = lighten_sse2(lo, m);
+            hi = lighten_sse2(hi, m);
+        } else
+        {
+            lo = darken_sse2(lo, m);
+            hi = darken_sse2(hi, m);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+IMAGE_TARGET_AVX2 int tone_row_avx2(unsigned char* p, int bytes, unsigned int multiplier, bool lighten)
+/**
+ * Lightens or darkens a row 32 channels at a time
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+    __m256i m = _mm256_set1_epi16(static_cast<short>(multiplier));
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        // Unpacking and packing both work within 128 bit halves,
+        // so the bytes come back out in their original order
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i*>(p + i));
+        __m256i lo = _mm256_unpacklo_epi8(v, zero);
+        __m256i hi = _mm256_unpackhi_epi8(v, zero);
+        if (lighten)
+        {
+            lo = lighten_avx2(lo, m);
+            hi = lighten_avx2(hi, m);
+        } else
+        {
+            lo = darken_avx2(lo, m);
+            hi = darken_avx2(hi, m);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), _mm256_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+// Sum of the three channels of the pixel each lane belongs to
+// n holds the 16 bit channel values starting 2, 1, 0 bytes before and
+// 1, 2 bytes after the lanes, lane k holds channel (first_lane + k) % 3
+inline __m128i phase_sums_sse2(const __m128i n[5], int first_lane)
+{
+    __m128i phase0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[0][first_lane]));
+    __m128i phase2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[2][first_lane]));
+    __m128i sum1 = _mm_add_epi16(_mm_add_epi16(n[1], n[2]), n[3]);
+    __m128i sum0 = _mm_add_epi16(_mm_sub_epi16(sum1, n[1]), n[4]);
+    __m128i sum2 = _mm_add_epi16(_mm_sub_epi16(sum1, n[3]), n[0]);
+
+    // Start from the channel 1 sums and swap in the other two
+    return _mm_or_si128(_mm_andnot_si128(_mm_or_si128(phase0, phase2), sum1),
+           _mm_or_si128(_mm_and_si128(sum0, phase0), _mm_and_si128(sum2, phase2)));
+}
+
+// Pixel sums for the 16 bytes starting at p, as two halves of 8 lanes
+inline void pixel_sums_sse2(const unsigned char* p, int first_lane, __m128i& sums_lo, __m128i& sums_hi)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo[5];
+    __m128i hi[5];
+    for (int k = 0; k < 5; k++)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + k - 2));
+        lo[k] = _mm_unpacklo_epi8(v, zero);
+        hi[k] = _mm_unpackhi_epi8(v, zero);
+    }
+    sums_lo = phase_sums_sse2(lo, first_lane);
+    sums_hi = phase_sums_sse2(hi, first_lane + 8);
+}
+
+IMAGE_TARGET_AVX2 inline __m256i pixel_sums_avx2(const unsigned char* p, int first_lane)
+{
+    __m256i n[5];
+    for (int k = 0; k < 5; k++)
+    {
+        n[k] = load_u16_avx2(p + k - 2);
+    }
+    __m256i phase0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&phase_masks.lanes[0][first_lane]));
+    __m256i phase1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&phase_masks.lanes[1][first_lane]));
+    __m256i phase2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&phase_masks.lanes[2][first_lane]));
+    __m256i sum1 = _mm256_add_epi16(_mm256_add_epi16(n[1], n[2]), n[3]);
+    __m256i sum0 = _mm256_add_epi16(_mm256_sub_epi16(sum1, n[1]), n[4]);
+    __m256i sum2 = _mm256_add_epi16(_mm256_sub_epi16(sum1, n[3]), n[0]);
+    return _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(sum0, phase0), _mm256_and_si256(sum1, phase1)),
+                           _mm256_and_si256(sum2, phase2));
+}
+
+// Rounded luma of the pixel each lane belongs to, for the 16 bytes starting at p
+inline __m128i pixel_luma_sse2(const unsigned char* p, int first_lane, GreyMode mode)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i luma_lo = _mm_set1_epi16(128);
+    __m128i luma_hi = luma_lo;
+    for (int k = 0; k < 5; k++)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + k - 2));
+        __m128i weight_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&luma_lanes.lanes[mode][k][first_lane]));
+        __m128i weight_hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&luma_lanes.lanes[mode][k][first_lane + 8]));
+        luma_lo = _mm_add_epi16(luma_lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), weight_lo));
+        luma_hi = _mm_add_epi16(luma_hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), weight_hi));
+    }
+    return _mm_packus_epi16(_mm_srli_epi16(luma_lo, 8), _mm_srli_epi16(luma_hi, 8));
+}
+
+IMAGE_TARGET_AVX2 inline __m256i pixel_luma_avx2(const unsigned char* p, int first_lane, GreyMode mode)
+{
+    __m256i luma = _mm256_set1_epi16(128);
+    for (int k = 0; k < 5; k++)
+    {
+        __m256i weight = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&luma_lanes.lanes[mode][k][first_lane]));
+        luma = _mm256_add_epi16(luma, _mm256_mullo_epi16(load_u16_avx2(p + k - 2), weight));
+    }
+    return _mm256_srli_epi16(luma, 8);
+}
+
+// Red, green and blue of the pixel each lane belongs to, from the
+// channels around the lanes as phase_sums_sse2() takes them
+inline void phase_channels_sse2(const __m128i n[5], int first_lane, __m128i& red, __m128i& green, __m128i& blue)
+{
+    __m128i phase0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[0][first_lane]));
+    __m128i phase1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[1][first_lane]));
+    __m128i phase2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[2][first_lane]));
+    blue = _mm_or_si128(_mm_or_si128(_mm_and_si128(phase0, n[2]), _mm_and_si128(phase1, n[1])), _mm_and_si128(phase2, n[0]));
+    green = _mm_or_si128(_mm_or_si128(_mm_and_si128(phase0, n[3]), _mm_and_si128(phase1, n[2])), _mm_and_si128(phase2, n[1]));
+    red = _mm_or_si128(_mm_or_si128(_mm_and_si128(phase0, n[4]), _mm_and_si128(phase1, n[3])), _mm_and_si128(phase2, n[2]));
+}
+
+// process_10 on 8 lanes as compare masks, all ones where the lane turns 255
+// The winning channel is picked with masks instead of branches, a >= b
+// being the inverse of b > a, and white and black override it
+inline __m128i black_white_rgb_lanes_sse2(const __m128i n[5], int first_lane)
+{
+    __m128i red, green, blue;
+    phase_channels_sse2(n, first_lane, red, green, blue);
+    __m128i phase0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[0][first_lane]));
+    __m128i phase1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[1][first_lane]));
+    __m128i phase2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&phase_masks.lanes[2][first_lane]));
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(red, green), blue);
+    __m128i all = _mm_set1_epi16(-1);
+    __m128i red_wins = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi16(green, red), _mm_cmpgt_epi16(blue, red)), all);
+    __m128i green_wins = _mm_andnot_si128(_mm_or_si128(red_wins, _mm_cmpgt_epi16(blue, green)), all);
+    __m128i blue_wins = _mm_andnot_si128(_mm_or_si128(red_wins, green_wins), all);
+    __m128i on = _mm_or_si128(_mm_or_si128(_mm_and_si128(phase2, red_wins), _mm_and_si128(phase1, green_wins)),
+                              _mm_and_si128(phase0, blue_wins));
+    __m128i white = _mm_cmpgt_epi16(sum, _mm_set1_epi16(549));
+    __m128i black = _mm_cmpgt_epi16(_mm_set1_epi16(151), sum);
+    return _mm_or_si128(white, _mm_andnot_si128(black, on));
+}
+
+IMAGE_TARGET_AVX2 inline __m256i black_white_rgb_lanes_avx2(const unsigned char* p, int first_lane)
+{
+    __m256i n[5];
+    for (int k = 0; k < 5; k++)
+    {
+        n[k] = load_u16_avx2(p + k - 2);
+    }
+    __m256i phase0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&phase_masks.lanes[0][first_lane]));
+    __m256i phase1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&phase_masks.lanes[1][first_lane]));
+    __m256i phase2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&phase_masks.lanes[2][first_lane]));
+    __m256i blue = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(phase0, n[2]), _mm256_and_si256(phase1, n[1])),
+                                   _mm256_and_si256(phase2, n[0]));
+    __m256i green = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(phase0, n[3]), _mm256_and_si256(phase1, n[2])),
+                                    _mm256_and_si256(phase2, n[1]));
+    __m256i red = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(phase0, n[4]), _mm256_and_si256(phase1, n[3])),
+                                  _mm256_and_si256(phase2, n[2]));
+    __m256i sum = _mm256_add_epi16(_mm256_add_epi16(red, green), blue);
+    __m256i all = _mm256_set1_epi16(-1);
+    __m256i red_wins = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi16(green, red), _mm256_cmpgt_epi16(blue, red)), all);
+    __m256i green_wins = _mm256_andnot_si256(_mm256_or_si256(red_wins, _mm256_cmpgt_epi16(blue, green)), all);
+    __m256i blue_wins = _mm256_andnot_si256(_mm256_or_si256(red_wins, green_wins), all);
+    __m256i on = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(phase2, red_wins), _mm256_and_si256(phase1, green_wins)),
+                                 _mm256_and_si256(phase0, blue_wins));
+    __m256i white = _mm256_cmpgt_epi16(sum, _mm256_set1_epi16(549));
+    __m256i black = _mm256_cmpgt_epi16(_mm256_set1_epi16(151), sum);
+    return _mm256_or_si256(white, _mm256_andnot_si256(black, on));
+}
+
+// Pixel rows are worked on in chunks of 16 pixels, every chunk is loaded
+// before any of it is stored since the sums read the neighbouring channels.
+// Chunks start at the second pixel and stop a few pixels short of the end
+// so the loads two bytes either side of a chunk stay inside the row. The
+// first pixel is done on its own and the rest are left to the caller.
+const int SIMD_CHUNK_BYTES = 48;
+
+int greyscale_row_sse2(unsigned char* row, int width)
+/**
+ * Greyscales pixels 16 at a time
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m128i third = _mm_set1_epi16(static_cast<short>(43691));
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m128i grey[3];
+        for (int k = 0; k < 3; k++)
+        {
+            // (sum * 43691) >> 17 is sum / 3 for sums up to 765
+            __m128i sums_lo, sums_hi;
+            pixel_sums_sse2(row + i + k * 16, k * 16, sums_lo, sums_hi);
+            grey[k] = _mm_packus_epi16(_mm_srli_epi16(_mm_mulhi_epu16(sums_lo, third), 1),
+                                       _mm_srli_epi16(_mm_mulhi_epu16(sums_hi, third), 1));
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i + k * 16), grey[k]);
+        }
+    }
+    greyscale_pixel(row);
+    return i / 3;
+}
+
+int luma_row_sse2(unsigned char* row, int width, GreyMode mode)
+/**
+ * Replaces pixels with their luma 16 at a time
+ * @return the number of pixels done from the start of the row
+ */
+{
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m128i grey[3];
+        for (int k = 0; k < 3; k++)
+        {
+            grey[k] = pixel_luma_sse2(row + i + k * 16, k * 16, mode);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i + k * 16), grey[k]);
+        }
+    }
+    greyscale_pixel(row, mode);
+    return i / 3;
+}
+
+IMAGE_TARGET_AVX2 int greyscale_row_avx2(unsigned char* row, int width)
+/**
+ * Greyscales pixels 16 at a time with 16 lanes per register
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m256i third = _mm256_set1_epi16(static_cast<short>(43691));
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m256i grey[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i sum = pixel_sums_avx2(row + i + k * 16, k * 16);
+            grey[k] = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, third), 1);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            store_u8_avx2(row + i + k * 16, grey[k]);
+        }
+    }
+    greyscale_pixel(row);
+    return i / 3;
+}
+
+IMAGE_TARGET_AVX2 int luma_row_avx2(unsigned char* row, int width, GreyMode mode)
+/**
+ * Replaces pixels with their luma 16 at a time with 16 lanes per register
+ * @return the number of pixels done from the start of the row
+ */
+{
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m256i grey[3];
+        for (int k = 0; k < 3; k++)
+        {
+            grey[k] = pixel_luma_avx2(row + i + k * 16, k * 16, mode);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            store_u8_avx2(row + i + k * 16, grey[k]);
+        }
+    }
+    greyscale_pixel(row, mode);
+    return i / 3;
+}
+
+int black_white_row_sse2(unsigned char* row, int width, int threshold)
+/**
+ * Thresholds pixels 16 at a time, comparing the channel sum with
+ * three times the threshold so no division is needed
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m128i limit = _mm_set1_epi16(static_cast<short>(threshold * 3 - 1));
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m128i value[3];
+        for (int k = 0; k < 3; k++)
+        {
+            // Signed packing keeps all ones as 255 and zero as 0
+            __m128i sums_lo, sums_hi;
+            pixel_sums_sse2(row + i + k * 16, k * 16, sums_lo, sums_hi);
+            value[k] = _mm_packs_epi16(_mm_cmpgt_epi16(sums_lo, limit), _mm_cmpgt_epi16(sums_hi, limit));
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i + k * 16), value[k]);
+        }
+    }
+    black_white_pixel(row, threshold);
+    return i / 3;
+}
+
+int black_white_rgb_row_sse2(unsigned char* row, int width)
+/**
+ * Runs process_10 on pixels 16 at a time
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m128i zero = _mm_setzero_si128();
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m128i value[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i lo[5];
+            __m128i hi[5];
+            for (int j = 0; j < 5; j++)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + k * 16 + j - 2));
+                lo[j] = _mm_unpacklo_epi8(v, zero);
+                hi[j] = _mm_unpackhi_epi8(v, zero);
+            }
+            value[k] = _mm_packs_epi16(black_white_rgb_lanes_sse2(lo, k * 16), black_white_rgb_lanes_sse2(hi, k * 16 + 8));
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i + k * 16), value[k]);
+        }
+    }
+    black_white_rgb_pixel(row);
+    return i / 3;
+}
+
+IMAGE_TARGET_AVX2 int black_white_row_avx2(unsigned char* row, int width, int threshold)
+/**
+ * Thresholds pixels 16 at a time with 16 lanes per register
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m256i limit = _mm256_set1_epi16(static_cast<short>(threshold * 3 - 1));
+    __m256i white = _mm256_set1_epi16(255);
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m256i value[3];
+        for (int k = 0; k < 3; k++)
+        {
+            value[k] = _mm256_and_si256(_mm256_cmpgt_epi16(pixel_sums_avx2(row + i + k * 16, k * 16), limit), white);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            store_u8_avx2(row + i + k * 16, value[k]);
+        }
+    }
+    black_white_pixel(row, threshold);
+    return i / 3;
+}
+
+IMAGE_TARGET_AVX2 int black_white_rgb_row_avx2(unsigned char* row, int width)
+/**
+ * Runs process_10 on pixels 16 at a time with 16 lanes per register
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m256i white = _mm256_set1_epi16(255);
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m256i value[3];
+        for (int k = 0; k < 3; k++)
+        {
+            value[k] = _mm256_and_si256(black_white_rgb_lanes_avx2(row + i + k * 16, k * 16), white);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            store_u8_avx2(row + i + k * 16, value[k]);
+        }
+    }
+    black_white_rgb_pixel(row);
+    return i / 3;
+}
+
+int claredon_row_sse2(unsigned char* row, int width, const ToneScale& scale)
+/**
+ * Applies the Claredon effect to pixels 16 at a time
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lighten_m = _mm_set1_epi16(static_cast<short>(scale.lighten));
+    __m128i darken_m = _mm_set1_epi16(static_cast<short>(scale.darken));
+    __m128i bright = _mm_set1_epi16(510);
+    __m128i dark = _mm_set1_epi16(270);
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m128i result[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i sums[2];
+            pixel_sums_sse2(row + i + k * 16, k * 16, sums[0], sums[1]);
+            __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i*>(row + i + k * 16));
+            __m128i halves[2];
+            for (int half = 0; half < 2; half++)
+            {
+                __m128i c = half == 1 ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+
+                // Average above 170 is a sum above 510, below 90 is a sum below 270
+                __m128i is_bright = _mm_cmpgt_epi16(sums[half], bright);
+                __m128i is_dark = _mm_cmplt_epi16(sums[half], dark);
+                __m128i unchanged = _mm_andnot_si128(_mm_or_si128(is_bright, is_dark), c);
+                halves[half] = _mm_or_si128(unchanged,
+                               _mm_or_si128(_mm_and_si128(is_bright, lighten_sse2(c, lighten_m)),
+                                            _mm_and_si128(is_dark, darken_sse2(c, darken_m))));
+            }
+            result[k] = _mm_packus_epi16(halves[0], halves[1]);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i + k * 16), result[k]);
+        }
+    }
+    claredon_pixel(row, scale);
+    return i / 3;
+}
+
+IMAGE_TARGET_AVX2 int claredon_row_avx2(unsigned char* row, int width, const ToneScale& scale)
+/**
+ * Applies the Claredon effect to pixels 16 at a time with 16 lanes per register
+ * @return the number of pixels done from the start of the row
+ */
+{
+    __m256i lighten_m = _mm256_set1_epi16(static_cast<short>(scale.lighten));
+    __m256i darken_m = _mm256_set1_epi16(static_cast<short>(scale.darken));
+    __m256i bright = _mm256_set1_epi16(510);
+    __m256i dark = _mm256_set1_epi16(270);
+    int bytes = width * 3;
+    int i = 3;
+    for (; i + SIMD_CHUNK_BYTES + 2 <= bytes; i += SIMD_CHUNK_BYTES)
+    {
+        __m256i result[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i sum = pixel_sums_avx2(row + i + k * 16, k * 16);
+            __m256i v = load_u16_avx2(row + i + k * 16);
+            __m256i is_bright = _mm256_cmpgt_epi16(sum, bright);
+            __m256i is_dark = _mm256_cmpgt_epi16(dark, sum);
+            __m256i unchanged = _mm256_andnot_si256(_mm256_or_si256(is_bright, is_dark), v);
+            result[k] = _mm256_or_si256(unchanged,
+                        _mm256_or_si256(_mm256_and_si256(is_bright, lighten_avx2(v, lighten_m)),
+                                        _mm256_and_si256(is_dark, darken_avx2(v, darken_m))));
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            store_u8_avx2(row + i + k * 16, result[k]);
+        }
+    }
+    claredon_pixel(row, scale);
+    return i / 3;
+}
+
+// Divides 16 bit lanes holding a product of two bytes by 255, rounded
+inline __m128i div255_sse2(__m128i v)
+{
+    v = _mm_add_epi16(v, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+// Premultiplied source over destination for the two BGRA pixels in 8 lanes
+inline __m128i blend_over_sse2(__m128i target, __m128i source, __m128i opacity)
+{
+    source = div255_sse2(_mm_mullo_epi16(source, opacity));
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i keep = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    return _mm_add_epi16(source, div255_sse2(_mm_mullo_epi16(target, keep)));
+}
+
+int blend_row_sse2(unsigned char* target, const unsigned char* source, int width, int opacity)
+/**
+ * Blends premultiplied BGRA pixels 4 at a time
+ * @return the number of pixels done, the caller finishes the rest
+ */
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i scale = _mm_set1_epi16(static_cast<short>(opacity));
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(target + x * 4));
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x * 4));
+        __m128i lo = blend_over_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), scale);
+        __m128i hi = blend_over_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), scale);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target + x * 4), _mm_packus_epi16(lo, hi));
+    }
+    return x;
+}
+
+IMAGE_TARGET_AVX2 inline __m256i div255_avx2(__m256i v)
+{
+    v = _mm256_add_epi16(v, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+IMAGE_TARGET_AVX2 inline __m256i blend_over_avx2(__m256i target, __m256i source, __m256i opacity)
+{
+    source = div255_avx2(_mm256_mullo_epi16(source, opacity));
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i keep = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    return _mm256_add_epi16(source, div255_avx2(_mm256_mullo_epi16(target, keep)));
+}
+
+IMAGE_TARGET_AVX2 int blend_row_avx2(unsigned char* target, const unsigned char* source, int width, int opacity)
+/**
+ * Blends premultiplied BGRA pixels 8 at a time
+ * @return the number of pixels done, the caller finishes the rest
+ */
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i scale = _mm256_set1_epi16(static_cast<short>(opacity));
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        // Unpacking and packing both work within 128 bit halves
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i*>(target + x * 4));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + x * 4));
+        __m256i lo = blend_over_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), scale);
+        __m256i hi = blend_over_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), scale);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + x * 4), _mm256_packus_epi16(lo, hi));
+    }
+    return x;
+}
+
+#endif
+
+int tone_row_simd(unsigned char* row, int bytes, unsigned int multiplier, bool lighten)
+/**
+ * Runs the fastest available lighten or darken kernel on a row
+ * @param row        First byte of the row
+ * @param bytes      Number of channel values in the row
+ * @param multiplier Fixed point multiplier from make_tone_scale()
+ * @param lighten    True to lighten, false to darken
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        return tone_row_avx2(row, bytes, multiplier, lighten);
+    }
+    if (active_simd_level >= SIMD_SSE2)
+    {
+        return tone_row_sse2(row, bytes, multiplier, lighten);
+    }
+#endif
+    return 0;
+}
+
+int greyscale_row_simd(unsigned char* row, int width, GreyMode mode = GREY_AVERAGE)
+/**
+ * Runs the fastest available greyscale kernel on a row of BGR pixels
+ * @return the number of pixels done from the start of the row
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        return mode == GREY_AVERAGE ? greyscale_row_avx2(row, width) : luma_row_avx2(row, width, mode);
+    }
+    if (active_simd_level >= SIMD_SSE2)
+    {
+        return mode == GREY_AVERAGE ? greyscale_row_sse2(row, width) : luma_row_sse2(row, width, mode);
+    }
+#endif
+    return 0;
+}
+
+int black_white_row_simd(unsigned char* row, int width, int threshold)
+/**
+ * Runs the fastest available black and white kernel on a row of BGR pixels
+ * @return the number of pixels done from the start of the row
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        return black_white_row_avx2(row, width, threshold);
+    }
+    if (active_simd_level >= SIMD_SSE2)
+    {
+        return black_white_row_sse2(row, width, threshold);
+    }
+#endif
+    return 0;
+}
+
+int black_white_rgb_row_simd(unsigned char* row, int width)
+/**
+ * Runs the fastest available process_10 kernel on a row of BGR pixels
+ * @return the number of pixels done from the start of the row
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        return black_white_rgb_row_avx2(row, width);
+    }
+    if (active_simd_level >= SIMD_SSE2)
+    {
+        return black_white_rgb_row_sse2(row, width);
+    }
+#endif
+    return 0;
+}
+
+int claredon_row_simd(unsigned char* row, int width, const ToneScale& scale)
+/**
+ * Runs the fastest available Claredon kernel on a row of BGR pixels
+ * @return the number of pixels done from the start of the row
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        return claredon_row_avx2(row, width, scale);
+    }
+    if (active_simd_level >= SIMD_SSE2)
+    {
+        return claredon_row_sse2(row, width, scale);
+    }
+#endif
+    return 0;
+}
+
+int blend_row_simd(unsigned char* target, const unsigned char* source, int width, int opacity)
+/**
+ * Runs the fastest available blend kernel on a row of premultiplied BGRA pixels
+ * @return the number of pixels done from the start of the row
+ */
+{
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        return blend_row_avx2(target, source, width, opacity);
+    }
+    if (active_simd_level >= SIMD_SSE2)
+    {
+        return blend_row_sse2(target, source, width, opacity);
+    }
+#endif
+    return 0;
+}
+
+//
+// Tone curves
+// Lighten, darken and both sides of Claredon change each channel value on
+// its own, so each one is a 256 entry lookup table. Tables are built once
+// per scaling factor and cached, several curves can be composed into one
+// table, and custom curves can be saved to and loaded from text files.
+//
+
+// A lookup table giving the new value of each channel value
+struct ToneCurve
+{
+    unsigned char table[256];
+};
+
+// Curves that can be built from a scaling factor
+enum ToneCurveKind
+{
+    CURVE_IDENTITY,
+    CURVE_LIGHTEN,      // process_08, and bright pixels in process_02
+    CURVE_DARKEN,       // process_09, and dark pixels in process_02
+    CURVE_POSTERIZE     // Evenly spaced levels, the scaling is the number of levels
+};
+
+ToneCurve make_tone_curve(ToneCurveKind kind, double scaling = 1)
+/**
+ * Builds a curve with the same rounding as the matching process
+ * @param kind    Which curve to build
+ * @param scaling Strength of the effect, ignored for the identity curve
+ * @return the curve
+ */
+{
+    ToneCurve curve;
+    for (int c = 0; c < 256; c++)
+    {
+        int value = c;
+        if (kind == CURVE_LIGHTEN)
+        {
+            value = static_cast<int>(round(255-(255 - c)*scaling));
+        } else if (kind == CURVE_DARKEN)
+        {
+            value = static_cast<int>(round(c*scaling));
+        } else if (kind == CURVE_POSTERIZE)
+        {
+            // Rounds to the nearest level, then spreads the levels over 0 to 255
+            double steps = min(max(round(scaling), 2.0), 256.0) - 1;
+            value = static_cast<int>(round(round(c * steps / 255) * 255 / steps));
+        }
+        curve.table[c] = static_cast<unsigned char>(value);
+    }
+    return curve;
+}
+
+ToneCurve compose_curves(const ToneCurve& first, const ToneCurve& second)
+/**
+ * Combines two curves into one
+ * @param first  Curve applied first
+ * @param second Curve applied to the result of the first
+ * @return a curve with the same effect as applying both in order
+ */
+{
+    ToneCurve curve;
+    for (int c = 0; c < 256; c++)
+    {
+        curve.table[c] = second.table[first.table[c]];
+    }
+    return curve;
+}
+
+// Curves already built, most recently used first
+struct CachedToneCurve
+{
+    ToneCurveKind kind;
+    double scaling;
+    shared_ptr<const ToneCurve> curve;
+};
+const size_t TONE_CURVE_CACHE_SIZE = 32;
+vector<CachedToneCurve> tone_curve_cache;
+mutex tone_curve_cache_lock;
+
+shared_ptr<const ToneCurve> get_tone_curve(ToneCurveKind kind, double scaling)
+/**
+ * Gets the curve for an operation and scaling factor, building it on first use
+ * @param kind    Which curve to get
+ * @param scaling Strength of the effect
+ * @return the shared curve
+ */
+{
+    lock_guard<mutex> lock(tone_curve_cache_lock);
+    for (size_t i = 0; i < tone_curve_cache.size(); i++)
+    {
+        if (tone_curve_cache[i].kind == kind && tone_curve_cache[i].scaling == scaling)
+        {
+            // Move to the front so it is evicted last
+            CachedToneCurve found = tone_curve_cache[i];
+            tone_curve_cache.erase(tone_curve_cache.begin() + i);
+            tone_curve_cache.insert(tone_curve_cache.begin(), found);
+            return found.curve;
+        }
+    }
+
+    CachedToneCurve entry = {kind, scaling, make_shared<ToneCurve>(make_tone_curve(kind, scaling))};
+    tone_curve_cache.insert(tone_curve_cache.begin(), entry);
+    if (tone_curve_cache.size() > TONE_CURVE_CACHE_SIZE)
+    {
+        tone_curve_cache.pop_back();
+    }
+    return entry.curve;
+}
+
+void curve_row(unsigned char* row, int width, int channels, const ToneCurve& curve)
+/**
+ * Looks up the blue, green and red channels of a row of pixels in a curve
+ * @param row      First pixel of the row
+ * @param width    Number of pixels
+ * @param channels Bytes per pixel
+ * @param curve    The curve to apply
+ */
+{
+    const unsigned char* table = curve.table;
+    if (channels == 3)
+    {
+        // Every byte is a colour channel, unrolled by one pixel
+        int bytes = width * 3;
+        for (int i = 0; i < bytes; i += 3)
+        {
+            row[i] = table[row[i]];
+            row[i + 1] = table[row[i + 1]];
+            row[i + 2] = table[row[i + 2]];
+        }
+        return;
+    }
+    for (int x = 0; x < width; x++)
+    {
+        row[CHANNEL_BLUE] = table[row[CHANNEL_BLUE]];
+        row[CHANNEL_GREEN] = table[row[CHANNEL_GREEN]];
+        row[CHANNEL_RED] = table[row[CHANNEL_RED]];
+        row += channels;
+    }
+}
+
+// First line of a saved curve file
+const string TONE_CURVE_FILE_HEADER = "TONECURVE 1";
+
+bool save_curve(string filename, const ToneCurve& curve)
+/**
+ * Saves a curve as text, the header line then 16 values per line
+ * @param filename File to write
+ * @param curve    The curve to save
+ * @return True if successful and false otherwise
+ */
+{
+    ofstream stream(filename.c_str());
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream << TONE_CURVE_FILE_HEADER << endl;
+    for (int c = 0; c < 256; c++)
+    {
+        stream << static_cast<int>(curve.table[c]) << (c % 16 == 15 ? '\n' : ' ');
+    }
+    bool written = stream.good();
+    stream.close();
+    return written;
+}
+
+bool load_curve(string filename, ToneCurve& curve)
+/**
+ * Loads a curve written by save_curve()
+ * @param filename File to read
+ * @param curve    Receives the curve, unchanged on failure
+ * @return True if the file held 256 values from 0 to 255
+ */
+{
+    ifstream stream(filename.c_str());
+    string header;
+    if (!stream.is_open() || !getline(stream, header))
+    {
+        return false;
+    }
+    // Tolerate Windows line endings
+    if (!header.empty() && header[header.size() - 1] == '\r')
+    {
+        header.erase(header.size() - 1);
+    }
+    if (header != TONE_CURVE_FILE_HEADER)
+    {
+        return false;
+    }
+
+    ToneCurve loaded;
+    for (int c = 0; c < 256; c++)
+    {
+        int value;
+        if (!(stream >> value) || value < 0 || value > 255)
+        {
+            return false;
+        }
+        loaded.table[c] = static_cast<unsigned char>(value);
+    }
+    curve = loaded;
+    return true;
+}
+
+//
+// Premultiplied alpha
+// Images with 4 channels keep straight alpha. Anything that mixes pixels,
+// resampling, convolutions and blending, first converts them to
+// premultiplied alpha, where each colour is already multiplied by its
+// alpha, so invisible pixels add no colour to the ones around them.
+//
+
+inline int div255(int value)
+{
+    // Rounded value / 255 for values from 0 to 255 * 255
+    value += 128;
+    return (value + (value >> 8)) >> 8;
+}
+
+void premultiply_row(unsigned char* target, const unsigned char* source, int width, int channels)
+/**
+ * Converts a row of pixels to premultiplied BGRA
+ * @param target   Receives width 4 byte pixels
+ * @param source   Pixels with straight alpha, or opaque pixels without alpha
+ * @param width    Number of pixels
+ * @param channels Bytes per source pixel, 3 or 4
+ */
+{
+    for (int x = 0; x < width; x++)
+    {
+        int alpha = channels == 4 ? source[CHANNEL_ALPHA] : 255;
+        target[CHANNEL_BLUE] = div255(source[CHANNEL_BLUE] * alpha);
+        target[CHANNEL_GREEN] = div255(source[CHANNEL_GREEN] * alpha);
+        target[CHANNEL_RED] = div255(source[CHANNEL_RED] * alpha);
+        target[CHANNEL_ALPHA] = alpha;
+        target += 4;
+        source += channels;
+    }
+}
+
+void unpremultiply_row(unsigned char* target, const unsigned char* source, int width, int channels)
+/**
+ * Converts a row of premultiplied BGRA back to straight alpha
+ * @param target   Receives width pixels
+ * @param source   Premultiplied 4 byte pixels
+ * @param width    Number of pixels
+ * @param channels Bytes per target pixel, 3 drops the alpha
+ */
+{
+    for (int x = 0; x < width; x++)
+    {
+        int alpha = source[CHANNEL_ALPHA];
+        for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+        {
+            target[c] = alpha == 0 ? 0 : min(255, (source[c] * 255 + alpha / 2) / alpha);
+        }
+        if (channels == 4)
+        {
+            target[CHANNEL_ALPHA] = alpha;
+        }
+        target += channels;
+        source += 4;
+    }
+}
+
+void premultiply_into(const Image& image, Image& target)
+/**
+ * Copies an image with alpha into a premultiplied one, target comes from image_pool
+ */
+{
+    image_pool.resize(target, image.width, image.height, 4);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            premultiply_row(target.row(y), image.row(y), image.width, 4);
+        }
+    });
+}
+
+void unpremultiply_in_place(Image& image)
+/**
+ * Converts a premultiplied image back to straight alpha
+ */
+{
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            unpremultiply_row(image.row(y), image.row(y), image.width, 4);
+        }
+    });
+}
+
+//
+// Resampling
+// Scales images with a choice of filters. Each axis gets a table of source
+// pixels and fixed point weights for every output pixel, built once per
+// resize. Rows are filtered horizontally first, then the vertical pass
+// blends whole rows of that result, so both passes read memory in order.
+// Images with alpha go through both passes premultiplied.
+//
+
+// Filters for resizing, nearest is the one process_06 uses
+enum ResampleFilter
+{
+    RESAMPLE_NEAREST = 0,
+    RESAMPLE_BILINEAR,
+    RESAMPLE_BICUBIC,       // Catmull-Rom
+    RESAMPLE_LANCZOS3,
+    RESAMPLE_AREA           // Average of the source area each pixel covers
+};
+
+// Resample weights are fixed point, with 1.0 stored as 1 << RESAMPLE_BITS
+const int RESAMPLE_BITS = 14;
+
+// Source pixels and weights for each output pixel along one axis
+struct ResampleAxis
+{
+    int taps;               // Source pixels per output pixel
+    vector<int> indices;    // taps source indices per output pixel, clamped to the image
+    vector<int> weights;    // Matching weights, each output pixel's weights sum to 1 << RESAMPLE_BITS
+};
+
+double resample_support(ResampleFilter filter)
+/**
+ * Gets how far a filter reaches from the pixel center, in source pixels at scale 1
+ */
+{
+    switch (filter)
+    {
+        case RESAMPLE_BILINEAR:
+            return 1;
+        case RESAMPLE_BICUBIC:
+            return 2;
+        case RESAMPLE_LANCZOS3:
+            return 3;
+        default:
+            return 0.5;
+    }
+}
+
+double resample_kernel(ResampleFilter filter, double x)
+/**
+ * Evaluates a filter at a distance from the pixel center
+ */
+{
+    x = abs(x);
+    switch (filter)
+    {
+        case RESAMPLE_BILINEAR:
+            return x < 1 ? 1 - x : 0;
+        case RESAMPLE_BICUBIC:
+            // Catmull-Rom, a = -0.5
+            if (x < 1)
+            {
+                return (1.5*x - 2.5)*x*x + 1;
+            }
+            if (x < 2)
+            {
+                return ((-0.5*x + 2.5)*x - 4)*x + 2;
+            }
+            return 0;
+        case RESAMPLE_LANCZOS3:
+        {
+            if (x < 1e-8)
+            {
+                return 1;
+            }
+            if (x >= 3)
+            {
+                return 0;
+            }
+            const double pi = 3.14159265358979323846;
+            return 3 * sin(pi*x) * sin(pi*x/3) / (pi*pi*x*x);
+        }
+        default:
+            return x < 0.5 ? 1 : 0;
+    }
+}
+
+void nearest_indices(vector<int>& indices, int source_size, int target_size, float scale)
+/**
+ * Finds the source pixel for each output pixel, rounding like process_06
+ * @param indices     Receives one source index per output pixel
+ * @param source_size Pixels along the axis of the source image
+ * @param target_size Pixels along the axis of the scaled image
+ * @param scale       Scale factor process_06 was given for the axis
+ */
+{
+    indices.resize(target_size);
+    for (int i = 0; i < target_size; i++)
+    {
+        indices[i] = min(static_cast<int>(round(i/scale)), source_size - 1);
+    }
+}
+
+void build_resample_axis(ResampleAxis& axis, int source_size, int target_size, ResampleFilter filter)
+/**
+ * Calculates the source pixels and weights for one axis of a resize
+ * When shrinking, filters are stretched to cover every source pixel
+ * @param axis        Receives the table
+ * @param source_size Pixels along the axis of the source image
+ * @param target_size Pixels along the axis of the resized image
+ * @param filter      Filter to use, not nearest
+ */
+{
+    double ratio = static_cast<double>(source_size) / target_size;
+    double filter_scale = max(ratio, 1.0);
+    double support = resample_support(filter) * filter_scale;
+    axis.taps = static_cast<int>(ceil(support)) * 2 + 1;
+    axis.indices.assign(static_cast<size_t>(target_size) * axis.taps, 0);
+    axis.weights.assign(static_cast<size_t>(target_size) * axis.taps, 0);
+
+    vector<double> weights(axis.taps);
+    for (int i = 0; i < target_size; i++)
+    {
+        // Center of the output pixel, in source pixels
+        double center = (i + 0.5) * ratio;
+        int left = static_cast<int>(floor(center - support));
+        double total = 0;
+        for (int k = 0; k < axis.taps; k++)
+        {
+            int source = left + k;
+            if (filter == RESAMPLE_AREA)
+            {
+                // Overlap of the source pixel with the output pixel
+                double start = max(static_cast<double>(source), i * ratio);
+                double end = min(static_cast<double>(source + 1), (i + 1) * ratio);
+                weights[k] = max(0.0, end - start);
+            } else
+            {
+                weights[k] = resample_kernel(filter, (source + 0.5 - center) / filter_scale);
+            }
+            total += weights[k];
+        }
+
+        // Normalizes to fixed point by rounding the running sum, so the
+        // rounding error spreads over the taps and they still add up to one
+        int* fixed = &axis.weights[static_cast<size_t>(i) * axis.taps];
+        int* indices = &axis.indices[static_cast<size_t>(i) * axis.taps];
+        double running = 0;
+        int previous = 0;
+        for (int k = 0; k < axis.taps; k++)
+        {
+            running += weights[k];
+            int rounded = static_cast<int>(round(running / total * (1 << RESAMPLE_BITS)));
+            fixed[k] = rounded - previous;
+            previous = rounded;
+            indices[k] = min(max(left + k, 0), source_size - 1);
+        }
+    }
+}
+
+inline unsigned char resample_round(int sum)
+{
+    sum = (sum + (1 << (RESAMPLE_BITS - 1))) >> RESAMPLE_BITS;
+    return static_cast<unsigned char>(min(max(sum, 0), 255));
+}
+
+void resample_rows(const Image& image, Image& target, const ResampleAxis& axis)
+/**
+ * Resizes each row of the image to the width of the axis table
+ * @param image  Source image
+ * @param target Receives rows of the new width, same height
+ * @param axis   Table for the horizontal axis
+ */
+{
+    int target_width = static_cast<int>(axis.indices.size() / axis.taps);
+    target.resize(target_width, image.height, image.channels);
+    int channels = image.channels;
+    parallel_rows(image.height, static_cast<long long>(target_width) * axis.taps, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            const unsigned char* source = image.row(y);
+            unsigned char* p = target.row(y);
+            for (int x = 0; x < target_width; x++)
+            {
+                const int* indices = &axis.indices[static_cast<size_t>(x) * axis.taps];
+                const int* weights = &axis.weights[static_cast<size_t>(x) * axis.taps];
+                if (channels == 3)
+                {
+                    int blue = 0;
+                    int green = 0;
+                    int red = 0;
+                    for (int k = 0; k < axis.taps; k++)
+                    {
+                        const unsigned char* s = source + indices[k] * 3;
+                        blue += weights[k] * s[0];
+                        green += weights[k] * s[1];
+                        red += weights[k] * s[2];
+                    }
+                    p[0] = resample_round(blue);
+                    p[1] = resample_round(green);
+                    p[2] = resample_round(red);
+                    p += 3;
+                    continue;
+                }
+                int sums[4] = {0, 0, 0, 0};
+                for (int k = 0; k < axis.taps; k++)
+                {
+                    const unsigned char* s = source + indices[k] * channels;
+                    for (int c = 0; c < channels; c++)
+                    {
+                        sums[c] += weights[k] * s[c];
+                    }
+                }
+                for (int c = 0; c < channels; c++)
+                {
+                    p[c] = resample_round(sums[c]);
+                }
+                p += channels;
+            }
+        }
+    });
+}
+
+void resample_columns(const Image& image, Image& target, const ResampleAxis& axis)
+/**
+ * Resizes each column of the image to the height of the axis table
+ * Each output row is a weighted sum of whole source rows
+ * @param image  Source image
+ * @param target Receives the new height, same width
+ * @param axis   Table for the vertical axis
+ */
+{
+    int target_height = static_cast<int>(axis.indices.size() / axis.taps);
+    target.resize(image.width, target_height, image.channels);
+    int row_bytes = image.width * image.channels;
+    parallel_rows(target_height, static_cast<long long>(image.width) * axis.taps, [&](int begin, int end)
+    {
+        vector<int> sums(row_bytes);
+        for (int y = begin; y < end; y++)
+        {
+            const int* indices = &axis.indices[static_cast<size_t>(y) * axis.taps];
+            const int* weights = &axis.weights[static_cast<size_t>(y) * axis.taps];
+            fill(sums.begin(), sums.end(), 0);
+            for (int k = 0; k < axis.taps; k++)
+            {
+                if (weights[k] == 0)
+                {
+                    continue;
+                }
+                const unsigned char* source = image.row(indices[k]);
+                int weight = weights[k];
+                for (int i = 0; i < row_bytes; i++)
+                {
+                    sums[i] += weight * source[i];
+                }
+            }
+            unsigned char* p = target.row(y);
+            for (int i = 0; i < row_bytes; i++)
+            {
+                p[i] = resample_round(sums[i]);
+            }
+        }
+    });
+}
+
+//
+// Convolution
+// Blurs, sharpens and finds edges from the pixels around each pixel. Each
+// band of output rows copies the source rows it needs, with extra pixels
+// either side made up by the border mode, so the kernels never check
+// bounds. Separable kernels filter the band across, then each output row
+// is a weighted sum of whole rows of that, and the box blur keeps running
+// sums so its cost does not grow with the radius. Images with alpha are
+// filtered premultiplied: blurs blur the alpha along with the colour,
+// while kernels and edges keep the alpha of the source.
+//
+
+// How pixels beyond the edges of the image are made up
+enum BorderMode
+{
+    BORDER_CLAMP = 0,       // Repeat the edge pixel
+    BORDER_MIRROR,          // Reflect about the edge pixel, without repeating it
+    BORDER_WRAP,            // Continue from the opposite edge
+    BORDER_ZERO             // Black, and clear for images with alpha
+};
+
+// Convolution weights are fixed point, with 1.0 stored as 1 << CONVOLVE_BITS
+// The SIMD kernels multiply in 16 bits, so a weight must be below 8
+const int CONVOLVE_BITS = 12;
+const double CONVOLVE_MAX_WEIGHT = 32767.0 / (1 << CONVOLVE_BITS);
+
+// Output rows each band of a convolution works on, so the band's copy of
+// the source rows stays in cache while its output is written
+const int CONVOLVE_BAND_ROWS = 32;
+
+// Square kernel for convolve_into(), weights listed row by row
+struct ConvolutionKernel
+{
+    int size;               // Width and height, odd
+    vector<double> weights; // size * size weights, each below CONVOLVE_MAX_WEIGHT
+};
+
+// Fixed point weights, also packed in pairs for the SIMD kernels
+struct ConvolveWeights
+{
+    vector<short> weights;
+    vector<int> pairs;      // Weights 2k and 2k + 1 in the low and high 16 bits
+};
+
+ConvolveWeights make_convolve_weights(const vector<double>& weights, bool normalize)
+/**
+ * Converts weights to fixed point
+ * @param weights   The weights
+ * @param normalize Make the weights add up to exactly 1, any rounding
+ *                  error goes to the largest weight
+ * @return the fixed point weights
+ */
+{
+    ConvolveWeights fixed;
+    int total = 0;
+    int largest = 0;
+    for (size_t k = 0; k < weights.size(); k++)
+    {
+        double weight = min(max(weights[k], -CONVOLVE_MAX_WEIGHT), CONVOLVE_MAX_WEIGHT);
+        fixed.weights.push_back(static_cast<short>(round(weight * (1 << CONVOLVE_BITS))));
+        total += fixed.weights[k];
+        largest = fixed.weights[k] > fixed.weights[largest] ? static_cast<int>(k) : largest;
+    }
+    if (normalize && !weights.empty())
+    {
+        fixed.weights[largest] = static_cast<short>(fixed.weights[largest] + (1 << CONVOLVE_BITS) - total);
+    }
+    for (size_t k = 0; k < fixed.weights.size(); k += 2)
+    {
+        unsigned int low = static_cast<unsigned short>(fixed.weights[k]);
+        unsigned int high = k + 1 < fixed.weights.size() ? static_cast<unsigned short>(fixed.weights[k + 1]) : 0;
+        fixed.pairs.push_back(static_cast<int>(low | (high << 16)));
+    }
+    return fixed;
+}
+
+int border_index(int i, int size, BorderMode border)
+/**
+ * Maps a position that may be beyond either end of an axis onto it
+ * @param i      The position
+ * @param size   Pixels along the axis
+ * @param border How positions outside are made up
+ * @return the position inside the axis, or -1 for a zero border
+ */
+{
+    if (i >= 0 && i < size)
+    {
+        return i;
+    }
+    switch (border)
+    {
+        case BORDER_MIRROR:
+        {
+            // Reflections repeat every 2 * size - 2 pixels
+            if (size == 1)
+            {
+                return 0;
+            }
+            int period = 2 * size - 2;
+            i = (i % period + period) % period;
+            return i < size ? i : period - i;
+        }
+        case BORDER_WRAP:
+            return (i % size + size) % size;
+        case BORDER_ZERO:
+            return -1;
+        default:
+            return min(max(i, 0), size - 1);
+    }
+}
+
+void border_band(const Image& image, int first, int rows, int radius, BorderMode border, Image& band)
+/**
+ * Copies rows of an image with extra pixels either side
+ * Rows and pixels beyond the image are made up by the border mode
+ * @param image  Source image
+ * @param first  First row to copy, may be outside the image
+ * @param rows   Number of rows to copy
+ * @param radius Pixels to add on each side
+ * @param border How pixels outside the image are made up
+ * @param band   Receives rows of width + 2 * radius pixels
+ */
+{
+    int channels = image.channels;
+    band.resize(image.width + 2 * radius, rows, channels);
+    for (int j = 0; j < rows; j++)
+    {
+        unsigned char* target = band.row(j);
+        int y = border_index(first + j, image.height, border);
+        if (y < 0)
+        {
+            memset(target, 0, static_cast<size_t>(band.width) * channels);
+            continue;
+        }
+        const unsigned char* source = image.row(y);
+        memcpy(target + radius * channels, source, static_cast<size_t>(image.width) * channels);
+        for (int x = 0; x < radius; x++)
+        {
+            int left = border_index(x - radius, image.width, border);
+            int right = border_index(image.width + x, image.width, border);
+            unsigned char* left_pixel = target + x * channels;
+            unsigned char* right_pixel = target + (radius + image.width + x) * channels;
+            if (left < 0)
+            {
+                memset(left_pixel, 0, channels);
+                memset(right_pixel, 0, channels);
+                continue;
+            }
+            memcpy(left_pixel, source + left * channels, channels);
+            memcpy(right_pixel, source + right * channels, channels);
+        }
+    }
+}
+
+inline unsigned char convolve_round(int sum)
+{
+    sum = (sum + (1 << (CONVOLVE_BITS - 1))) >> CONVOLVE_BITS;
+    return static_cast<unsigned char>(min(max(sum, 0), 255));
+}
+
+#ifdef IMAGE_HAVE_X86_SIMD
+
+int weighted_rows_sse2(const unsigned char* const* sources, const int* pairs, int taps, unsigned char* target, int bytes)
+/**
+ * Adds up weighted bytes of several sources 16 bytes at a time
+ * Bytes of two sources are interleaved so one multiply-add weighs both
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i half = _mm_set1_epi32(1 << (CONVOLVE_BITS - 1));
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i sums[4] = {half, half, half, half};
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sources[k] + i));
+            __m128i b = k + 1 < taps ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(sources[k + 1] + i)) : zero;
+            __m128i weights = _mm_set1_epi32(pairs[k / 2]);
+            __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+            __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+            __m128i b_lo = _mm_unpacklo_epi8(b, zero);
+            __m128i b_hi = _mm_unpackhi_epi8(b, zero);
+            sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), weights));
+            sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), weights));
+            sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), weights));
+            sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), weights));
+        }
+        // Saturating packs clip the results to 0 to 255
+        __m128i lo = _mm_packs_epi32(_mm_srai_epi32(sums[0], CONVOLVE_BITS), _mm_srai_epi32(sums[1], CONVOLVE_BITS));
+        __m128i hi = _mm_packs_epi32(_mm_srai_epi32(sums[2], CONVOLVE_BITS), _mm_srai_epi32(sums[3], CONVOLVE_BITS));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+IMAGE_TARGET_AVX2 int weighted_rows_avx2(const unsigned char* const* sources, const int* pairs, int taps,
+                                         unsigned char* target, int bytes)
+/**
+ * Adds up weighted bytes of several sources 32 bytes at a time
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i half = _mm256_set1_epi32(1 << (CONVOLVE_BITS - 1));
+    int i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        // Unpacking and packing both work within 128 bit halves,
+        // so the bytes come back out in their original order
+        __m256i sums[4] = {half, half, half, half};
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sources[k] + i));
+            __m256i b = k + 1 < taps ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sources[k + 1] + i)) : zero;
+            __m256i weights = _mm256_set1_epi32(pairs[k / 2]);
+            __m256i a_lo = _mm256_unpacklo_epi8(a, zero);
+            __m256i a_hi = _mm256_unpackhi_epi8(a, zero);
+            __m256i b_lo = _mm256_unpacklo_epi8(b, zero);
+            __m256i b_hi = _mm256_unpackhi_epi8(b, zero);
+            sums[0] = _mm256_add_epi32(sums[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(a_lo, b_lo), weights));
+            sums[1] = _mm256_add_epi32(sums[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(a_lo, b_lo), weights));
+            sums[2] = _mm256_add_epi32(sums[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(a_hi, b_hi), weights));
+            sums[3] = _mm256_add_epi32(sums[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(a_hi, b_hi), weights));
+        }
+        __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(sums[0], CONVOLVE_BITS), _mm256_srai_epi32(sums[1], CONVOLVE_BITS));
+        __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(sums[2], CONVOLVE_BITS), _mm256_srai_epi32(sums[3], CONVOLVE_BITS));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+inline __m128i sobel_magnitude_sse2(__m128i gx, __m128i gy)
+{
+    // gx * gx + gy * gy from one multiply-add of the interleaved gradients,
+    // capped at 255 squared where float square roots are exact enough
+    __m128i lo = _mm_unpacklo_epi16(gx, gy);
+    __m128i hi = _mm_unpackhi_epi16(gx, gy);
+    __m128 cap = _mm_set1_ps(255 * 255);
+    __m128 squared_lo = _mm_min_ps(_mm_cvtepi32_ps(_mm_madd_epi16(lo, lo)), cap);
+    __m128 squared_hi = _mm_min_ps(_mm_cvtepi32_ps(_mm_madd_epi16(hi, hi)), cap);
+    return _mm_packs_epi32(_mm_cvttps_epi32(_mm_sqrt_ps(squared_lo)), _mm_cvttps_epi32(_mm_sqrt_ps(squared_hi)));
+}
+
+int sobel_row_sse2(const unsigned char* above, const unsigned char* middle, const unsigned char* below,
+                   int channels, unsigned char* target, int bytes)
+/**
+ * Finds the gradient size of 8 bytes at a time, every channel including alpha
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8)
+    {
+        __m128i n[3][3];
+        const unsigned char* rows[3] = {above, middle, below};
+        for (int r = 0; r < 3; r++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                n[r][k] = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rows[r] + i + k * channels)), zero);
+            }
+        }
+        __m128i gx = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(n[0][2], n[2][2]), _mm_slli_epi16(n[1][2], 1)),
+                                   _mm_add_epi16(_mm_add_epi16(n[0][0], n[2][0]), _mm_slli_epi16(n[1][0], 1)));
+        __m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(n[2][0], n[2][2]), _mm_slli_epi16(n[2][1], 1)),
+                                   _mm_add_epi16(_mm_add_epi16(n[0][0], n[0][2]), _mm_slli_epi16(n[0][1], 1)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(target + i), _mm_packus_epi16(sobel_magnitude_sse2(gx, gy), zero));
+    }
+    return i;
+}
+
+IMAGE_TARGET_AVX2 int sobel_row_avx2(const unsigned char* above, const unsigned char* middle, const unsigned char* below,
+                                     int channels, unsigned char* target, int bytes)
+/**
+ * Finds the gradient size of 16 bytes at a time, every channel including alpha
+ * @return the number of bytes done, the caller finishes the rest
+ */
+{
+    __m256 cap = _mm256_set1_ps(255 * 255);
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m256i n[3][3];
+        const unsigned char* rows[3] = {above, middle, below};
+        for (int r = 0; r < 3; r++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                n[r][k] = load_u16_avx2(rows[r] + i + k * channels);
+            }
+        }
+        __m256i gx = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(n[0][2], n[2][2]), _mm256_slli_epi16(n[1][2], 1)),
+                                      _mm256_add_epi16(_mm256_add_epi16(n[0][0], n[2][0]), _mm256_slli_epi16(n[1][0], 1)));
+        __m256i gy = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(n[2][0], n[2][2]), _mm256_slli_epi16(n[2][1], 1)),
+                                      _mm256_add_epi16(_mm256_add_epi16(n[0][0], n[0][2]), _mm256_slli_epi16(n[0][1], 1)));
+
+        // Interleaving and packing both stay within 128 bit halves, so the order comes back
+        __m256i lo = _mm256_unpacklo_epi16(gx, gy);
+        __m256i hi = _mm256_unpackhi_epi16(gx, gy);
+        __m256 squared_lo = _mm256_min_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(lo, lo)), cap);
+        __m256 squared_hi = _mm256_min_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(hi, hi)), cap);
+        store_u8_avx2(target + i, _mm256_packs_epi32(_mm256_cvttps_epi32(_mm256_sqrt_ps(squared_lo)),
+                                                     _mm256_cvttps_epi32(_mm256_sqrt_ps(squared_hi))));
+    }
+    return i;
+}
+
+#endif
+
+void weighted_rows(const unsigned char* const* sources, const ConvolveWeights& weights, unsigned char* target, int bytes)
+/**
+ * Sets each byte of the target to the weighted sum of the same byte of every source
+ * @param sources One pointer per weight
+ * @param weights The weights
+ * @param target  Receives the sums, rounded and clipped
+ * @param bytes   Number of bytes
+ */
+{
+    int taps = static_cast<int>(weights.weights.size());
+    int i = 0;
+#ifdef IMAGE_HAVE_X86_SIMD
+    if (active_simd_level >= SIMD_AVX2)
+    {
+        i = weighted_rows_avx2(sources, &weights.pairs[0], taps, target, bytes);
+    } else if (active_simd_level >= SIMD_SSE2)
+    {
+        i = weighted_rows_sse2(sources, &weights.pairs[0], taps, target, bytes);
+    }
+#endif
+    for (; i < bytes; i++)
+    {
+        int sum = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += weights.weights[k] * sources[k][i];
+        }
+        target[i] = convolve_round(sum);
+    }
+}
+
+void separable_into(const Image& image, Image& target, const vector<double>& taps, BorderMode border)
+/**
+ * Convolves with the same kernel across and then down
+ * @param image  Source image
+ * @param target Receives the result, same size
+ * @param taps   Odd number of weights adding up to 1, the middle one on the pixel
+ * @param border How pixels beyond the edges are made up
+ */
+{
+    int radius = static_cast<int>(taps.size() / 2);
+    ConvolveWeights weights = make_convolve_weights(taps, true);
+    target.resize(image.width, image.height, image.channels);
+    int channels = image.channels;
+    int row_bytes = image.width * channels;
+    int band_rows = max(CONVOLVE_BAND_ROWS, 2 * radius + 1);
+    int bands = (image.height + band_rows - 1) / band_rows;
+    parallel_rows(bands, static_cast<long long>(image.width) * band_rows * static_cast<long long>(taps.size()), [&](int begin, int end)
+    {
+        Image band;
+        Image across;
+        vector<const unsigned char*> sources(taps.size());
+        for (int b = begin; b < end; b++)
+        {
+            int first = b * band_rows;
+            int last = min(first + band_rows, image.height);
+            int rows = last - first + 2 * radius;
+            border_band(image, first - radius, rows, radius, border, band);
+            across.resize(image.width, rows, channels);
+            for (int j = 0; j < rows; j++)
+            {
+                for (size_t k = 0; k < taps.size(); k++)
+                {
+                    sources[k] = band.row(j) + k * channels;
+                }
+                weighted_rows(&sources[0], weights, across.row(j), row_bytes);
+            }
+            for (int y = first; y < last; y++)
+            {
+                for (size_t k = 0; k < taps.size(); k++)
+                {
+                    sources[k] = across.row(y - first + static_cast<int>(k));
+                }
+                weighted_rows(&sources[0], weights, target.row(y), row_bytes);
+            }
+        }
+    });
+}
+
+void copy_alpha(const Image& image, Image& target)
+/**
+ * Copies the alpha of an image to another of the same size
+ */
+{
+    if (!image.has_alpha() || !target.has_alpha())
+    {
+        return;
+    }
+    for (int y = 0; y < image.height; y++)
+    {
+        const unsigned char* p = image.row(y);
+        unsigned char* q = target.row(y);
+        for (int x = 0; x < image.width; x++)
+        {
+            q[x * 4 + CHANNEL_ALPHA] = p[x * 4 + CHANNEL_ALPHA];
+        }
+    }
+}
+
+template <typename Filter>
+void filter_premultiplied(const Image& image, Image& target, bool keep_alpha, Filter filter)
+/**
+ * Runs a convolution, on premultiplied pixels if the image has alpha
+ * @param image      Source image
+ * @param target     Receives the result with straight alpha
+ * @param keep_alpha Give the result the alpha of the source, instead of the filtered alpha
+ * @param filter     Called with the pixels to filter and the image for the result
+ */
+{
+    if (!image.has_alpha())
+    {
+        filter(image, target);
+        return;
+    }
+    Image premultiplied;
+    premultiply_into(image, premultiplied);
+    filter(premultiplied, target);
+    if (keep_alpha)
+    {
+        copy_alpha(premultiplied, target);
+    }
+    unpremultiply_in_place(target);
+    image_pool.release(premultiplied);
+}
+
+void gaussian_blur_into(const Image& image, Image& target, double sigma, BorderMode border = BORDER_CLAMP)
+/**
+ * Blurs with a Gaussian kernel reaching three standard deviations
+ * @param image  Source image
+ * @param target Receives the result, same size
+ * @param sigma  Standard deviation in pixels, 0 copies the image
+ * @param border How pixels beyond the edges are made up
+ */
+{
+    TraceScope trace("filter", "gaussian_blur", image.pixel_count());
+    if (sigma <= 0)
+    {
+        target = image;
+        return;
+    }
+    int radius = max(1, static_cast<int>(ceil(3 * sigma)));
+    vector<double> taps(2 * radius + 1);
+    double total = 0;
+    for (int k = -radius; k <= radius; k++)
+    {
+        taps[k + radius] = exp(-k * k / (2 * sigma * sigma));
+        total += taps[k + radius];
+    }
+    for (size_t k = 0; k < taps.size(); k++)
+    {
+        taps[k] /= total;
+    }
+    filter_premultiplied(image, target, false, [&](const Image& source, Image& result)
+    {
+        separable_into(source, result, taps, border);
+    });
+}
+
+inline unsigned char box_average(unsigned int sum, unsigned int multiplier)
+{
+    // multiplier is 2^23 / count, and 255 * 2^23 still fits in 32 bits
+    return static_cast<unsigned char>((sum * multiplier + (1u << 22)) >> 23);
+}
+
+template <int CHANNELS>
+void box_row(const unsigned char* p, unsigned char* q, int width, int window, unsigned int multiplier)
+/**
+ * Averages a window of pixels across a padded row, sliding it a pixel at a time
+ * @param p          Row with window / 2 extra pixels either side
+ * @param q          Receives width averaged pixels
+ * @param width      Pixels to write
+ * @param window     Pixels averaged, odd
+ * @param multiplier 2^23 / window
+ */
+{
+    // The channel count is fixed so the running sums stay in registers
+    unsigned int sums[CHANNELS] = {};
+    for (int k = 0; k < window; k++)
+    {
+        for (int c = 0; c < CHANNELS; c++)
+        {
+            sums[c] += p[k * CHANNELS + c];
+        }
+    }
+    for (int c = 0; c < CHANNELS; c++)
+    {
+        q[c] = box_average(sums[c], multiplier);
+    }
+    const unsigned char* entering = p + window * CHANNELS;
+    for (int x = 1; x < width; x++)
+    {
+        for (int c = 0; c < CHANNELS; c++)
+        {
+            sums[c] += entering[c] - p[c];
+            q[x * CHANNELS + c] = box_average(sums[c], multiplier);
+        }
+        entering += CHANNELS;
+        p += CHANNELS;
+    }
+}
+
+void box_filter_into(const Image& image, Image& target, int radius, BorderMode border)
+/**
+ * Averages a square of 2 * radius + 1 pixels a side, every channel alike
+ * Running sums add the pixel entering the window and take away the one
+ * leaving it, across each row and then down each column, so every pixel
+ * costs the same whatever the radius
+ */
+{
+    target.resize(image.width, image.height, image.channels);
+    int channels = image.channels;
+    int row_bytes = image.width * channels;
+    int window = 2 * radius + 1;
+    unsigned int multiplier = static_cast<unsigned int>(round(static_cast<double>(1 << 23) / window));
+
+    // Bands twice as tall as the window, so the extra rows each band filters stay in proportion
+    int band_rows = max(CONVOLVE_BAND_ROWS, 2 * window);
+    int bands = (image.height + band_rows - 1) / band_rows;
+    parallel_rows(bands, static_cast<long long>(image.width) * band_rows * 2, [&](int begin, int end)
+    {
+        Image band;
+        Image across;
+        vector<unsigned int> sums(row_bytes);
+        for (int b = begin; b < end; b++)
+        {
+            int first = b * band_rows;
+            int last = min(first + band_rows, image.height);
+            int rows = last - first + 2 * radius;
+            border_band(image, first - radius, rows, radius, border, band);
+            across.resize(image.width, rows, channels);
+            for (int j = 0; j < rows; j++)
+            {
+                if (channels == 4)
+                {
+                    box_row<4>(band.row(j), across.row(j), image.width, window, multiplier);
+                } else
+                {
+                    box_row<3>(band.row(j), across.row(j), image.width, window, multiplier);
+                }
+            }
+
+            // Column sums of the first window, then slide it down a row at a time
+            fill(sums.begin(), sums.end(), 0);
+            for (int k = 0; k < window; k++)
+            {
+                const unsigned char* q = across.row(k);
+                for (int i = 0; i < row_bytes; i++)
+                {
+                    sums[i] += q[i];
+                }
+            }
+            unsigned char* p = target.row(first);
+            for (int i = 0; i < row_bytes; i++)
+            {
+                p[i] = box_average(sums[i], multiplier);
+            }
+            for (int y = first + 1; y < last; y++)
+            {
+                const unsigned char* entering = across.row(y - first + 2 * radius);
+                const unsigned char* leaving = across.row(y - first - 1);
+                p = target.row(y);
+                for (int i = 0; i < row_bytes; i++)
+                {
+                    sums[i] += entering[i] - leaving[i];
+                    p[i] = box_average(sums[i], multiplier);
+                }
+            }
+        }
+    });
+}
+
+void box_blur_into(const Image& image, Image& target, int radius, BorderMode border = BORDER_CLAMP)
+/**
+ * Blurs with the average of a square of 2 * radius + 1 pixels a side
+ * @param image  Source image
+ * @param target Receives the result, same size
+ * @param radius Pixels either side, 0 copies the image
+ * @param border How pixels beyond the edges are made up
+ */
+{
+    TraceScope trace("filter", "box_blur", image.pixel_count());
+    if (radius <= 0)
+    {
+        target = image;
+        return;
+    }
+    filter_premultiplied(image, target, false, [&](const Image& source, Image& result)
+    {
+        box_filter_into(source, result, radius, border);
+    });
+}
+
+void kernel_filter_into(const Image& image, Image& target, const ConvolutionKernel& kernel, BorderMode border)
+/**
+ * Convolves every channel with a square kernel
+ */
+{
+    int size = kernel.size;
+    int radius = size / 2;
+    ConvolveWeights weights = make_convolve_weights(kernel.weights, false);
+    target.resize(image.width, image.height, image.channels);
+    int channels = image.channels;
+    int row_bytes = image.width * channels;
+    int bands = (image.height + CONVOLVE_BAND_ROWS - 1) / CONVOLVE_BAND_ROWS;
+    parallel_rows(bands, static_cast<long long>(image.width) * CONVOLVE_BAND_ROWS * size * size, [&](int begin, int end)
+    {
+        Image band;
+        vector<const unsigned char*> sources(static_cast<size_t>(size) * size);
+        for (int b = begin; b < end; b++)
+        {
+            int first = b * CONVOLVE_BAND_ROWS;
+            int last = min(first + CONVOLVE_BAND_ROWS, image.height);
+            border_band(image, first - radius, last - first + 2 * radius, radius, border, band);
+            for (int y = first; y < last; y++)
+            {
+                for (int ky = 0; ky < size; ky++)
+                {
+                    for (int kx = 0; kx < size; kx++)
+                    {
+                        sources[ky * size + kx] = band.row(y - first + ky) + kx * channels;
+                    }
+                }
+                weighted_rows(&sources[0], weights, target.row(y), row_bytes);
+            }
+        }
+    });
+}
+
+void convolve_into(const Image& image, Image& target, const ConvolutionKernel& kernel, BorderMode border = BORDER_CLAMP)
+/**
+ * Convolves the colour channels with a square kernel, alpha is kept
+ * @param image  Source image
+ * @param target Receives the result, same size
+ * @param kernel The kernel, usually 3x3 or 5x5
+ * @param border How pixels beyond the edges are made up
+ */
+{
+    TraceScope trace("filter", "convolve", image.pixel_count());
+    filter_premultiplied(image, target, true, [&](const Image& source, Image& result)
+    {
+        kernel_filter_into(source, result, kernel, border);
+    });
+}
+
+void sobel_filter_into(const Image& image, Image& target, BorderMode border)
+/**
+ * Sets every channel to the size of its Sobel gradient
+ */
+{
+    target.resize(image.width, image.height, image.channels);
+    int channels = image.channels;
+    int row_bytes = image.width * channels;
+    int bands = (image.height + CONVOLVE_BAND_ROWS - 1) / CONVOLVE_BAND_ROWS;
+    parallel_rows(bands, static_cast<long long>(image.width) * CONVOLVE_BAND_ROWS * 9, [&](int begin, int end)
+    {
+        Image band;
+        for (int b = begin; b < end; b++)
+        {
+            int first = b * CONVOLVE_BAND_ROWS;
+            int last = min(first + CONVOLVE_BAND_ROWS, image.height);
+            border_band(image, first - 1, last - first + 2, 1, border, band);
+            for (int y = first; y < last; y++)
+            {
+                const unsigned char* above = band.row(y - first);
+                const unsigned char* middle = band.row(y - first + 1);
+                const unsigned char* below = band.row(y - first + 2);
+                unsigned char* p = target.row(y);
+                int i = 0;
+#ifdef IMAGE_HAVE_X86_SIMD
+                if (active_simd_level >= SIMD_AVX2)
+                {
+                    i = sobel_row_avx2(above, middle, below, channels, p, row_bytes);
+                } else if (active_simd_level >= SIMD_SSE2)
+                {
+                    i = sobel_row_sse2(above, middle, below, channels, p, row_bytes);
+                }
+#endif
+                for (; i < row_bytes; i++)
+                {
+                    int left = i;
+                    int right = i + 2 * channels;
+                    int gx = (above[right] + 2 * middle[right] + below[right])
+                           - (above[left] + 2 * middle[left] + below[left]);
+                    int gy = (below[left] + 2 * below[left + channels] + below[right])
+                           - (above[left] + 2 * above[left + channels] + above[right]);
+                    // Below 255 squared, float square roots never round up to the next whole number
+                    int squared = gx * gx + gy * gy;
+                    p[i] = squared >= 255 * 255 ? 255 : static_cast<unsigned char>(sqrtf(static_cast<float>(squared)));
+                }
+            }
+        }
+    });
+}
+
+void sobel_into(const Image& image, Image& target, BorderMode border = BORDER_CLAMP)
+/**
+ * Finds edges, each colour channel becomes the size of its Sobel gradient
+ * @param image  Source image
+ * @param target Receives the edges, same size, alpha is kept
+ * @param border How pixels beyond the edges are made up
+ */
+{
+    TraceScope trace("filter", "sobel", image.pixel_count());
+    filter_premultiplied(image, target, true, [&](const Image& source, Image& result)
+    {
+        sobel_filter_into(source, result, border);
+    });
+}
+
+ConvolutionKernel sharpen_kernel(double amount)
+/**
+ * Builds a 3x3 kernel that adds amount times the difference from the
+ * four neighbours, 1 gives the usual 0 -1 0 / -1 5 -1 / 0 -1 0
+ */
+{
+    ConvolutionKernel kernel = {3, vector<double>(9, 0)};
+    kernel.weights[1] = kernel.weights[3] = kernel.weights[5] = kernel.weights[7] = -amount;
+    kernel.weights[4] = 1 + 4 * amount;
+    return kernel;
+}
+
+ConvolutionKernel emboss_kernel()
+/**
+ * Builds a 3x3 kernel that lights edges from the top left
+ */
+{
+    const double weights[] = {-2, -1, 0, -1, 1, 1, 0, 1, 2};
+    ConvolutionKernel kernel = {3, vector<double>(weights, weights + 9)};
+    return kernel;
+}
+
+
+//
+// Alpha compositing
+// Blending works on premultiplied rows, so laying one pixel over another
+// is a multiply and an add per channel with no division, which the SIMD
+// kernels do 4 or 8 at a time.
+//
+
+void blend_premultiplied_row(unsigned char* target, const unsigned char* source, int width, int opacity)
+/**
+ * Lays premultiplied BGRA pixels over others (Porter-Duff source over)
+ * Every channel becomes top * opacity + bottom * (1 - top alpha * opacity)
+ * @param target  Bottom pixels, receives the result
+ * @param source  Top pixels
+ * @param width   Number of pixels
+ * @param opacity How much of the top pixels shows, 0 to 255
+ */
+{
+    int x = blend_row_simd(target, source, width, opacity);
+    for (target += x * 4, source += x * 4; x < width; x++)
+    {
+        int keep = 255 - div255(source[CHANNEL_ALPHA] * opacity);
+        for (int c = 0; c < 4; c++)
+        {
+            // Same saturation as the vector code for pixels that are not
+            // properly premultiplied
+            target[c] = min(255, div255(source[c] * opacity) + div255(target[c] * keep));
+        }
+        target += 4;
+        source += 4;
+    }
+}
+
+
+//
+// In place versions of the processes, working on Image
+// Point filters modify the image they are given, geometric filters
+// write into a destination image whose buffer is reused when possible.
+// They produce the same pixels as process_01 to process_11 and print nothing.
+// Point filters work a row at a time through the *_row functions, which pick
+// the vector kernel when it reproduces the process exactly, and the fused
+// passes of FilterPipeline run the same functions.
+//
+
+// Exponent and strength process_01 uses for its vignette
+const double VIGNETTE_EXPONENT = 1.5;
+const double VIGNETTE_STRENGTH = 1;
+
+/**
+ * Vignette gradient split into a factor per row and a factor per column
+ * The gradient at (y, x) is rows[y] * columns[x], where each factor is
+ * 1 - strength * (2 * distance from the center)^exponent
+ */
+struct VignetteMask
+{
+    int width;
+    int height;
+    double exponent;
+    double strength;
+    vector<double> rows;
+    vector<double> columns;
+};
+
+void vignette_factors(vector<double>& factors, int size, double exponent, double strength)
+/**
+ * Calculates the vignette factors along one side of the image
+ * With the default exponent and strength these are the values process_01 uses
+ * @param factors  Receives one factor per row or column
+ * @param size     Number of rows or columns
+ * @param exponent How quickly the gradient falls off towards the edges
+ * @param strength How dark the edges get, 0 to 1
+ */
+{
+    factors.resize(size);
+    for (int i = 0; i < size; i++)
+    {
+        double factor = 1 - strength * pow(2*abs(.5 - static_cast<double>(i)/static_cast<double>(size-1)),exponent);
+        // Keeps results in range for strengths above 1
+        factors[i] = min(1.0, max(0.0, factor));
+    }
+}
+
+// Masks already calculated, most recently used first
+const size_t VIGNETTE_CACHE_SIZE = 16;
+vector<shared_ptr<const VignetteMask>> vignette_cache;
+mutex vignette_cache_lock;
+
+shared_ptr<const VignetteMask> get_vignette_mask(int width, int height, double exponent = VIGNETTE_EXPONENT, double strength = VIGNETTE_STRENGTH)
+/**
+ * Gets the vignette mask for an image size, calculating it on first use
+ * Recently used masks are kept so a batch of same sized images
+ * only calculates its mask once
+ * @param width    Width of the image
+ * @param height   Height of the image
+ * @param exponent How quickly the gradient falls off towards the edges
+ * @param strength How dark the edges get, 0 to 1
+ * @return the shared mask
+ */
+{
+    lock_guard<mutex> lock(vignette_cache_lock);
+    for (size_t i = 0; i < vignette_cache.size(); i++)
+    {
+        const VignetteMask& mask = *vignette_cache[i];
+        if (mask.width == width && mask.height == height && mask.exponent == exponent && mask.strength == strength)
+        {
+            // Move to the front so it is evicted last
+            shared_ptr<const VignetteMask> found = vignette_cache[i];
+            vignette_cache.erase(vignette_cache.begin() + i);
+            vignette_cache.insert(vignette_cache.begin(), found);
+            return found;
+        }
+    }
+
+    shared_ptr<VignetteMask> mask(new VignetteMask());
+    mask->width = width;
+    mask->height = height;
+    mask->exponent = exponent;
+    mask->strength = strength;
+    vignette_factors(mask->rows, height, exponent, strength);
+    vignette_factors(mask->columns, width, exponent, strength);
+
+    vignette_cache.insert(vignette_cache.begin(), mask);
+    if (vignette_cache.size() > VIGNETTE_CACHE_SIZE)
+    {
+        vignette_cache.pop_back();
+    }
+    return mask;
+}
+
+void vignette_row(unsigned char* row, int width, int channels, double dist_y, const double* columns)
+/**
+ * Applies the vignette gradient to a row, same multiplication order as process_01
+ * @param row      First pixel of the row
+ * @param width    Number of pixels
+ * @param channels Bytes per pixel
+ * @param dist_y   Factor of the row
+ * @param columns  Factor of each column
+ */
+{
+    for (int x = 0; x < width; x++)
+    {
+        row[CHANNEL_RED] = static_cast<int>(round(row[CHANNEL_RED] * dist_y * columns[x]));
+        row[CHANNEL_GREEN] = static_cast<int>(round(row[CHANNEL_GREEN] * dist_y * columns[x]));
+        row[CHANNEL_BLUE] = static_cast<int>(round(row[CHANNEL_BLUE] * dist_y * columns[x]));
+        row += channels;
+    }
+}
+
+void claredon_row(unsigned char* row, int width, int channels, const ToneScale& scale,
+                  const ToneCurve& bright, const ToneCurve& dark)
+/**
+ * Applies process_02 to a row
+ * Scaling factors the vector code cannot reproduce use the lookup tables
+ * @param scale  Multipliers from make_tone_scale()
+ * @param bright Lighten curve for bright pixels
+ * @param dark   Darken curve for dark pixels
+ */
+{
+    if (scale.exact && channels == 3)
+    {
+        int x = claredon_row_simd(row, width, scale);
+        for (row += x * channels; x < width; x++)
+        {
+            claredon_pixel(row, scale);
+            row += channels;
+        }
+        return;
+    }
+    for (int x = 0; x < width; x++)
+    {
+        // Average above 170 is a sum above 510, below 90 is a sum below 270
+        int sum = row[CHANNEL_RED] + row[CHANNEL_GREEN] + row[CHANNEL_BLUE];
+        const unsigned char* table = sum > 510 ? bright.table : (sum < 270 ? dark.table : NULL);
+        if (table)
+        {
+            row[CHANNEL_RED] = table[row[CHANNEL_RED]];
+            row[CHANNEL_GREEN] = table[row[CHANNEL_GREEN]];
+            row[CHANNEL_BLUE] = table[row[CHANNEL_BLUE]];
+        }
+        row += channels;
+    }
+}
+
+void greyscale_row(unsigned char* row, int width, int channels, GreyMode mode)
+/**
+ * Changes a row to greys, the average is the same as process_03
+ */
+{
+    int x = channels == 3 ? greyscale_row_simd(row, width, mode) : 0;
+    for (row += x * channels; x < width; x++)
+    {
+        greyscale_pixel(row, mode);
+        row += channels;
+    }
+}
+
+void black_white_row(unsigned char* row, int width, int channels, int threshold)
+/**
+ * Turns a row black and white, same as process_07 with its threshold
+ */
+{
+    bool use_simd = channels == 3 && threshold >= 0 && threshold <= 256;
+    int x = use_simd ? black_white_row_simd(row, width, threshold) : 0;
+    for (row += x * channels; x < width; x++)
+    {
+        black_white_pixel(row, threshold);
+        row += channels;
+    }
+}
+
+void tone_row(unsigned char* row, int width, int channels, const ToneScale& scale, const ToneCurve& curve, bool lighten)
+/**
+ * Lightens or darkens a row like process_08 or process_09
+ * @param scale   Multipliers from make_tone_scale(), when not exact the curve is used
+ * @param curve   Lookup table with the same effect
+ * @param lighten True to lighten, false to darken
+ */
+{
+    if (!scale.exact || channels != 3)
+    {
+        curve_row(row, width, channels, curve);
+        return;
+    }
+    int bytes = width * channels;
+    unsigned int multiplier = lighten ? scale.lighten : scale.darken;
+    for (int i = tone_row_simd(row, bytes, multiplier, lighten); i < bytes; i++)
+    {
+        row[i] = lighten ? fixed_lighten(row[i], multiplier) : fixed_darken(row[i], multiplier);
+    }
+}
+
+void black_white_rgb_row(unsigned char* row, int width, int channels)
+/**
+ * Applies process_10 to a row
+ */
+{
+    int x = channels == 3 ? black_white_rgb_row_simd(row, width) : 0;
+    for (row += x * channels; x < width; x++)
+    {
+        black_white_rgb_pixel(row);
+        row += channels;
+    }
+}
+
+void vignette_in_place(Image& image, double exponent = VIGNETTE_EXPONENT, double strength = VIGNETTE_STRENGTH)
+/**
+ * Adds a vignette to the image, same as process_01 with the default settings
+ * @param image    The image to be editted
+ * @param exponent How quickly the gradient falls off towards the edges
+ * @param strength How dark the edges get, 0 to 1
+ */
+{
+    TraceScope trace("filter", "vignette", image.pixel_count());
+    shared_ptr<const VignetteMask> mask = get_vignette_mask(image.width, image.height, exponent, strength);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            vignette_row(image.row(y), image.width, image.channels, mask->rows[y], &mask->columns[0]);
+        }
+    });
+}
+
+void claredon_in_place(Image& image, double scaling)
+/**
+ * Makes a high contrast version of the image, same as process_02
+ * @param image   The image to be editted
+ * @param scaling Strength of the effect on the image
+ */
+{
+    TraceScope trace("filter", "claredon", image.pixel_count());
+    ToneScale scale = make_tone_scale(scaling);
+    shared_ptr<const ToneCurve> bright = get_tone_curve(CURVE_LIGHTEN, scaling);
+    shared_ptr<const ToneCurve> dark = get_tone_curve(CURVE_DARKEN, scaling);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            claredon_row(image.row(y), image.width, image.channels, scale, *bright, *dark);
+        }
+    });
+}
+
+void greyscale_in_place(Image& image, GreyMode mode = GREY_AVERAGE)
+/**
+ * Changes the image to greyscale, the average is the same as process_03
+ * @param image The image to be editted
+ * @param mode  How colours become greys
+ */
+{
+    TraceScope trace("filter", "greyscale", image.pixel_count());
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            greyscale_row(image.row(y), image.width, image.channels, mode);
+        }
+    });
+}
+
+void greyscale_into(const Image& source, Image& target, GreyMode mode = GREY_AVERAGE)
+/**
+ * Makes a single channel image of the greys of an image
+ * Holds a third of the bytes of greyscale_in_place(), alpha is dropped
+ * @param source The image to read
+ * @param target Receives the greys, resized to fit
+ * @param mode   How colours become greys
+ */
+{
+    TraceScope trace("filter", "greyscale", source.pixel_count());
+    target.resize(source.width, source.height, 1);
+    bool use_simd = source.channels == 3;
+    parallel_rows(source.height, source.width, [&](int begin, int end)
+    {
+        // The kernels work in place, so each row is greyed in a copy
+        // that stays in cache and then every third byte is kept
+        vector<unsigned char> scratch(use_simd ? source.width * 3 : 0);
+        for (int y = begin; y < end; y++)
+        {
+            const unsigned char* p = source.row(y);
+            unsigned char* grey = target.row(y);
+            int x = 0;
+            if (use_simd)
+            {
+                memcpy(&scratch[0], p, scratch.size());
+                x = greyscale_row_simd(&scratch[0], source.width, mode);
+                for (int i = 0; i < x; i++)
+                {
+                    grey[i] = scratch[i * 3];
+                }
+            }
+            for (p += x * source.channels; x < source.width; x++)
+            {
+                grey[x] = grey_value(mode, p[CHANNEL_RED], p[CHANNEL_GREEN], p[CHANNEL_BLUE]);
+                p += source.channels;
+            }
+        }
+    });
+}
+
+void black_white_in_place(Image& image, int threshold = BLACK_WHITE_THRESHOLD)
+/**
+ * Changes the image to high contrast black and white, the default
+ * threshold is the same as process_07
+ * @param image     The image to be editted
+ * @param threshold Average at or above which a pixel turns white
+ */
+{
+    TraceScope trace("filter", "black_white", image.pixel_count());
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            black_white_row(image.row(y), image.width, image.channels, threshold);
+        }
+    });
+}
+
+void lighten_in_place(Image& image, double scaling)
+/**
+ * Lightens image by the scaling factor, same as process_08
+ * @param image   The image to be editted
+ * @param scaling Strength of the effect on the image
+ */
+{
+    TraceScope trace("filter", "lighten", image.pixel_count());
+    ToneScale scale = make_tone_scale(scaling);
+    shared_ptr<const ToneCurve> curve = get_tone_curve(CURVE_LIGHTEN, scaling);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            tone_row(image.row(y), image.width, image.channels, scale, *curve, true);
+        }
+    });
+}
+
+void darken_in_place(Image& image, double scaling)
+/**
+ * Darkens image by the scaling factor, same as process_09
+ * @param image   The image to be editted
+ * @param scaling Strength of the effect on the image
+ */
+{
+    TraceScope trace("filter", "darken", image.pixel_count());
+    ToneScale scale = make_tone_scale(scaling);
+    shared_ptr<const ToneCurve> curve = get_tone_curve(CURVE_DARKEN, scaling);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            tone_row(image.row(y), image.width, image.channels, scale, *curve, false);
+        }
+    });
+}
+
+void curve_in_place(Image& image, const ToneCurve& curve)
+/**
+ * Passes every colour channel of the image through a tone curve
+ * @param image The image to be editted
+ * @param curve The curve to apply
+ */
+{
+    TraceScope trace("filter", "curve", image.pixel_count());
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            curve_row(image.row(y), image.width, image.channels, curve);
+        }
+    });
+}
+
+void black_white_rgb_in_place(Image& image)
+/**
+ * Extreme contrast, extreme saturation, same as process_10
+ * @param image The image to be editted
+ */
+{
+    TraceScope trace("filter", "black_white_rgb", image.pixel_count());
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            black_white_rgb_row(image.row(y), image.width, image.channels);
+        }
+    });
+}
+
+void posterize_in_place(Image& image, int levels)
+/**
+ * Reduces every channel to a number of evenly spaced levels
+ * @param image  The image to be editted
+ * @param levels Values each channel keeps, from 2 to 256
+ */
+{
+    TraceScope trace("filter", "posterize", image.pixel_count());
+    shared_ptr<const ToneCurve> curve = get_tone_curve(CURVE_POSTERIZE, levels);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            curve_row(image.row(y), image.width, image.channels, *curve);
+        }
+    });
+}
+
+// Pixels per side of the blocks rotations copy, so the rows being read
+// stay in cache while the output is written a row at a time
+const int ROTATE_TILE = 64;
+
+inline void copy_pixel(unsigned char* target, const unsigned char* source, int channels)
+{
+    if (channels == 3)
+    {
+        target[0] = source[0];
+        target[1] = source[1];
+        target[2] = source[2];
+    } else
+    {
+        memcpy(target, source, channels);
+    }
+}
+
+void rotate_quarter_into(const Image& image, Image& rotated_image, bool clockwise)
+/**
+ * Rotates the image by a quarter turn in one pass, one tile at a time
+ * @param image         The image to rotate
+ * @param rotated_image Receives the rotated image
+ * @param clockwise     True for 90 degrees clockwise, false for counterclockwise
+ */
+{
+    rotated_image.resize(image.height, image.width, image.channels);
+    int channels = image.channels;
+    int tile_rows = (rotated_image.height + ROTATE_TILE - 1) / ROTATE_TILE;
+    ptrdiff_t step = clockwise ? -static_cast<ptrdiff_t>(image.stride) : image.stride;
+
+    parallel_rows(tile_rows, static_cast<long long>(ROTATE_TILE) * rotated_image.width, [&](int begin, int end)
+    {
+        for (int tile_y = begin; tile_y < end; tile_y++)
+        {
+            int y_first = tile_y * ROTATE_TILE;
+            int y_last = min(y_first + ROTATE_TILE, rotated_image.height);
+            for (int x_first = 0; x_first < rotated_image.width; x_first += ROTATE_TILE)
+            {
+                int x_last = min(x_first + ROTATE_TILE, rotated_image.width);
+                for (int y = y_first; y < y_last; y++)
+                {
+                    // Clockwise, each rotated row is a column of the original
+                    // read from the bottom up, counterclockwise from the top down
+                    unsigned char* target = rotated_image.pixel(y, x_first);
+                    const unsigned char* source = clockwise
+                        ? image.pixel(image.height - 1 - x_first, y)
+                        : image.pixel(x_first, image.width - 1 - y);
+                    for (int x = x_first; x < x_last; x++)
+                    {
+                        copy_pixel(target, source, channels);
+                        target += channels;
+                        source += step;
+                    }
+                }
+            }
+        }
+    });
+}
+
+void rotate_90_into(const Image& image, Image& rotated_image)
+/**
+ * Rotates the image by 90 degrees clockwise, same as process_04
+ * @param image         The image to rotate
+ * @param rotated_image Receives the rotated image
+ */
+{
+    TraceScope trace("filter", "rotate_90", image.pixel_count());
+    rotate_quarter_into(image, rotated_image, true);
+}
+
+void reverse_row(unsigned char* target, const unsigned char* source, int width, int channels)
+/**
+ * Copies a row of pixels in reverse order, target and source must not overlap
+ */
+{
+    const unsigned char* p = source + (width - 1) * channels;
+    for (int x = 0; x < width; x++)
+    {
+        copy_pixel(target, p, channels);
+        target += channels;
+        p -= channels;
+    }
+}
+
+void rotate_180_in_place(Image& image)
+/**
+ * Rotates the image by 180 degrees without a second image
+ * Swaps each row with its mirror row, both reversed
+ * @param image The image to rotate
+ */
+{
+    TraceScope trace("filter", "rotate_180", image.pixel_count());
+    int channels = image.channels;
+    int row_bytes = image.width * channels;
+    parallel_rows((image.height + 1) / 2, 2LL * image.width, [&](int begin, int end)
+    {
+        vector<unsigned char> top(row_bytes);
+        for (int y = begin; y < end; y++)
+        {
+            unsigned char* upper = image.row(y);
+            unsigned char* lower = image.row(image.height - 1 - y);
+            memcpy(&top[0], upper, row_bytes);
+            if (upper == lower)
+            {
+                // Middle row of an odd height image
+                reverse_row(upper, &top[0], image.width, channels);
+            } else
+            {
+                reverse_row(upper, lower, image.width, channels);
+                reverse_row(lower, &top[0], image.width, channels);
+            }
+        }
+    });
+}
+
+void rotate_180_into(const Image& image, Image& rotated_image)
+/**
+ * Rotates the image by 180 degrees into another image
+ * @param image         The image to rotate
+ * @param rotated_image Receives the rotated image
+ */
+{
+    rotated_image.resize(image.width, image.height, image.channels);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            reverse_row(rotated_image.row(y), image.row(image.height - 1 - y), image.width, image.channels);
+        }
+    });
+}
+
+int normalize_turns(int turns)
+/**
+ * Reduces a number of turns to the clockwise turns with the same result
+ * @param turns Number of clockwise turns, negative for counterclockwise
+ * @return 0 to 3
+ */
+{
+    return ((turns % 4) + 4) % 4;
+}
+
+void rotate_into(const Image& image, Image& rotated_image, int turns)
+/**
+ * Rotates the image by 90 degrees multiple times, same as process_05
+ * Every number of turns is a single pass over the image
+ * @param image         The image to rotate
+ * @param rotated_image Receives the rotated image
+ * @param turns         Number of clockwise turns, negative for counterclockwise
+ */
+{
+    TraceScope trace("filter", "rotate", image.pixel_count());
+    switch (normalize_turns(turns))
+    {
+        case 1:
+            rotate_quarter_into(image, rotated_image, true);
+            break;
+        case 2:
+            rotate_180_into(image, rotated_image);
+            break;
+        case 3:
+            rotate_quarter_into(image, rotated_image, false);
+            break;
+        default:
+            rotated_image = image;
+            break;
+    }
+}
+
+void nearest_into(const Image& image, Image& target, const vector<int>& rows, const vector<int>& columns)
+/**
+ * Copies the chosen source pixels into an image of the table sizes
+ * @param image   The source image
+ * @param target  Receives one row per entry of rows, one column per entry of columns
+ * @param rows    Source row for each target row
+ * @param columns Source column for each target column
+ */
+{
+    int width = static_cast<int>(columns.size());
+    int height = static_cast<int>(rows.size());
+    target.resize(width, height, image.channels);
+    parallel_rows(height, width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            const unsigned char* source = image.row(rows[y]);
+            unsigned char* p = target.row(y);
+            for (int x = 0; x < width; x++)
+            {
+                copy_pixel(p, source + columns[x] * image.channels, image.channels);
+                p += image.channels;
+            }
+        }
+    });
+}
+
+void resize_into(const Image& image, Image& resized_image, int width, int height, ResampleFilter filter)
+/**
+ * Resizes the image to an exact size with a resampling filter
+ * Nearest picks source pixels the way process_06 does for the same ratio
+ * @param image         The image to resize
+ * @param resized_image Receives the resized image
+ * @param width         New width in pixels
+ * @param height        New height in pixels
+ * @param filter        How new pixels are calculated from the old ones
+ */
+{
+    if (width <= 0 || height <= 0 || image.empty())
+    {
+        resized_image.resize(max(width, 0), max(height, 0), image.channels);
+        return;
+    }
+
+    if (filter == RESAMPLE_NEAREST)
+    {
+        vector<int> rows;
+        vector<int> columns;
+        nearest_indices(rows, image.height, height, static_cast<float>(height) / image.height);
+        nearest_indices(columns, image.width, width, static_cast<float>(width) / image.width);
+        nearest_into(image, resized_image, rows, columns);
+        return;
+    }
+
+    if (width == image.width && height == image.height)
+    {
+        resized_image = image;
+        return;
+    }
+
+    // Images with alpha are resampled premultiplied, so clear pixels add no colour
+    Image premultiplied;
+    const Image* source = &image;
+    if (image.has_alpha())
+    {
+        premultiply_into(image, premultiplied);
+        source = &premultiplied;
+    }
+
+    // Sides that keep their size skip their pass, the image between passes comes from the pool
+    Image temp;
+    const Image* rows_done = source;
+    if (width != image.width)
+    {
+        ResampleAxis horizontal;
+        build_resample_axis(horizontal, image.width, width, filter);
+        if (height != image.height)
+        {
+            image_pool.resize(temp, width, image.height, image.channels);
+        }
+        resample_rows(*source, height != image.height ? temp : resized_image, horizontal);
+        rows_done = height != image.height ? &temp : &resized_image;
+    }
+    if (height != image.height)
+    {
+        ResampleAxis vertical;
+        build_resample_axis(vertical, image.height, height, filter);
+        resample_columns(*rows_done, resized_image, vertical);
+    }
+    if (image.has_alpha())
+    {
+        unpremultiply_in_place(resized_image);
+    }
+    image_pool.release(temp);
+    image_pool.release(premultiplied);
+}
+
+void scale_into(const Image& image, Image& scaled_image, float scale_x, float scale_y, ResampleFilter filter = RESAMPLE_NEAREST)
+/**
+ * Scales the image larger or smaller, same as process_06 with the nearest filter
+ * @param image        The image to scale
+ * @param scaled_image Receives the scaled image
+ * @param scale_x      Amount to scale the image by on the x axis
+ * @param scale_y      Amount to scale the image by on the y axis
+ * @param filter       How new pixels are calculated from the old ones
+ */
+{
+    TraceScope trace("filter", "scale", image.pixel_count());
+    // Prevents dividing by zero
+    if (scale_x == 0)
+    {
+        scale_x = 1;
+    }
+    if (scale_y == 0)
+    {
+        scale_y = 1;
+    }
+
+    int scaled_height = static_cast<int>(round(image.height * scale_y));
+    int scaled_width = static_cast<int>(round(image.width * scale_x));
+    if (filter != RESAMPLE_NEAREST || scaled_width <= 0 || scaled_height <= 0)
+    {
+        resize_into(image, scaled_image, scaled_width, scaled_height, filter);
+        return;
+    }
+
+    // Source rows and columns use the given scale, like process_06
+    vector<int> rows;
+    vector<int> columns;
+    nearest_indices(rows, image.height, scaled_height, scale_y);
+    nearest_indices(columns, image.width, scaled_width, scale_x);
+    nearest_into(image, scaled_image, rows, columns);
+}
+
+bool overlap_views(Image& image, const Image& layer_image, int x, int y, ImageView& target, ConstImageView& source)
+/**
+ * Finds the part of a top image that lands on the bottom one
+ * @param image       The image on the bottom
+ * @param layer_image The image on top
+ * @param x           Column of the bottom image the top left of the layer goes on, may be negative
+ * @param y           Row of the bottom image the top left of the layer goes on, may be negative
+ * @param target      Receives the covered part of the bottom image
+ * @param source      Receives the part of the top image that covers it
+ * @return False if the images do not overlap
+ */
+{
+    // In 64 bits, so offsets near the limits of int cannot overflow
+    long long left = max(x, 0);
+    long long top = max(y, 0);
+    long long right = min(static_cast<long long>(image.width), static_cast<long long>(x) + layer_image.width);
+    long long bottom = min(static_cast<long long>(image.height), static_cast<long long>(y) + layer_image.height);
+    if (right <= left || bottom <= top)
+    {
+        return false;
+    }
+
+    // Overlapping, so every value below lies inside one of the images
+    int width = static_cast<int>(right - left);
+    int height = static_cast<int>(bottom - top);
+    target = image.view(static_cast<int>(left), static_cast<int>(top), width, height);
+    source = layer_image.view(static_cast<int>(left - x), static_cast<int>(top - y), width, height);
+    return true;
+}
+
+void blend_normal_span(unsigned char* target, int target_channels, const unsigned char* source, int source_channels,
+                       int width, double scaling, vector<unsigned char>& bottom, vector<unsigned char>& top)
+/**
+ * Blends a run of top pixels into bottom ones, the formula of process_11
+ * If either has alpha they are blended with premultiplied alpha instead
+ * @param target          Pixels on the bottom, receives the result
+ * @param target_channels Bytes per bottom pixel
+ * @param source          Pixels on top
+ * @param source_channels Bytes per top pixel
+ * @param width           Number of pixels
+ * @param scaling         The transparency of the top pixels
+ * @param bottom          Scratch space for premultiplied bottom pixels
+ * @param top             Scratch space for premultiplied top pixels
+ */
+{
+    if (target_channels == 4 || source_channels == 4)
+    {
+        int opacity = static_cast<int>(round(min(max(1 - scaling, 0.0), 1.0) * 255));
+        bottom.resize(width * 4);
+        top.resize(width * 4);
+        premultiply_row(&bottom[0], target, width, target_channels);
+        premultiply_row(&top[0], source, width, source_channels);
+        blend_premultiplied_row(&bottom[0], &top[0], width, opacity);
+        unpremultiply_row(target, &bottom[0], width, target_channels);
+        return;
+    }
+    for (int x = 0; x < width; x++)
+    {
+        for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+        {
+            target[c] = static_cast<int>(target[c] * (scaling) + source[c] * (1 - scaling));
+        }
+        target += target_channels;
+        source += source_channels;
+    }
+}
+
+void blend_view(const ImageView& target, const ConstImageView& source, double scaling)
+/**
+ * Blends one view into another of the same size, see blend_normal_span()
+ * @param target  Pixels on the bottom, receives the result
+ * @param source  Pixels on top
+ * @param scaling The transparency of the top pixels
+ */
+{
+    parallel_rows(target.height, target.width, [&](int begin, int end)
+    {
+        vector<unsigned char> bottom;
+        vector<unsigned char> top;
+        for (int y = begin; y < end; y++)
+        {
+            blend_normal_span(target.row(y), target.channels, source.row(y), source.channels, target.width, scaling, bottom, top);
+        }
+    });
+}
+
+void layer_in_place(Image& image, const Image& layer_image, double scaling, int x, int y)
+/**
+ * Layers an image on top of this one at any position
+ * Parts of the top image outside the bottom one are left out
+ * @param image       The image on the bottom, receives the result
+ * @param layer_image The image layered on top
+ * @param scaling     The transparency of the top image
+ * @param x           Column the left edge of the top image goes on, may be negative
+ * @param y           Row the top edge of the top image goes on, may be negative
+ */
+{
+    ImageView target;
+    ConstImageView source;
+    if (!overlap_views(image, layer_image, x, y, target, source))
+    {
+        return;
+    }
+    TraceScope trace("filter", "layer", static_cast<long long>(target.width) * target.height);
+    blend_view(target, source, scaling);
+}
+
+int centered_offset(int size, int layer_size)
+/**
+ * Gets where a top image starts so it is centered, as process_11 does
+ * A larger top image gets a negative offset, so it is cropped evenly from either side
+ */
+{
+    return (size - layer_size)/2;
+}
+
+void layer_into(const Image& image, const Image& layer_image, double scaling, Image& layered_image)
+/**
+ * Layers one image on top of the other, same as process_11
+ * The top image is centered on the bottom one and cropped to fit
+ * If either image has alpha they are blended with premultiplied alpha
+ * instead, and the result keeps the alpha of the bottom image
+ * @param image         The image on the bottom
+ * @param layer_image   The image layered on top
+ * @param scaling       The transparency of the top image
+ * @param layered_image Receives the layered image
+ */
+{
+    layered_image = image;
+    layer_in_place(layered_image, layer_image, scaling, centered_offset(image.width, layer_image.width),
+                   centered_offset(image.height, layer_image.height));
+}
+
+
+//
+// Compositing
+// Lays any number of images over one image in a single pass. The image is
+// walked a tile of each row at a time and every layer covering the tile
+// is blended into it while it is in cache, so the image is neither copied
+// nor read again for each layer, unlike chaining layer_into() calls.
+//
+
+// How a layer combines with the pixels under it
+enum BlendMode
+{
+    BLEND_NORMAL = 0,       // Top over bottom, the same as layer_in_place()
+    BLEND_MULTIPLY,         // Darkens, bottom * top
+    BLEND_SCREEN,           // Lightens, the inverse of multiplying the inverses
+    BLEND_OVERLAY,          // Multiply on dark bottom pixels, screen on light ones
+    BLEND_ADD,              // bottom + top, clipped to white
+    BLEND_DIFFERENCE        // |bottom - top|
+};
+
+// One image of a composite
+struct CompositeLayer
+{
+    const Image* image;     // Top image, must outlive the composite
+    double scaling;         // Transparency, 0 shows the layer fully, as in process_11
+    int x;                  // Column of the left edge, may be negative
+    int y;                  // Row of the top edge, may be negative
+    BlendMode mode;
+};
+
+// Pixels of a row blended by every layer before moving along the row
+const int COMPOSITE_TILE = 256;
+
+inline int blend_channel(BlendMode mode, int bottom, int top)
+/**
+ * Blends one channel value of an opaque top pixel with the bottom one
+ */
+{
+    switch (mode)
+    {
+        case BLEND_MULTIPLY: return div255(bottom * top);
+        case BLEND_SCREEN: return bottom + top - div255(bottom * top);
+        case BLEND_OVERLAY: return bottom < 128 ? div255(2 * bottom * top) : 255 - div255(2 * (255 - bottom) * (255 - top));
+        case BLEND_ADD: return min(bottom + top, 255);
+        case BLEND_DIFFERENCE: return abs(bottom - top);
+        default: return top;
+    }
+}
+
+void blend_mode_span(unsigned char* target, int target_channels, const unsigned char* source, int source_channels,
+                     int width, double scaling, BlendMode mode)
+/**
+ * Blends a run of top pixels into bottom ones with a blend mode other than normal
+ * Follows the separable blend modes of the W3C compositing spec, where
+ * the blended colour shows where both pixels are opaque and each pixel
+ * shows through where the other is clear
+ * @param target          Pixels on the bottom, receives the result
+ * @param target_channels Bytes per bottom pixel
+ * @param source          Pixels on top
+ * @param source_channels Bytes per top pixel
+ * @param width           Number of pixels
+ * @param scaling         The transparency of the top pixels
+ * @param mode            How the pixels combine
+ */
+{
+    int opacity = static_cast<int>(round(min(max(1 - scaling, 0.0), 1.0) * 255));
+    for (int x = 0; x < width; x++)
+    {
+        int top_alpha = div255((source_channels == 4 ? source[CHANNEL_ALPHA] : 255) * opacity);
+        int bottom_alpha = target_channels == 4 ? target[CHANNEL_ALPHA] : 255;
+        if (bottom_alpha == 255)
+        {
+            // The common case of an opaque bottom needs no division
+            for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+            {
+                target[c] = div255(target[c] * (255 - top_alpha) + top_alpha * blend_channel(mode, target[c], source[c]));
+            }
+        } else
+        {
+            int alpha = top_alpha + bottom_alpha - div255(top_alpha * bottom_alpha);
+            for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+            {
+                int sum = source[c] * top_alpha * (255 - bottom_alpha) + target[c] * bottom_alpha * (255 - top_alpha)
+                        + top_alpha * bottom_alpha * blend_channel(mode, target[c], source[c]);
+                target[c] = alpha == 0 ? 0 : min(255, (sum + alpha * 255 / 2) / (alpha * 255));
+            }
+            target[CHANNEL_ALPHA] = alpha;
+        }
+        target += target_channels;
+        source += source_channels;
+    }
+}
+
+void composite_in_place(Image& image, const vector<CompositeLayer>& layers)
+/**
+ * Blends every layer into the image in order, first layer lowest
+ * A single normal layer gives the same pixels as layer_in_place()
+ * @param image  The image on the bottom, receives the result
+ * @param layers The images to lay over it, with their positions and modes
+ */
+{
+    // Parts of the image each layer covers, layers off the image are dropped
+    struct Placed
+    {
+        const CompositeLayer* layer;
+        ImageView target;
+        ConstImageView source;
+        int left;
+        int top;
+    };
+    vector<Placed> placed;
+    long long work = 0;
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        Placed p;
+        p.layer = &layers[l];
+        if (overlap_views(image, *layers[l].image, layers[l].x, layers[l].y, p.target, p.source))
+        {
+            p.left = max(layers[l].x, 0);
+            p.top = max(layers[l].y, 0);
+            work += static_cast<long long>(p.target.width) * p.target.height;
+            placed.push_back(p);
+        }
+    }
+    if (placed.empty())
+    {
+        return;
+    }
+    TraceScope trace("filter", "composite", work);
+
+    parallel_rows(image.height, image.width * static_cast<int>(placed.size()), [&](int begin, int end)
+    {
+        vector<unsigned char> bottom;
+        vector<unsigned char> top;
+        for (int y = begin; y < end; y++)
+        {
+            for (int tile = 0; tile < image.width; tile += COMPOSITE_TILE)
+            {
+                int tile_end = min(tile + COMPOSITE_TILE, image.width);
+                for (size_t l = 0; l < placed.size(); l++)
+                {
+                    const Placed& p = placed[l];
+                    int first = max(tile, p.left);
+                    int last = min(tile_end, p.left + p.target.width);
+                    if (y < p.top || y >= p.top + p.target.height || first >= last)
+                    {
+                        continue;
+                    }
+                    unsigned char* target = image.pixel(y, first);
+                    const unsigned char* source = p.source.pixel(y - p.top, first - p.left);
+                    const CompositeLayer& layer = *p.layer;
+                    if (layer.mode == BLEND_NORMAL)
+                    {
+                        blend_normal_span(target, image.channels, source, p.source.channels, last - first, layer.scaling, bottom, top);
+                    } else
+                    {
+                        blend_mode_span(target, image.channels, source, p.source.channels, last - first, layer.scaling, layer.mode);
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+//
+// Statistics
+// Histograms of the blue, green and red channels and of the luma of an
+// image, counted in one pass. Each band of rows counts into histograms of
+// its own that are added together at the end, so threads never share a
+// counter. Auto levels, equalization and CLAHE build their curves from
+// these histograms instead of the fixed limits process_02 uses.
+//
+
+// Index of the luma histogram, after the three colour channels
+const int STATS_LUMA = 3;
+
+// Percent of the darkest and of the brightest pixels auto levels clips
+const double AUTO_LEVELS_CLIP = 0.5;
+
+// Tiles along each side of the image for CLAHE, and how many times the
+// average count a bin of a tile histogram can hold before it is clipped
+const int CLAHE_TILES = 8;
+const double CLAHE_CLIP_LIMIT = 2.0;
+
+// Counts of every value of the colour channels and the luma of an image
+struct ImageStats
+{
+    long long pixels;
+    long long histogram[4][256];    // Index with CHANNEL_BLUE, CHANNEL_GREEN, CHANNEL_RED or STATS_LUMA
+
+    double mean(int channel) const
+    {
+        double sum = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            sum += static_cast<double>(v) * histogram[channel][v];
+        }
+        return pixels > 0 ? sum / pixels : 0;
+    }
+    int lowest(int channel) const
+    {
+        int v = 0;
+        while (v < 255 && histogram[channel][v] == 0)
+        {
+            v++;
+        }
+        return v;
+    }
+    int highest(int channel) const
+    {
+        int v = 255;
+        while (v > 0 && histogram[channel][v] == 0)
+        {
+            v--;
+        }
+        return v;
+    }
+    int percentile(int channel, double percent) const
+    {
+        // Smallest value with at least percent of the pixels at or below it
+        double wanted = pixels * min(max(percent, 0.0), 100.0) / 100;
+        long long count = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            count += histogram[channel][v];
+            if (count > 0 && count >= wanted)
+            {
+                return v;
+            }
+        }
+        return 255;
+    }
+};
+
+void count_row(const unsigned char* p, int width, int channels, GreyMode luma_mode, long long counts[4][256])
+/**
+ * Adds the channel values and the luma of a row of pixels to histograms
+ */
+{
+    for (int x = 0; x < width; x++)
+    {
+        int blue = p[CHANNEL_BLUE];
+        int green = p[CHANNEL_GREEN];
+        int red = p[CHANNEL_RED];
+        counts[CHANNEL_BLUE][blue]++;
+        counts[CHANNEL_GREEN][green]++;
+        counts[CHANNEL_RED][red]++;
+        counts[STATS_LUMA][grey_value(luma_mode, red, green, blue)]++;
+        p += channels;
+    }
+}
+
+ImageStats image_stats(const Image& image, GreyMode luma_mode = GREY_REC709)
+/**
+ * Counts the histograms of an image in one parallel pass
+ * @param image     The image to measure, alpha is not counted
+ * @param luma_mode How the luma histogram turns colours into greys
+ * @return the histograms
+ */
+{
+    TraceScope trace("filter", "stats", image.pixel_count());
+    ImageStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.pixels = static_cast<long long>(image.pixel_count());
+    mutex merge_lock;
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        long long counts[4][256];
+        memset(counts, 0, sizeof(counts));
+        for (int y = begin; y < end; y++)
+        {
+            count_row(image.row(y), image.width, image.channels, luma_mode, counts);
+        }
+        lock_guard<mutex> lock(merge_lock);
+        for (int c = 0; c < 4; c++)
+        {
+            for (int v = 0; v < 256; v++)
+            {
+                stats.histogram[c][v] += counts[c][v];
+            }
+        }
+    });
+    return stats;
+}
+
+ToneCurve levels_curve(int low, int high)
+/**
+ * Builds a curve that stretches values from low to high over 0 to 255
+ * Values outside are clipped, and an empty range gives the identity
+ */
+{
+    if (high <= low)
+    {
+        return make_tone_curve(CURVE_IDENTITY);
+    }
+    ToneCurve curve;
+    for (int c = 0; c < 256; c++)
+    {
+        int value = static_cast<int>(round((c - low) * 255.0 / (high - low)));
+        curve.table[c] = static_cast<unsigned char>(min(max(value, 0), 255));
+    }
+    return curve;
+}
+
+ToneCurve equalize_curve(const long long histogram[256], long long pixels)
+/**
+ * Builds the curve that spreads the values of a histogram evenly over 0 to 255
+ * The lowest value present maps to 0 and the highest to 255
+ */
+{
+    long long first = 0;
+    for (int v = 0; v < 256 && first == 0; v++)
+    {
+        first = histogram[v];
+    }
+    if (pixels <= first)
+    {
+        return make_tone_curve(CURVE_IDENTITY);
+    }
+    ToneCurve curve;
+    long long count = 0;
+    for (int v = 0; v < 256; v++)
+    {
+        count += histogram[v];
+        int value = static_cast<int>(round(max(count - first, 0LL) * 255.0 / (pixels - first)));
+        curve.table[v] = static_cast<unsigned char>(value);
+    }
+    return curve;
+}
+
+void channel_curves_row(unsigned char* row, int width, int channels, const ToneCurve curves[3])
+/**
+ * Looks up each colour channel of a row of pixels in a curve of its own
+ * @param curves Curves indexed with CHANNEL_BLUE, CHANNEL_GREEN and CHANNEL_RED
+ */
+{
+    for (int x = 0; x < width; x++)
+    {
+        row[CHANNEL_BLUE] = curves[CHANNEL_BLUE].table[row[CHANNEL_BLUE]];
+        row[CHANNEL_GREEN] = curves[CHANNEL_GREEN].table[row[CHANNEL_GREEN]];
+        row[CHANNEL_RED] = curves[CHANNEL_RED].table[row[CHANNEL_RED]];
+        row += channels;
+    }
+}
+
+void auto_levels_in_place(Image& image, double clip = AUTO_LEVELS_CLIP, bool per_channel = false)
+/**
+ * Stretches the contrast so the image uses the whole range of values
+ * @param image       The image to be editted
+ * @param clip        Percent of the darkest and of the brightest pixels allowed to clip
+ * @param per_channel Stretch each channel on its own, which also removes
+ *                    colour casts, instead of all of them by the luma
+ */
+{
+    ImageStats stats = image_stats(image);
+    TraceScope trace("filter", "auto_levels", image.pixel_count());
+    ToneCurve curves[3];
+    for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+    {
+        int source = per_channel ? c : STATS_LUMA;
+        curves[c] = levels_curve(stats.percentile(source, clip), stats.percentile(source, 100 - clip));
+    }
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            channel_curves_row(image.row(y), image.width, image.channels, curves);
+        }
+    });
+}
+
+void equalize_in_place(Image& image)
+/**
+ * Equalizes the histogram of the luma, passing each colour channel through
+ * the curve that makes the luma values evenly spread
+ * @param image The image to be editted
+ */
+{
+    ImageStats stats = image_stats(image);
+    TraceScope trace("filter", "equalize", image.pixel_count());
+    ToneCurve curve = equalize_curve(stats.histogram[STATS_LUMA], stats.pixels);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            curve_row(image.row(y), image.width, image.channels, curve);
+        }
+    });
+}
+
+// Neighbouring tiles a row or column blends between, and the weight
+// out of 256 of the second one
+struct TileBlend
+{
+    int first;
+    int second;
+    int weight;
+};
+
+vector<TileBlend> tile_blends(int size, int tiles)
+/**
+ * Finds the two tiles whose centres each position lies between
+ * Positions before the first centre or after the last use that tile alone
+ * @param size  Pixels along the side
+ * @param tiles Tiles along the side
+ */
+{
+    vector<TileBlend> blends(size);
+    for (int i = 0; i < size; i++)
+    {
+        // Tile t covers [t * size / tiles, (t + 1) * size / tiles)
+        double position = (i + .5) * tiles / size - .5;
+        int first = min(max(static_cast<int>(floor(position)), 0), tiles - 1);
+        int second = min(first + 1, tiles - 1);
+        double weight = min(max(position - first, 0.0), 1.0);
+        TileBlend blend = {first, second, first == second ? 0 : static_cast<int>(round(weight * 256))};
+        blends[i] = blend;
+    }
+    return blends;
+}
+
+void clahe_in_place(Image& image, double clip_limit = CLAHE_CLIP_LIMIT, int tiles = CLAHE_TILES)
+/**
+ * Contrast limited adaptive histogram equalization
+ * Each tile of the image gets its own equalization curve from the luma
+ * of its pixels, with bins clipped at clip_limit times the average count
+ * and the excess spread over all bins, so flat areas are not stretched
+ * into noise. Pixels blend the curves of the four nearest tile centres.
+ * @param image      The image to be editted
+ * @param clip_limit Largest bin as a multiple of the average, 0 for no limit
+ * @param tiles      Tiles along each side
+ */
+{
+    TraceScope trace("filter", "clahe", image.pixel_count());
+    int tiles_x = min(max(tiles, 1), image.width);
+    int tiles_y = min(max(tiles, 1), image.height);
+    if (image.empty())
+    {
+        return;
+    }
+
+    // A curve for each tile, tile rows in parallel
+    vector<ToneCurve> curves(static_cast<size_t>(tiles_x) * tiles_y);
+    parallel_rows(tiles_y, image.width * (image.height / tiles_y), [&](int begin, int end)
+    {
+        for (int ty = begin; ty < end; ty++)
+        {
+            int top = static_cast<int>(static_cast<long long>(ty) * image.height / tiles_y);
+            int bottom = static_cast<int>(static_cast<long long>(ty + 1) * image.height / tiles_y);
+            for (int tx = 0; tx < tiles_x; tx++)
+            {
+                int left = static_cast<int>(static_cast<long long>(tx) * image.width / tiles_x);
+                int right = static_cast<int>(static_cast<long long>(tx + 1) * image.width / tiles_x);
+                long long counts[4][256];
+                memset(counts, 0, sizeof(counts));
+                for (int y = top; y < bottom; y++)
+                {
+                    count_row(image.pixel(y, left), right - left, image.channels, GREY_REC709, counts);
+                }
+                long long* histogram = counts[STATS_LUMA];
+                long long pixels = static_cast<long long>(bottom - top) * (right - left);
+                if (clip_limit > 0)
+                {
+                    long long limit = max(1LL, static_cast<long long>(clip_limit * pixels / 256));
+                    long long excess = 0;
+                    for (int v = 0; v < 256; v++)
+                    {
+                        excess += max(histogram[v] - limit, 0LL);
+                        histogram[v] = min(histogram[v], limit);
+                    }
+                    for (int v = 0; v < 256; v++)
+                    {
+                        histogram[v] += excess / 256 + (v < excess % 256 ? 1 : 0);
+                    }
+                }
+                curves[static_cast<size_t>(ty) * tiles_x + tx] = equalize_curve(histogram, pixels);
+            }
+        }
+    });
+
+    // Blend the curves of the nearest tiles with 8 bit weights in each direction
+    vector<TileBlend> columns = tile_blends(image.width, tiles_x);
+    vector<TileBlend> rows = tile_blends(image.height, tiles_y);
+    parallel_rows(image.height, image.width, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            const TileBlend& row_blend = rows[y];
+            const ToneCurve* upper = &curves[static_cast<size_t>(row_blend.first) * tiles_x];
+            const ToneCurve* lower = &curves[static_cast<size_t>(row_blend.second) * tiles_x];
+            int wy = row_blend.weight;
+            unsigned char* p = image.row(y);
+            for (int x = 0; x < image.width; x++)
+            {
+                const TileBlend& column = columns[x];
+                int wx = column.weight;
+                const unsigned char* top_left = upper[column.first].table;
+                const unsigned char* top_right = upper[column.second].table;
+                const unsigned char* bottom_left = lower[column.first].table;
+                const unsigned char* bottom_right = lower[column.second].table;
+                for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+                {
+                    int v = p[c];
+                    int top = top_left[v] * (256 - wx) + top_right[v] * wx;
+                    int bottom = bottom_left[v] * (256 - wx) + bottom_right[v] * wx;
+                    p[c] = static_cast<unsigned char>((top * (256 - wy) + bottom * wy + 32768) >> 16);
+                }
+                p += image.channels;
+            }
+        }
+    });
+}
+
+
+//
+// Filter pipeline
+// Runs a chain of processes over an image. Consecutive point filters are
+// fused into one pass over the pixels and consecutive layers are composited
+// in one pass, only rotate and scale need a second image to write into.
+//
+
+// Operations a FilterPipeline can run, numbered like the menu options
+enum FilterOp
+{
+    OP_VIGNETTE = 1,
+    OP_CLAREDON = 2,
+    OP_GREYSCALE = 3,
+    OP_ROTATE_90 = 4,
+    OP_ROTATE = 5,
+    OP_SCALE = 6,
+    OP_BLACK_WHITE = 7,
+    OP_LIGHTEN = 8,
+    OP_DARKEN = 9,
+    OP_BLACK_WHITE_RGB = 10,
+    OP_LAYER = 11,
+    OP_CURVE = 12,          // Custom tone curve, not on the menu
+    OP_AUTO_LEVELS = 13,    // Adaptive contrast from the histograms, not on the menu
+    OP_EQUALIZE = 14,
+    OP_CLAHE = 15,
+    OP_BLUR = 16,           // Convolutions, not on the menu
+    OP_BOX_BLUR = 17,
+    OP_SHARPEN = 18,
+    OP_EMBOSS = 19,
+    OP_EDGES = 20,
+    OP_KERNEL = 21
+};
+
+// One step of a FilterPipeline
+struct FilterStage
+{
+    FilterOp op;            // Which process to run
+    double amount;          // Exponent for 1, scaling for 2, 8, 9 and 11, turns for 5, x scale for 6, threshold for 7,
+                            // clip percent for 13, clip limit for 15, sigma for 16, radius for 17, amount for 18
+    double amount_y;        // Strength for 1, y scale for 6, 1 for separate channels for 13, tiles for 15
+    const Image* layer;     // Top image for 11, must outlive the pipeline
+    bool centered;          // Centers the top image for 11, otherwise it goes at (x, y)
+    int x;                  // Column of the left edge of the top image for 11
+    int y;                  // Row of the top edge of the top image for 11
+    BlendMode blend;        // How the top image combines for 11
+    GreyMode grey;          // How colours become greys for 3
+    bool single_channel;    // Leaves one channel of greys for 3, only as the last stage
+    shared_ptr<const ToneCurve> curve;  // Table for 12
+    shared_ptr<const ConvolutionKernel> kernel; // Weights for 21
+    BorderMode border;      // Edges for 16 to 21
+    ResampleFilter filter;  // Filter for 6, nearest unless set
+};
+
+FilterStage make_stage(FilterOp op, double amount = 0, double amount_y = 0)
+/**
+ * Creates a stage with the settings every operation shares
+ */
+{
+    FilterStage stage;
+    stage.op = op;
+    stage.amount = amount;
+    stage.amount_y = amount_y;
+    stage.layer = NULL;
+    stage.centered = true;
+    stage.x = 0;
+    stage.y = 0;
+    stage.blend = BLEND_NORMAL;
+    stage.grey = GREY_AVERAGE;
+    stage.single_channel = false;
+    stage.filter = RESAMPLE_NEAREST;
+    stage.border = BORDER_CLAMP;
+    return stage;
+}
+
+bool is_curve_op(FilterOp op)
+/**
+ * Checks if an operation changes each channel value on its own
+ * @param op The operation
+ * @return True for operations that are a single tone curve
+ */
+{
+    return op == OP_LIGHTEN || op == OP_DARKEN || op == OP_CURVE;
+}
+
+bool is_point_op(FilterOp op)
+/**
+ * Checks if an operation only looks at one pixel at a time
+ * @param op The operation
+ * @return True for operations that can be fused into one pass
+ */
+{
+    switch (op)
+    {
+        case OP_ROTATE_90:
+        case OP_ROTATE:
+        case OP_SCALE:
+        case OP_LAYER:
+        case OP_AUTO_LEVELS:
+        case OP_EQUALIZE:
+        case OP_CLAHE:
+        case OP_BLUR:
+        case OP_BOX_BLUR:
+        case OP_SHARPEN:
+        case OP_EMBOSS:
+        case OP_EDGES:
+        case OP_KERNEL:
+            return false;
+        default:
+            return true;
+    }
+}
+
+bool is_point_stage(const FilterStage& stage)
+/**
+ * Checks if a stage can be fused into one pass with its neighbours
+ * Greyscale that drops to one channel makes a new image instead
+ */
+{
+    return is_point_op(stage.op) && !stage.single_channel;
+}
+
+class FilterPipeline
+{
+public:
+    FilterPipeline& add(FilterOp op, double amount = 0, double amount_y = 0)
+    {
+        if (op == OP_VIGNETTE)
+        {
+            // Vignettes added this way use the settings of process_01
+            return add_vignette();
+        }
+        if (op == OP_BLACK_WHITE)
+        {
+            // And black and white the threshold of process_07
+            return add_black_white();
+        }
+        FilterStage stage = make_stage(op, amount, amount_y);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_vignette(double exponent = VIGNETTE_EXPONENT, double strength = VIGNETTE_STRENGTH)
+    {
+        FilterStage stage = make_stage(OP_VIGNETTE, exponent, strength);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_black_white(int threshold = BLACK_WHITE_THRESHOLD)
+    {
+        FilterStage stage = make_stage(OP_BLACK_WHITE, threshold);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_posterize(int levels)
+    {
+        // A curve, so it folds into the tables of neighbouring tone changes
+        FilterStage stage = make_stage(OP_CURVE);
+        stage.curve = get_tone_curve(CURVE_POSTERIZE, levels);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_auto_levels(double clip = AUTO_LEVELS_CLIP, bool per_channel = false)
+    {
+        FilterStage stage = make_stage(OP_AUTO_LEVELS, clip, per_channel ? 1 : 0);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_clahe(double clip_limit = CLAHE_CLIP_LIMIT, int tiles = CLAHE_TILES)
+    {
+        FilterStage stage = make_stage(OP_CLAHE, clip_limit, tiles);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_convolution(FilterOp op, double amount = 0, BorderMode border = BORDER_CLAMP)
+    {
+        FilterStage stage = make_stage(op, amount);
+        stage.border = border;
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_kernel(const ConvolutionKernel& kernel, BorderMode border = BORDER_CLAMP)
+    {
+        FilterStage stage = make_stage(OP_KERNEL);
+        stage.kernel = make_shared<ConvolutionKernel>(kernel);
+        stage.border = border;
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_scale(double scale_x, double scale_y, ResampleFilter filter)
+    {
+        FilterStage stage = make_stage(OP_SCALE, scale_x, scale_y);
+        stage.filter = filter;
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_greyscale(GreyMode mode, bool single_channel = false)
+    {
+        FilterStage stage = make_stage(OP_GREYSCALE);
+        stage.grey = mode;
+        stage.single_channel = single_channel;
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_curve(const ToneCurve& curve)
+    {
+        FilterStage stage = make_stage(OP_CURVE);
+        stage.curve = make_shared<ToneCurve>(curve);
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_layer(const Image& layer_image, double scaling, BlendMode blend = BLEND_NORMAL)
+    {
+        FilterStage stage = make_stage(OP_LAYER, scaling);
+        stage.layer = &layer_image;
+        stage.blend = blend;
+        stages.push_back(stage);
+        return *this;
+    }
+    FilterPipeline& add_layer_at(const Image& layer_image, double scaling, int x, int y, BlendMode blend = BLEND_NORMAL)
+    {
+        FilterStage stage = make_stage(OP_LAYER, scaling);
+        stage.layer = &layer_image;
+        stage.centered = false;
+        stage.x = x;
+        stage.y = y;
+        stage.blend = blend;
+        stages.push_back(stage);
+        return *this;
+    }
+
+    bool empty() const { return stages.empty(); }
+    const vector<FilterStage>& get_stages() const { return stages; }
+
+    void run(Image& image) const;
+    void run_point_stages(Image& image, size_t first, size_t last, int row_offset = 0, int full_height = 0) const;
+
+private:
+    vector<FilterStage> stages;
+};
+
+// Tables a fused pass uses for one stage
+struct StageTables
+{
+    bool skip;                              // Already composed into an earlier stage's curve
+    ToneScale scale;                        // Multipliers for lighten, darken and Claredon, not exact once curves are composed
+    ToneCurve curve;                        // Lighten, darken and curves, bright pixels for Claredon
+    ToneCurve dark_curve;                   // Dark pixels for Claredon
+    shared_ptr<const VignetteMask> mask;    // Vignette gradient
+};
+
+// Bytes of rows a fused pass keeps in cache while every stage runs on them
+const int POINT_STRIP_BYTES = 128 * 1024;
+
+void run_point_row(const FilterStage& stage, const StageTables& tables, unsigned char* row, int width, int channels, int y)
+/**
+ * Runs one point stage on a row with the row function of its filter
+ * @param stage    The stage to run
+ * @param tables   Tables prepared for the stage
+ * @param row      First pixel of the row
+ * @param width    Number of pixels
+ * @param channels Bytes per pixel
+ * @param y        Row of the full image, for vignettes
+ */
+{
+    switch (stage.op)
+    {
+        case OP_VIGNETTE:
+            vignette_row(row, width, channels, tables.mask->rows[y], &tables.mask->columns[0]);
+            break;
+        case OP_CLAREDON:
+            claredon_row(row, width, channels, tables.scale, tables.curve, tables.dark_curve);
+            break;
+        case OP_GREYSCALE:
+            greyscale_row(row, width, channels, stage.grey);
+            break;
+        case OP_BLACK_WHITE:
+            black_white_row(row, width, channels, static_cast<int>(stage.amount));
+            break;
+        case OP_LIGHTEN:
+        case OP_DARKEN:
+        case OP_CURVE:
+            // Composed runs and custom curves have no exact multipliers, so they use the table
+            tone_row(row, width, channels, tables.scale, tables.curve, stage.op == OP_LIGHTEN);
+            break;
+        case OP_BLACK_WHITE_RGB:
+            black_white_rgb_row(row, width, channels);
+            break;
+        default:
+            break;
+    }
+}
+
+void FilterPipeline::run_point_stages(Image& image, size_t first, size_t last, int row_offset, int full_height) const
+/**
+ * Runs stages [first, last) in a single pass over the pixels
+ * All of them must be point operations
+ * Rows are taken a strip at a time, and every stage runs on the strip
+ * with the row functions of the standalone filters while it is in cache
+ * The image can be a band of rows from a taller image, which only
+ * matters for vignettes
+ * @param image       The image to be editted
+ * @param first       Index of the first stage
+ * @param last        Index one past the last stage
+ * @param row_offset  Row of the full image that the first row of the band is
+ * @param full_height Height of the full image, 0 if the image is not a band
+ */
+{
+    if (full_height <= 0)
+    {
+        full_height = image.height;
+    }
+    if (first >= last || image.empty())
+    {
+        return;
+    }
+    TraceScope trace("filter", "fused point filters", image.pixel_count());
+
+    // Vignette gradients come from the cached row and column factors and
+    // tone changes from multipliers or lookup tables. Consecutive curve
+    // stages are composed into the table of the first, unless both have
+    // vector kernels, which beat a table lookup on rows already in cache.
+    vector<StageTables> tables(last - first);
+    size_t run_start = first;
+    for (size_t s = first; s < last; s++)
+    {
+        const FilterStage& stage = stages[s];
+        StageTables& stage_tables = tables[s - first];
+        stage_tables.skip = false;
+        stage_tables.scale = make_tone_scale(stage.op == OP_LIGHTEN || stage.op == OP_DARKEN || stage.op == OP_CLAREDON ? stage.amount : -1);
+        if (stage.op == OP_VIGNETTE)
+        {
+            stage_tables.mask = get_vignette_mask(image.width, full_height, stage.amount, stage.amount_y);
+        } else if (stage.op == OP_CLAREDON)
+        {
+            stage_tables.curve = *get_tone_curve(CURVE_LIGHTEN, stage.amount);
+            stage_tables.dark_curve = *get_tone_curve(CURVE_DARKEN, stage.amount);
+        } else if (is_curve_op(stage.op))
+        {
+            if (stage.op == OP_CURVE)
+            {
+                stage_tables.curve = *stage.curve;
+            } else
+            {
+                stage_tables.curve = *get_tone_curve(stage.op == OP_LIGHTEN ? CURVE_LIGHTEN : CURVE_DARKEN, stage.amount);
+            }
+            bool both_vector = tables[run_start - first].scale.exact && stage_tables.scale.exact && image.channels == 3;
+            if (s > first && is_curve_op(stages[s - 1].op) && !both_vector)
+            {
+                StageTables& start_tables = tables[run_start - first];
+                start_tables.curve = compose_curves(start_tables.curve, stage_tables.curve);
+                start_tables.scale.exact = false;
+                stage_tables.skip = true;
+            } else
+            {
+                run_start = s;
+            }
+        }
+    }
+
+    int strip_rows = max(1, POINT_STRIP_BYTES / image.stride);
+    parallel_rows(image.height, image.width * (last - first), [&](int begin, int end)
+    {
+        for (int strip = begin; strip < end; strip += strip_rows)
+        {
+            int strip_end = min(end, strip + strip_rows);
+            for (size_t s = first; s < last; s++)
+            {
+                if (tables[s - first].skip)
+                {
+                    continue;
+                }
+                for (int y = strip; y < strip_end; y++)
+                {
+                    run_point_row(stages[s], tables[s - first], image.row(y), image.width, image.channels, row_offset + y);
+                }
+            }
+        }
+    });
+}
+
+bool second_image_size(const FilterStage& stage, const Image& image, int& width, int& height, int& channels)
+/**
+ * Works out the size of the second image a stage writes its result into
+ * @return False for stages that change the image in place
+ */
+{
+    width = image.width;
+    height = image.height;
+    channels = image.channels;
+    switch (stage.op)
+    {
+        case OP_ROTATE:
+            if (normalize_turns(static_cast<int>(round(stage.amount))) % 2 == 0)
+            {
+                return false;
+            }
+            swap(width, height);
+            return true;
+        case OP_ROTATE_90:
+            swap(width, height);
+            return true;
+        case OP_SCALE:
+        {
+            // Same rounding as scale_into(), where 0 leaves a side as it is
+            float scale_x = static_cast<float>(stage.amount);
+            float scale_y = static_cast<float>(stage.amount_y);
+            width = static_cast<int>(round(image.width * (scale_x == 0 ? 1 : scale_x)));
+            height = static_cast<int>(round(image.height * (scale_y == 0 ? 1 : scale_y)));
+            return true;
+        }
+        case OP_GREYSCALE:
+            // Only greyscale down to one channel gets here
+            channels = 1;
+            return true;
+        case OP_BLUR:
+        case OP_BOX_BLUR:
+        case OP_SHARPEN:
+        case OP_EMBOSS:
+        case OP_EDGES:
+        case OP_KERNEL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void FilterPipeline::run(Image& image) const
+/**
+ * Runs every stage of the pipeline on the image
+ * Point operations between geometric ones run as one fused pass
+ * Second images come from image_pool and go back to it, so running the
+ * pipeline on many images allocates only for the first
+ * @param image The image to be editted, replaced by the result
+ */
+{
+    Image temp;
+    size_t first = 0;
+    for (size_t s = 0; s <= stages.size(); s++)
+    {
+        if (s < stages.size() && is_point_stage(stages[s]))
+        {
+            continue;
+        }
+
+        // Flush the run of point operations before this stage
+        run_point_stages(image, first, s);
+        first = s + 1;
+        if (s == stages.size())
+        {
+            break;
+        }
+
+        const FilterStage& stage = stages[s];
+        int width, height, channels;
+        if (second_image_size(stage, image, width, height, channels) && width > 0 && height > 0)
+        {
+            image_pool.resize(temp, width, height, channels);
+        }
+        switch (stage.op)
+        {
+            case OP_ROTATE_90:
+                rotate_90_into(image, temp);
+                break;
+            case OP_ROTATE:
+            {
+                // Half turns and whole turns need no second image
+                int turns = normalize_turns(static_cast<int>(round(stage.amount)));
+                if (turns == 2)
+                {
+                    rotate_180_in_place(image);
+                }
+                if (turns % 2 == 0)
+                {
+                    continue;
+                }
+                rotate_into(image, temp, turns);
+                break;
+            }
+            case OP_SCALE:
+                scale_into(image, temp, stage.amount, stage.amount_y, stage.filter);
+                break;
+            case OP_GREYSCALE:
+                greyscale_into(image, temp, stage.grey);
+                break;
+            case OP_AUTO_LEVELS:
+                // These need the whole image measured first, but no second image
+                auto_levels_in_place(image, stage.amount, stage.amount_y != 0);
+                continue;
+            case OP_EQUALIZE:
+                equalize_in_place(image);
+                continue;
+            case OP_CLAHE:
+                clahe_in_place(image, stage.amount, static_cast<int>(stage.amount_y));
+                continue;
+            case OP_BLUR:
+                gaussian_blur_into(image, temp, stage.amount, stage.border);
+                break;
+            case OP_BOX_BLUR:
+                box_blur_into(image, temp, static_cast<int>(stage.amount), stage.border);
+                break;
+            case OP_SHARPEN:
+                convolve_into(image, temp, sharpen_kernel(stage.amount), stage.border);
+                break;
+            case OP_EMBOSS:
+                convolve_into(image, temp, emboss_kernel(), stage.border);
+                break;
+            case OP_EDGES:
+                sobel_into(image, temp, stage.border);
+                break;
+            case OP_KERNEL:
+                convolve_into(image, temp, *stage.kernel, stage.border);
+                break;
+            case OP_LAYER:
+            {
+                // Consecutive layers blend straight into the image in one pass
+                vector<CompositeLayer> layers;
+                for (; s < stages.size() && stages[s].op == OP_LAYER; s++)
+                {
+                    const Image& layer_image = *stages[s].layer;
+                    CompositeLayer layer = {&layer_image, stages[s].amount, stages[s].x, stages[s].y, stages[s].blend};
+                    if (stages[s].centered)
+                    {
+                        layer.x = centered_offset(image.width, layer_image.width);
+                        layer.y = centered_offset(image.height, layer_image.height);
+                    }
+                    layers.push_back(layer);
+                }
+                first = s--;
+                composite_in_place(image, layers);
+                continue;
+            }
+            default:
+                break;
+        }
+        swap(image, temp);
+    }
+    image_pool.release(temp);
+}
+
+
+//
+// Streaming
+// Processes BMP files a band of rows at a time so images larger than
+// memory can be filtered. Rows are read straight from the file and written
+// straight to the output, and rotations read the file one column strip at
+// a time. Memory use is bounded by the limit passed in, not the image size.
+//
+
+// Default bytes of pixels a streaming pass keeps in memory
+const size_t STREAM_MEMORY_LIMIT = 256 * 1024 * 1024;
+
+/**
+ * Reads rows and parts of rows from a BMP file without loading it
+ * Pixels come out as 3 byte BGR, or 4 byte BGRA for files with alpha,
+ * like read_bmp()
+ */
+class BmpScanlineReader
+{
+public:
+    BmpScanlineReader() : position(0) {}
+
+    bool open(const string& filename);
+    bool read_pixels(int y, int x, int count, unsigned char* target);
+
+    int width() const { return header.width; }
+    int height() const { return header.height; }
+    int channels() const { return header.alpha ? 4 : 3; }
+
+private:
+    ifstream stream;
+    BmpHeader header;
+    long long position;             // File offset the next read starts at
+    vector<unsigned char> scratch;  // Undecoded pixels of 32 bit files
+};
+
+bool BmpScanlineReader::open(const string& filename)
+/**
+ * Opens the file and checks its headers, reading no pixels
+ * @param filename BMP image filename
+ * @return True if this is a valid image that can be decoded
+ */
+{
+    stream.open(filename.c_str(), ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    long long file_length = stream.tellg();
+    stream.seekg(0, ios::beg);
+
+    // Larger DIB headers hold the masks that say whether there is alpha,
+    // grey files follow theirs with the palette
+    unsigned char buffer[BMP_MAX_HEADER_SIZE + BMP_GREY_PALETTE_SIZE];
+    stream.read(reinterpret_cast<char*>(buffer), sizeof(buffer));
+    position = stream.gcount();
+    stream.clear();
+    return parse_bmp_header(buffer, static_cast<size_t>(position), file_length, header);
+}
+
+bool BmpScanlineReader::read_pixels(int y, int x, int count, unsigned char* target)
+/**
+ * Reads pixels from one row of the image
+ * Reading rows from the bottom up follows the file and avoids seeking
+ * @param y      Row of the image, 0 is the top
+ * @param x      First pixel to read
+ * @param count  Number of pixels to read
+ * @param target Receives count pixels of channels() bytes
+ * @return True if the pixels were read
+ */
+{
+    int bytes_per_pixel = header.bits_per_pixel / 8;
+    int target_channels = channels();
+    long long row_bytes = header.scanline_size + header.padding;
+    long long offset = header.start + (header.height - 1 - y) * row_bytes + static_cast<long long>(x) * bytes_per_pixel;
+    if (offset != position)
+    {
+        stream.seekg(offset);
+    }
+
+    size_t bytes = static_cast<size_t>(count) * bytes_per_pixel;
+    unsigned char* buffer = target;
+    if (bytes_per_pixel != target_channels)
+    {
+        scratch.resize(bytes);
+        buffer = &scratch[0];
+    }
+    stream.read(reinterpret_cast<char*>(buffer), bytes);
+    position = offset + bytes;
+    if (static_cast<size_t>(stream.gcount()) != bytes)
+    {
+        return false;
+    }
+
+    // Unused fourth bytes are dropped and greys are expanded
+    for (int i = 0; header.grey && i < count; i++)
+    {
+        target[i * 3] = target[i * 3 + 1] = target[i * 3 + 2] = buffer[i];
+    }
+    for (int i = 0; !header.grey && bytes_per_pixel != target_channels && i < count; i++)
+    {
+        memcpy(target + i * 3, buffer + i * bytes_per_pixel, 3);
+    }
+    return true;
+}
+
+/**
+ * Writes a 24 bit BMP file, or 32 bit with alpha or 8 bit grey, one row
+ * at a time, bottom row first
+ * Produces the same file as write_bmp() for the same pixels
+ */
+class BmpScanlineWriter
+{
+public:
+    BmpScanlineWriter() : width(0), height(0), channels(3), rows_left(0) {}
+
+    bool open(const string& filename, int image_width, int image_height, int image_channels = 3,
+              bool preallocate = false);
+    bool write_row(const unsigned char* row);
+    bool close();
+
+private:
+    fstream stream;
+    int width;
+    int height;
+    int channels;                   // Bytes per pixel, 1, 3 or 4
+    int rows_left;                  // Rows still to be written
+    vector<unsigned char> buffer;   // One padded scan line
+};
+
+bool BmpScanlineWriter::open(const string& filename, int image_width, int image_height, int image_channels,
+                             bool preallocate)
+/**
+ * Creates the file and writes its headers
+ * @param filename       The BMP file name to save the image to
+ * @param image_width    Width of the image in pixels
+ * @param image_height   Height of the image in pixels
+ * @param image_channels Bytes per pixel of the rows, 4 for alpha, 1 for grey
+ * @param preallocate    Reserve the final file size before writing the pixels
+ * @return True if the file is ready for rows
+ */
+{
+    width = image_width;
+    height = image_height;
+    channels = image_channels;
+    rows_left = height;
+    int row_bytes = (width * channels + 3) / 4 * 4;
+    long long array_bytes = static_cast<long long>(row_bytes) * height;
+    int header_bytes = bmp_header_size(channels);
+    if (width <= 0 || height <= 0 || (channels != 1 && channels != 3 && channels != 4)
+        || !open_bmp_output(stream, filename, header_bytes + array_bytes, preallocate))
+    {
+        return false;
+    }
+
+    unsigned char headers[BMP_GREY_HEADER_SIZE];
+    set_bmp_headers(headers, width, height, array_bytes, channels);
+    stream.write(reinterpret_cast<char*>(headers), header_bytes);
+    buffer.assign(row_bytes, 0);
+    return stream.good();
+}
+
+bool BmpScanlineWriter::write_row(const unsigned char* row)
+/**
+ * Writes the next row, starting with the bottom row of the image
+ * @param row Width pixels of the channels given to open()
+ * @return True if successful and false otherwise
+ */
+{
+    if (rows_left <= 0)
+    {
+        return false;
+    }
+    // Padding bytes stay zero from when the buffer was created
+    memcpy(&buffer[0], row, width * channels);
+    stream.write(reinterpret_cast<char*>(&buffer[0]), buffer.size());
+    rows_left--;
+    return stream.good();
+}
+
+bool BmpScanlineWriter::close()
+/**
+ * Finishes the file
+ * @return True if every row was written
+ */
+{
+    bool written = stream.good() && rows_left == 0;
+    stream.close();
+    return written;
+}
+
+bool stream_pass(const string& input, const string& output, int turns,
+                 const FilterPipeline& pipeline, size_t first, size_t last, size_t memory_limit)
+/**
+ * Rotates a BMP file and then runs point stages on it, a part at a time
+ * Half and whole turns work on bands of full rows. Quarter turns read
+ * a strip of source columns, which becomes a band of output rows
+ * @param input        BMP file to read
+ * @param output       BMP file to write, must not be the input
+ * @param turns        Number of clockwise turns, negative for counterclockwise
+ * @param pipeline     Pipeline holding the stages
+ * @param first        Index of the first point stage to run
+ * @param last         Index one past the last point stage
+ * @param memory_limit Bytes of pixels to keep in memory
+ * @return True if successful and false otherwise
+ */
+{
+    // Reads and writes happen inside, only the filters get their own events
+    TraceScope trace("stream", "stream_pass");
+    BmpScanlineReader reader;
+    if (!reader.open(input))
+    {
+        return false;
+    }
+    trace.set_pixels(static_cast<long long>(reader.width()) * reader.height());
+    turns = normalize_turns(turns);
+    bool quarter = turns % 2 == 1;
+    int width = quarter ? reader.height() : reader.width();
+    int height = quarter ? reader.width() : reader.height();
+
+    int channels = reader.channels();
+    BmpScanlineWriter writer;
+    if (!writer.open(output, width, height, channels))
+    {
+        return false;
+    }
+
+    // Quarter turns hold a strip of the source and the rotated strip
+    long long row_bytes = static_cast<long long>(width) * channels;
+    long long band_limit = quarter ? max(1LL, row_bytes * 2) : row_bytes;
+    int band_rows = static_cast<int>(min<long long>(height, max(1LL, static_cast<long long>(memory_limit) / band_limit)));
+
+    Image source;
+    Image band;
+    bool ok = true;
+    // Output rows are written bottom up, so bands go from the bottom up too
+    for (int band_end = height; band_end > 0 && ok; band_end -= band_rows)
+    {
+        int band_first = max(0, band_end - band_rows);
+        int rows = band_end - band_first;
+        if (quarter)
+        {
+            // Clockwise, output row y is source column y read from the
+            // bottom up, counterclockwise it is column width - 1 - y
+            int column = turns == 1 ? band_first : reader.width() - band_end;
+            source.resize(rows, reader.height(), channels);
+            for (int y = reader.height() - 1; y >= 0 && ok; y--)
+            {
+                ok = reader.read_pixels(y, column, rows, source.row(y));
+            }
+            rotate_quarter_into(source, band, turns == 1);
+        } else
+        {
+            // Half turns read the mirrored band of rows and reverse it
+            int source_first = turns == 2 ? height - band_end : band_first;
+            band.resize(width, rows, channels);
+            for (int y = rows - 1; y >= 0 && ok; y--)
+            {
+                ok = reader.read_pixels(source_first + y, 0, width, band.row(y));
+            }
+            if (turns == 2)
+            {
+                rotate_180_in_place(band);
+            }
+        }
+
+        pipeline.run_point_stages(band, first, last, band_first, height);
+        for (int y = rows - 1; y >= 0 && ok; y--)
+        {
+            ok = writer.write_row(band.row(y));
+        }
+    }
+    return writer.close() && ok;
+}
+
+bool is_stream_stage(const FilterStage& stage)
+/**
+ * Checks if stream_pipeline_bmp() can run a stage, point stages run on
+ * bands of rows and rotations take a pass of their own
+ */
+{
+    return is_point_stage(stage) || stage.op == OP_ROTATE || stage.op == OP_ROTATE_90;
+}
+
+bool stream_pipeline_bmp(const string& input, const string& output, const FilterPipeline& pipeline,
+                         size_t memory_limit = STREAM_MEMORY_LIMIT)
+/**
+ * Runs a pipeline on a BMP file without loading the whole image
+ * Point operations run on bands of rows as they are read, rotations
+ * take one tiled pass each through a temporary file next to the output.
+ * Scaling, layering, operations that measure the whole image and single
+ * channel greyscale are not supported
+ * @param input        BMP file to read
+ * @param output       BMP file to write, must not be the input
+ * @param pipeline     The stages to run
+ * @param memory_limit Bytes of pixels each pass keeps in memory
+ * @return True if successful, false on errors or unsupported stages
+ */
+{
+    // Splits the stages into passes, each a rotation then point stages
+    struct StreamPass
+    {
+        int turns;
+        size_t first;
+        size_t last;
+    };
+    const vector<FilterStage>& stages = pipeline.get_stages();
+    vector<StreamPass> passes;
+    StreamPass pass = {0, 0, 0};
+    for (size_t s = 0; s < stages.size(); s++)
+    {
+        if (!is_stream_stage(stages[s]))
+        {
+            return false;
+        }
+        if (is_point_stage(stages[s]))
+        {
+            continue;
+        }
+        int turns = stages[s].op == OP_ROTATE_90 ? 1 : static_cast<int>(round(stages[s].amount));
+        pass.last = s;
+        if (pass.first == pass.last)
+        {
+            // Rotations with nothing between them add up
+            pass.turns = normalize_turns(pass.turns + turns);
+        } else
+        {
+            passes.push_back(pass);
+            pass.turns = turns;
+        }
+        pass.first = s + 1;
+    }
+    pass.last = stages.size();
+    if (passes.empty() || pass.first != pass.last || pass.turns != 0)
+    {
+        passes.push_back(pass);
+    }
+
+    // Alternates between two temporary files until the last pass
+    string previous = input;
+    bool ok = true;
+    for (size_t p = 0; p < passes.size() && ok; p++)
+    {
+        string target = p + 1 == passes.size() ? output : output + (p % 2 == 0 ? ".part0" : ".part1");
+        ok = stream_pass(previous, target, passes[p].turns, pipeline, passes[p].first, passes[p].last, memory_limit);
+        previous = target;
+    }
+    remove((output + ".part0").c_str());
+    remove((output + ".part1").c_str());
+    return ok;
+}
+
+
+//
+// Batch processing
+// Runs a pipeline over many files with separate reader, compute and writer
+// threads connected by bounded queues. Readers decode the next files while
+// earlier ones are filtered and written, and a full queue makes the stage
+// before it wait, so only a few images are in memory at once.
+//
+
+/**
+ * First in, first out queue that blocks when full or empty
+ * close() wakes every waiting thread; pop() then drains what is left
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t queue_capacity) : capacity(max(queue_capacity, static_cast<size_t>(1))), closed(false) {}
+
+    void push(T item)
+    {
+        unique_lock<mutex> lock(items_lock);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(items_lock);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(items_lock);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex items_lock;
+    condition_variable not_empty;
+    condition_variable not_full;
+};
+
+// Thread counts and queue sizes for run_batch()
+struct BatchOptions
+{
+    int readers;        // Threads reading and decoding files
+    int computers;      // Threads running the pipeline, each on the shared thread pool
+    int writers;        // Threads encoding and writing files
+    int queue_depth;    // Images waiting between two stages before the first one waits
+
+    BatchOptions() : readers(2), computers(2), writers(2), queue_depth(4) {}
+};
+
+// Work done by one stage of a batch
+struct BatchStageStats
+{
+    int threads;            // Threads in the stage
+    int files;              // Files that went through the stage
+    long long pixels;       // Pixels of those files
+    long long bytes;        // File bytes read or written, 0 for compute
+    double busy_seconds;    // Time the threads spent working, added up
+
+    BatchStageStats() : threads(0), files(0), pixels(0), bytes(0), busy_seconds(0) {}
+};
+
+struct BatchStats
+{
+    BatchStageStats read;
+    BatchStageStats compute;
+    BatchStageStats write;
+    double wall_seconds;    // Time for the whole batch
+    int failures;           // Files that could not be read or written
+};
+
+// One file moving through a batch
+struct BatchJob
+{
+    size_t index;
+    Image image;
+};
+
+double seconds_since(const chrono::steady_clock::time_point& start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+BatchStats run_batch(const vector<string>& inputs, const vector<string>& outputs, const FilterPipeline& pipeline,
+                     const BatchOptions& options, vector<string>& errors)
+/**
+ * Reads, filters and writes many files at the same time
+ * @param inputs   BMP files to read
+ * @param outputs  Where to write each result, same order as inputs
+ * @param pipeline The operations to run on every image
+ * @param options  Thread counts and queue sizes
+ * @param errors   Receives a message for each file that failed
+ * @return how busy each stage was
+ */
+{
+    chrono::steady_clock::time_point batch_start = chrono::steady_clock::now();
+    BatchStats stats;
+    stats.read.threads = max(options.readers, 1);
+    stats.compute.threads = max(options.computers, 1);
+    stats.write.threads = max(options.writers, 1);
+    stats.failures = 0;
+    mutex stats_lock;
+
+    BoundedQueue<BatchJob> decoded(options.queue_depth);
+    BoundedQueue<BatchJob> filtered(options.queue_depth);
+    atomic<size_t> next_input(0);
+    atomic<int> readers_left(stats.read.threads);
+    atomic<int> computers_left(stats.compute.threads);
+
+    // Records a finished item, or a failure when message is not empty
+    auto record = [&](BatchStageStats& stage, size_t pixels, long long bytes, double seconds, const string& message)
+    {
+        lock_guard<mutex> lock(stats_lock);
+        stage.busy_seconds += seconds;
+        if (!message.empty())
+        {
+            errors.push_back(message);
+            stats.failures++;
+            return;
+        }
+        stage.files++;
+        stage.pixels += pixels;
+        stage.bytes += bytes;
+    };
+    auto file_bytes = [](const Image& image)
+    {
+        return bmp_header_size(image.channels) + static_cast<long long>(image.stride) * image.height;
+    };
+
+    vector<thread> threads;
+    for (int t = 0; t < stats.read.threads; t++)
+    {
+        threads.push_back(thread([&]
+        {
+            for (size_t i = next_input++; i < inputs.size(); i = next_input++)
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                // Buffers go round from the writers back to the readers through the pool
+                BatchJob job;
+                job.index = i;
+                bool ok = read_bmp_into(inputs[i], job.image, &image_pool);
+                record(stats.read, job.image.pixel_count(), ok ? file_bytes(job.image) : 0, seconds_since(start),
+                       ok ? string() : "unable to read image: " + inputs[i]);
+                if (ok)
+                {
+                    decoded.push(std::move(job));
+                } else
+                {
+                    image_pool.release(job.image);
+                }
+            }
+            if (--readers_left == 0)
+            {
+                decoded.close();
+            }
+        }));
+    }
+    for (int t = 0; t < stats.compute.threads; t++)
+    {
+        threads.push_back(thread([&]
+        {
+            BatchJob job;
+            while (decoded.pop(job))
+            {
+                // Counts the pixels going in, scaling changes how many come out
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                size_t pixels = job.image.pixel_count();
+                pipeline.run(job.image);
+                record(stats.compute, pixels, 0, seconds_since(start), string());
+                filtered.push(std::move(job));
+            }
+            if (--computers_left == 0)
+            {
+                filtered.close();
+            }
+        }));
+    }
+    for (int t = 0; t < stats.write.threads; t++)
+    {
+        threads.push_back(thread([&]
+        {
+            BatchJob job;
+            while (filtered.pop(job))
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                bool ok = write_bmp(outputs[job.index], job.image);
+                record(stats.write, job.image.pixel_count(), ok ? file_bytes(job.image) : 0, seconds_since(start),
+                       ok ? string() : "unable to write image: " + outputs[job.index]);
+                image_pool.release(job.image);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    stats.wall_seconds = seconds_since(batch_start);
+    return stats;
+}
+
+void print_batch_stats(ostream& out, const BatchStats& stats)
+/**
+ * Prints the throughput of each stage of a batch
+ * Busy rates are per thread while working, utilization is the share of
+ * the wall time the stage's threads were working
+ */
+{
+    const char* names[] = {"read", "compute", "write"};
+    const BatchStageStats* stages[] = {&stats.read, &stats.compute, &stats.write};
+    out << "Stage      Threads  Files    Files/s     MP/s  MB/s busy  Utilization" << endl;
+    for (int s = 0; s < 3; s++)
+    {
+        const BatchStageStats& stage = *stages[s];
+        double busy = max(stage.busy_seconds, 1e-9);
+        double wall = max(stats.wall_seconds, 1e-9);
+        char line[160];
+        snprintf(line, sizeof(line), "%-9s %8d %6d %10.1f %8.1f %10.1f %11.0f%%",
+                 names[s], stage.threads, stage.files, stage.files / wall,
+                 stage.pixels / busy / 1e6, stage.bytes / busy / 1e6,
+                 100 * stage.busy_seconds / (wall * stage.threads));
+        out << line << endl;
+    }
+    out << "Wall time " << stats.wall_seconds << " s, " << stats.failures << " failed" << endl;
+    print_image_pool_stats(out);
+}
+
+//
+// Command line
+// Runs a chain of operations without any prompts, for scripts and batches:
+//   ./main -i in.bmp -o out.bmp --op vignette --op darken=0.5
+// Inputs can be files, directories of BMP files or wildcard patterns.
+// Nothing is printed unless something goes wrong.
+//
+
+// Settings from the command line
+struct CliOptions
+{
+    vector<string> inputs;      // Input files, after expanding directories and patterns
+    string output;              // Output file, or directory when there are several inputs
+    FilterPipeline pipeline;    // Operations to run, in order
+    deque<Image> layers;        // Top images of layer operations, a deque keeps their addresses
+    bool stream;                // Process a band of rows at a time
+    size_t memory_limit;        // Bytes of pixels streaming keeps in memory
+    BatchOptions batch;         // Threads and queues for several inputs
+    bool report;                // Print how busy each batch stage was
+    bool stats;                 // Print the time and memory of every read, filter and write
+    string trace;               // Chrome trace file to write, empty for none
+
+    CliOptions() : stream(false), memory_limit(STREAM_MEMORY_LIMIT), report(false), stats(false) {}
+};
+
+void print_usage(ostream& out)
+{
+    out << "Usage: main -i INPUT [-i INPUT...] -o OUTPUT [--op OPERATION...]" << endl
+    << "       main            (no arguments) starts the interactive menu" << endl << endl
+    << "  -i, --input PATH     BMP file, directory of BMP files or wildcard pattern" << endl
+    << "  -o, --output PATH    Output file, or directory for several inputs" << endl
+    << "  --op NAME[=VALUES]   Operation to run, in the order given:" << endl
+    << "      vignette[=exponent,strength]  claredon=S  greyscale[=GREY[,single]]" << endl
+    << "      rotate90  rotate=TURNS  scale=X[,Y[,FILTER]]  blackwhite[=T]  lighten=S" << endl
+    << "      darken=S  bwrgb  posterize=N  layer=PATH[,S[,X,Y]][,MODE]  curve=PATH" << endl
+    << "      autolevels[=CLIP[,channels]]  equalize  clahe[=LIMIT[,TILES]]" << endl
+    << "      blur=SIGMA[,B]  boxblur=R[,B]  sharpen[=A[,B]]  emboss[=B]  edges[=B]" << endl
+    << "      kernel=W,W,...[,B]" << endl
+    << "      S is a strength from 0 to 1, FILTER is nearest, bilinear, bicubic," << endl
+    << "      lanczos3 or area, MODE is normal, multiply, screen, overlay, add or" << endl
+    << "      difference; consecutive layers are composited in one pass" << endl
+    << "      T is the grey from 0 to 255 that turns white (default 127), N is the" << endl
+    << "      number of levels each channel keeps, from 2 to 256" << endl
+    << "      CLIP is the percent of pixels clipped at each end (default 0.5)," << endl
+    << "      channels stretches each channel on its own; LIMIT is how far a tile" << endl
+    << "      histogram bin can rise above average (default 2, 0 for no limit)," << endl
+    << "      TILES the tiles along each side (default 8)" << endl
+    << "      GREY is average, rec601 or rec709, single writes an 8 bit grey file" << endl
+    << "      and must be the last operation" << endl
+    << "      SIGMA is the Gaussian blur in pixels, R the box blur radius, A the" << endl
+    << "      sharpen amount up to 1.5 (default 1), W the 9 or 25 weights of a 3x3" << endl
+    << "      or 5x5 kernel, row by row; B is how pixels past the edges are made up," << endl
+    << "      clamp (default), mirror, wrap or zero" << endl
+    << "  --threads N          Number of threads, 0 for every core" << endl
+    << "  --stream             Process a band of rows at a time (point operations and rotations)" << endl
+    << "  --memory MB          Memory limit for --stream" << endl
+    << "  --readers N          Threads reading files in a batch (default 2)" << endl
+    << "  --jobs N             Images filtered at the same time in a batch (default 2)" << endl
+    << "  --writers N          Threads writing files in a batch (default 2)" << endl
+    << "  --queue N            Images waiting between batch stages (default 4)" << endl
+    << "  --report             Print the throughput of each batch stage" << endl
+    << "  --stats              Print the time and memory of every read, filter and write" << endl
+    << "  --trace PATH         Write the same as a Chrome trace file" << endl
+    << "  --bench              Time every operation instead, see run_benchmark()" << endl
+    << "  --verify             Check every fast path against the original, see run_verify()" << endl
+    << "  -h, --help           Show this message" << endl;
+}
+
+bool parse_number(const string& text, double& value)
+/**
+ * Converts a whole string to a number
+ * @return True if the string is only a number
+ */
+{
+    if (text.empty())
+    {
+        return false;
+    }
+    char* end = NULL;
+    value = strtod(text.c_str(), &end);
+    return end != NULL && *end == '\0' && !std::isnan(value);
+}
+
+vector<string> split_values(const string& text)
+{
+    vector<string> values;
+    size_t start = 0;
+    for (size_t i = 0; i <= text.size(); i++)
+    {
+        if (i == text.size() || text[i] == ',')
+        {
+            values.push_back(text.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+    return values;
+}
+
+bool has_bmp_extension(const string& path)
+{
+    if (path.size() < 4)
+    {
+        return false;
+    }
+    string extension = path.substr(path.size() - 4);
+    for (size_t i = 0; i < extension.size(); i++)
+    {
+        extension[i] = tolower(extension[i]);
+    }
+    return extension == ".bmp";
+}
+
+string path_file_name(const string& path)
+/**
+ * Gets the part of a path after the last directory separator
+ */
+{
+    size_t slash = path.find_last_of("/\\");
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+bool is_directory(const string& path)
+{
+#ifdef IMAGE_HAVE_DIRENT
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#elif defined(_WIN32)
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    return false;
+#endif
+}
+
+bool make_directory(const string& path)
+{
+    if (is_directory(path))
+    {
+        return true;
+    }
+#ifdef IMAGE_HAVE_DIRENT
+    return mkdir(path.c_str(), 0755) == 0;
+#elif defined(_WIN32)
+    return CreateDirectoryA(path.c_str(), NULL) != 0;
+#else
+    return false;
+#endif
+}
+
+void expand_input(const string& input, vector<string>& files)
+/**
+ * Adds the files an input argument names
+ * Directories add every BMP file in them, wildcard patterns every match,
+ * both sorted by name. Anything else is added as a file name
+ * @param input The argument
+ * @param files Receives the file names
+ */
+{
+    vector<string> found;
+    bool pattern = input.find_first_of("*?[") != string::npos;
+    if (is_directory(input))
+    {
+        string directory = input;
+        if (directory[directory.size() - 1] != '/' && directory[directory.size() - 1] != '\\')
+        {
+            directory += '/';
+        }
+#ifdef IMAGE_HAVE_DIRENT
+        DIR* dir = opendir(directory.c_str());
+        for (struct dirent* entry = dir ? readdir(dir) : NULL; entry != NULL; entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            if (has_bmp_extension(name) && !is_directory(directory + name))
+            {
+                found.push_back(directory + name);
+            }
+        }
+        if (dir)
+        {
+            closedir(dir);
+        }
+#elif defined(_WIN32)
+        WIN32_FIND_DATAA entry;
+        HANDLE search = FindFirstFileA((directory + "*.bmp").c_str(), &entry);
+        for (bool more = search != INVALID_HANDLE_VALUE; more; more = FindNextFileA(search, &entry) != 0)
+        {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                found.push_back(directory + entry.cFileName);
+            }
+        }
+        if (search != INVALID_HANDLE_VALUE)
+        {
+            FindClose(search);
+        }
+#endif
+    } else if (pattern)
+    {
+#ifdef IMAGE_HAVE_DIRENT
+        glob_t matches;
+        if (glob(input.c_str(), 0, NULL, &matches) == 0)
+        {
+            for (size_t i = 0; i < matches.gl_pathc; i++)
+            {
+                if (!is_directory(matches.gl_pathv[i]))
+                {
+                    found.push_back(matches.gl_pathv[i]);
+                }
+            }
+        }
+        globfree(&matches);
+#elif defined(_WIN32)
+        size_t slash = input.find_last_of("/\\");
+        string directory = slash == string::npos ? "" : input.substr(0, slash + 1);
+        WIN32_FIND_DATAA entry;
+        HANDLE search = FindFirstFileA(input.c_str(), &entry);
+        for (bool more = search != INVALID_HANDLE_VALUE; more; more = FindNextFileA(search, &entry) != 0)
+        {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                found.push_back(directory + entry.cFileName);
+            }
+        }
+        if (search != INVALID_HANDLE_VALUE)
+        {
+            FindClose(search);
+        }
+#endif
+        if (found.empty())
+        {
+            // Reported as a file that cannot be read
+            found.push_back(input);
+        }
+    } else
+    {
+        found.push_back(input);
+    }
+    sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+}
+
+bool parse_resample_filter(const string& name, ResampleFilter& filter)
+{
+    const char* names[] = {"nearest", "bilinear", "bicubic", "lanczos3", "area"};
+    for (int i = 0; i < 5; i++)
+    {
+        if (name == names[i])
+        {
+            filter = static_cast<ResampleFilter>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_grey_mode(const string& name, GreyMode& mode)
+/**
+ * Looks up a greyscale mode by the name used on the command line
+ * @param name Mode name, average, rec601 or rec709
+ * @param mode Receives the mode
+ * @return True if the name is known
+ */
+{
+    const char* names[] = {"average", "rec601", "rec709"};
+    for (int i = 0; i < 3; i++)
+    {
+        if (name == names[i])
+        {
+            mode = static_cast<GreyMode>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_blend_mode(const string& name, BlendMode& mode)
+/**
+ * Looks up a blend mode by the name used on the command line
+ * @param name Mode name, for example multiply
+ * @param mode Receives the mode
+ * @return True if the name is known
+ */
+{
+    const char* names[] = {"normal", "multiply", "screen", "overlay", "add", "difference"};
+    for (int i = 0; i < 6; i++)
+    {
+        if (name == names[i])
+        {
+            mode = static_cast<BlendMode>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_border_mode(const string& name, BorderMode& mode)
+/**
+ * Looks up a border mode by the name used on the command line
+ * @param name Mode name, clamp, mirror, wrap or zero
+ * @param mode Receives the mode
+ * @return True if the name is known
+ */
+{
+    const char* names[] = {"clamp", "mirror", "wrap", "zero"};
+    for (int i = 0; i < 4; i++)
+    {
+        if (name == names[i])
+        {
+            mode = static_cast<BorderMode>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_operation(const string& spec, CliOptions& options, string& error)
+/**
+ * Adds the operation of one --op argument to the pipeline
+ * @param spec    NAME or NAME=VALUES
+ * @param options Settings to add the operation to
+ * @param error   Receives a message when the operation is not valid
+ * @return True if the operation was added
+ */
+{
+    size_t equals = spec.find('=');
+    string name = spec.substr(0, equals);
+    vector<string> values;
+    if (equals != string::npos)
+    {
+        values = split_values(spec.substr(equals + 1));
+    }
+
+    // Values that are numbers, the rest are left for names and paths
+    vector<double> numbers(values.size(), 0);
+    vector<bool> is_number(values.size(), false);
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        is_number[i] = parse_number(values[i], numbers[i]);
+    }
+    error = "invalid operation: " + spec;
+
+    // Filters expect colour images, so nothing can follow a single channel greyscale
+    const vector<FilterStage>& stages = options.pipeline.get_stages();
+    if (!stages.empty() && stages.back().single_channel)
+    {
+        error = "greyscale with one channel must be the last operation: " + spec;
+        return false;
+    }
+
+    // Convolutions take a trailing border mode
+    BorderMode border = BORDER_CLAMP;
+    bool convolution = name == "blur" || name == "boxblur" || name == "sharpen" || name == "emboss"
+                    || name == "edges" || name == "kernel";
+    if (convolution && !values.empty() && !is_number.back())
+    {
+        if (!parse_border_mode(values.back(), border))
+        {
+            return false;
+        }
+        values.pop_back();
+        numbers.pop_back();
+        is_number.pop_back();
+    }
+    for (size_t i = 0; convolution && i < values.size(); i++)
+    {
+        if (!is_number[i])
+        {
+            return false;
+        }
+    }
+
+    if (name == "vignette" && values.size() <= 2)
+    {
+        if ((values.size() > 0 && !is_number[0]) || (values.size() > 1 && !is_number[1]))
+        {
+            return false;
+        }
+        options.pipeline.add_vignette(values.size() > 0 ? numbers[0] : VIGNETTE_EXPONENT,
+                                      values.size() > 1 ? numbers[1] : VIGNETTE_STRENGTH);
+    } else if ((name == "claredon" || name == "lighten" || name == "darken") && values.size() == 1)
+    {
+        // Same range the menu accepts
+        if (!is_number[0] || numbers[0] < 0 || numbers[0] > 1)
+        {
+            return false;
+        }
+        FilterOp op = name == "claredon" ? OP_CLAREDON : (name == "lighten" ? OP_LIGHTEN : OP_DARKEN);
+        options.pipeline.add(op, numbers[0]);
+    } else if ((name == "greyscale" || name == "grayscale") && values.size() <= 2)
+    {
+        GreyMode mode = GREY_AVERAGE;
+        if ((values.size() > 0 && !parse_grey_mode(values[0], mode)) || (values.size() > 1 && values[1] != "single"))
+        {
+            return false;
+        }
+        options.pipeline.add_greyscale(mode, values.size() > 1);
+    } else if (name == "rotate90" && values.empty())
+    {
+        options.pipeline.add(OP_ROTATE_90);
+    } else if (name == "rotate" && values.size() == 1)
+    {
+        if (!is_number[0])
+        {
+            return false;
+        }
+        options.pipeline.add(OP_ROTATE, round(numbers[0]));
+    } else if (name == "scale" && values.size() >= 1 && values.size() <= 3)
+    {
+        ResampleFilter filter = RESAMPLE_NEAREST;
+        if (!is_number[0] || numbers[0] <= 0 || (values.size() > 1 && (!is_number[1] || numbers[1] <= 0))
+            || (values.size() > 2 && !parse_resample_filter(values[2], filter)))
+        {
+            return false;
+        }
+        options.pipeline.add_scale(numbers[0], values.size() > 1 ? numbers[1] : numbers[0], filter);
+    } else if ((name == "blackwhite" || name == "bw") && values.size() <= 1)
+    {
+        if (values.size() > 0 && (!is_number[0] || numbers[0] < 0 || numbers[0] > 255))
+        {
+            return false;
+        }
+        options.pipeline.add_black_white(values.size() > 0 ? static_cast<int>(round(numbers[0])) : BLACK_WHITE_THRESHOLD);
+    } else if (name == "autolevels" && values.size() <= 2)
+    {
+        if ((values.size() > 0 && (!is_number[0] || numbers[0] < 0 || numbers[0] >= 50))
+            || (values.size() > 1 && values[1] != "channels"))
+        {
+            return false;
+        }
+        options.pipeline.add_auto_levels(values.size() > 0 ? numbers[0] : AUTO_LEVELS_CLIP, values.size() > 1);
+    } else if (name == "equalize" && values.empty())
+    {
+        options.pipeline.add(OP_EQUALIZE);
+    } else if (name == "clahe" && values.size() <= 2)
+    {
+        if ((values.size() > 0 && (!is_number[0] || numbers[0] < 0))
+            || (values.size() > 1 && (!is_number[1] || numbers[1] < 1 || numbers[1] > 64)))
+        {
+            return false;
+        }
+        options.pipeline.add_clahe(values.size() > 0 ? numbers[0] : CLAHE_CLIP_LIMIT,
+                                   values.size() > 1 ? static_cast<int>(numbers[1]) : CLAHE_TILES);
+    } else if (name == "blur" && values.size() == 1)
+    {
+        if (numbers[0] <= 0 || numbers[0] > 100)
+        {
+            return false;
+        }
+        options.pipeline.add_convolution(OP_BLUR, numbers[0], border);
+    } else if (name == "boxblur" && values.size() == 1)
+    {
+        if (numbers[0] < 1 || numbers[0] > 1000)
+        {
+            return false;
+        }
+        options.pipeline.add_convolution(OP_BOX_BLUR, round(numbers[0]), border);
+    } else if (name == "sharpen" && values.size() <= 1)
+    {
+        // Larger amounts would overflow the fixed point weights
+        if (values.size() > 0 && (numbers[0] < 0 || numbers[0] > 1.5))
+        {
+            return false;
+        }
+        options.pipeline.add_convolution(OP_SHARPEN, values.size() > 0 ? numbers[0] : 1, border);
+    } else if ((name == "emboss" || name == "edges") && values.empty())
+    {
+        options.pipeline.add_convolution(name == "emboss" ? OP_EMBOSS : OP_EDGES, 0, border);
+    } else if (name == "kernel" && (values.size() == 9 || values.size() == 25))
+    {
+        ConvolutionKernel kernel = {values.size() == 9 ? 3 : 5, numbers};
+        for (size_t i = 0; i < numbers.size(); i++)
+        {
+            if (fabs(numbers[i]) >= CONVOLVE_MAX_WEIGHT)
+            {
+                return false;
+            }
+        }
+        options.pipeline.add_kernel(kernel, border);
+    } else if (name == "posterize" && values.size() == 1)
+    {
+        if (!is_number[0] || numbers[0] < 2 || numbers[0] > 256)
+        {
+            return false;
+        }
+        options.pipeline.add_posterize(static_cast<int>(round(numbers[0])));
+    } else if (name == "bwrgb" && values.empty())
+    {
+        options.pipeline.add(OP_BLACK_WHITE_RGB);
+    } else if (name == "layer" && values.size() >= 1 && values.size() <= 5)
+    {
+        // A trailing name picks the blend mode, the rest is PATH[,S[,X,Y]]
+        BlendMode blend = BLEND_NORMAL;
+        if (values.size() == 3 || values.size() == 5 || (values.size() == 2 && !is_number[1]))
+        {
+            if (!parse_blend_mode(values.back(), blend))
+            {
+                return false;
+            }
+            values.pop_back();
+        }
+        if (values.size() == 3)
+        {
+            return false;
+        }
+
+        // Centered like process_11 unless a position is given
+        double scaling = values.size() > 1 ? numbers[1] : .5;
+        if (values.size() > 1 && (!is_number[1] || scaling < 0 || scaling > 1))
+        {
+            return false;
+        }
+        // Offsets must fit an int, beyond a billion pixels the layer misses any image anyway
+        if (values.size() == 4 && (!is_number[2] || !is_number[3] || fabs(numbers[2]) > 1e9 || fabs(numbers[3]) > 1e9))
+        {
+            return false;
+        }
+        options.layers.push_back(read_bmp(values[0]));
+        if (options.layers.back().empty())
+        {
+            error = "unable to read layer image: " + values[0];
+            return false;
+        }
+        if (values.size() == 4)
+        {
+            options.pipeline.add_layer_at(options.layers.back(), scaling, static_cast<int>(numbers[2]), static_cast<int>(numbers[3]), blend);
+        } else
+        {
+            options.pipeline.add_layer(options.layers.back(), scaling, blend);
+        }
+    } else if (name == "curve" && values.size() == 1)
+    {
+        ToneCurve curve;
+        if (!load_curve(values[0], curve))
+        {
+            error = "unable to read curve: " + values[0];
+            return false;
+        }
+        options.pipeline.add_curve(curve);
+    } else
+    {
+        return false;
+    }
+    return true;
+}
+
+bool parse_cli(int argc, char* argv[], CliOptions& options, string& error)
+/**
+ * Reads the command line arguments
+ * @param argc    Number of arguments
+ * @param argv    The arguments, argv[0] is the program
+ * @param options Receives the settings
+ * @param error   Receives a message when the arguments are not valid
+ * @return True if the arguments are valid
+ */
+{
+    // The --op argument behind each stage, to name it in errors
+    vector<string> operations;
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if ((arg == "-i" || arg == "--input") && has_value)
+        {
+            expand_input(argv[++a], options.inputs);
+        } else if ((arg == "-o" || arg == "--output") && has_value)
+        {
+            options.output = argv[++a];
+        } else if (arg == "--op" && has_value)
+        {
+            if (!parse_operation(argv[++a], options, error))
+            {
+                return false;
+            }
+            operations.resize(options.pipeline.get_stages().size(), argv[a]);
+        } else if (arg == "--threads" && has_value)
+        {
+            double threads;
+            if (!parse_number(argv[++a], threads) || threads < 0)
+            {
+                error = "invalid thread count: " + string(argv[a]);
+                return false;
+            }
+            set_thread_count(static_cast<int>(threads));
+        } else if ((arg == "--readers" || arg == "--jobs" || arg == "--writers" || arg == "--queue") && has_value)
+        {
+            double count;
+            if (!parse_number(argv[++a], count) || count < 1)
+            {
+                error = "invalid count for " + arg + ": " + string(argv[a]);
+                return false;
+            }
+            int& setting = arg == "--readers" ? options.batch.readers
+                         : arg == "--jobs" ? options.batch.computers
+                         : arg == "--writers" ? options.batch.writers : options.batch.queue_depth;
+            setting = static_cast<int>(count);
+        } else if (arg == "--report")
+        {
+            options.report = true;
+        } else if (arg == "--stats")
+        {
+            options.stats = true;
+        } else if (arg == "--trace" && has_value)
+        {
+            options.trace = argv[++a];
+        } else if (arg == "--stream")
+        {
+            options.stream = true;
+        } else if (arg == "--memory" && has_value)
+        {
+            double megabytes;
+            if (!parse_number(argv[++a], megabytes) || megabytes <= 0)
+            {
+                error = "invalid memory limit: " + string(argv[a]);
+                return false;
+            }
+            options.memory_limit = static_cast<size_t>(megabytes * 1024 * 1024);
+        } else
+        {
+            error = "unknown or incomplete argument: " + arg;
+            return false;
+        }
+    }
+
+    if (options.inputs.empty() || options.output.empty())
+    {
+        error = "an input and an output are required";
+        return false;
+    }
+
+    // Found here rather than part way through the files
+    const vector<FilterStage>& stages = options.pipeline.get_stages();
+    for (size_t s = 0; s < stages.size() && options.stream; s++)
+    {
+        if (!is_stream_stage(stages[s]))
+        {
+            error = "operation cannot be streamed: " + operations[s];
+            return false;
+        }
+    }
+    return true;
+}
+
+string cli_output_path(const CliOptions& options, const string& input)
+/**
+ * Gets where the result for an input is written
+ * Several inputs, or an output that is a directory, keep the input file names
+ */
+{
+    const string& output = options.output;
+    char last = output[output.size() - 1];
+    if (options.inputs.size() > 1 || last == '/' || last == '\\' || is_directory(output))
+    {
+        string directory = (last == '/' || last == '\\') ? output : output + "/";
+        return directory + path_file_name(input);
+    }
+    return output;
+}
+
+bool run_cli_file(const CliOptions& options, const string& input, const string& output, string& error)
+/**
+ * Runs the pipeline on one file
+ * @return True if the result was written
+ */
+{
+    if (output == input)
+    {
+        error = "cannot overwrite input: " + input;
+        return false;
+    }
+    if (options.stream)
+    {
+        if (!stream_pipeline_bmp(input, output, options.pipeline, options.memory_limit))
+        {
+            error = "unable to stream " + input + " to " + output;
+            return false;
+        }
+        return true;
+    }
+
+    Image image;
+    if (!read_bmp_into(input, image, &image_pool))
+    {
+        error = "unable to read image: " + input;
+        return false;
+    }
+    options.pipeline.run(image);
+    bool written = write_bmp(output, image);
+    image_pool.release(image);
+    if (!written)
+    {
+        error = "unable to write image: " + output;
+        return false;
+    }
+    return true;
+}
+
+int run_cli(int argc, char* argv[])
+/**
+ * Runs the command line mode
+ * @return 0 on success, 1 if any file failed, 2 for invalid arguments
+ */
+{
+    for (int a = 1; a < argc; a++)
+    {
+        if (string(argv[a]) == "-h" || string(argv[a]) == "--help")
+        {
+            print_usage(cout);
+            return 0;
+        }
+    }
+
+    CliOptions options;
+    string error;
+    if (!parse_cli(argc, argv, options, error))
+    {
+        cerr << "ERROR: " << error << endl;
+        print_usage(cerr);
+        return 2;
+    }
+    if (options.inputs.size() > 1 && !make_directory(options.output))
+    {
+        cerr << "ERROR: unable to create output directory: " << options.output << endl;
+        return 1;
+    }
+    if (options.stats || !options.trace.empty())
+    {
+        start_instrumentation();
+    }
+
+    // Skips inputs that would overwrite themselves, or the result of an
+    // earlier input with the same file name
+    int failures = 0;
+    vector<string> inputs;
+    vector<string> outputs;
+    set<string> written;
+    for (size_t i = 0; i < options.inputs.size(); i++)
+    {
+        string output = cli_output_path(options, options.inputs[i]);
+        if (output == options.inputs[i])
+        {
+            cerr << "ERROR: cannot overwrite input: " << output << endl;
+            failures++;
+            continue;
+        }
+        if (!written.insert(output).second)
+        {
+            cerr << "ERROR: " << options.inputs[i] << " would overwrite the result of an earlier input: " << output << endl;
+            failures++;
+            continue;
+        }
+        inputs.push_back(options.inputs[i]);
+        outputs.push_back(output);
+    }
+
+    if (options.inputs.size() == 1 || options.stream)
+    {
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            if (!run_cli_file(options, inputs[i], outputs[i], error))
+            {
+                cerr << "ERROR: " << error << endl;
+                failures++;
+            }
+        }
+    } else
+    {
+        vector<string> errors;
+        BatchStats stats = run_batch(inputs, outputs, options.pipeline, options.batch, errors);
+        for (size_t i = 0; i < errors.size(); i++)
+        {
+            cerr << "ERROR: " << errors[i] << endl;
+        }
+        if (options.report)
+        {
+            print_batch_stats(cout, stats);
+        }
+        failures += stats.failures;
+    }
+
+    stop_instrumentation();
+    if (options.stats)
+    {
+        print_instrumentation_summary(cout);
+        print_image_pool_stats(cout);
+    }
+    if (!options.trace.empty() && !write_chrome_trace(options.trace))
+    {
+        cerr << "ERROR: unable to write trace: " << options.trace << endl;
+        failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+
+//
+// Benchmarks
+// Times every process, its Image based replacement and the BMP reader and
+// writer on synthetic images from VGA up to 100 megapixels. Each case runs
+// a few warm-up rounds and then repeated trials, and reports megapixels per
+// second, nanoseconds per pixel and allocations per run as JSON or CSV:
+//   ./main --bench --sizes vga,4k --trials 5 --format csv
+//
+
+// Synthetic image sizes
+struct BenchSize
+{
+    const char* name;
+    int width;
+    int height;
+};
+
+const BenchSize BENCH_SIZES[] = {
+    {"vga", 640, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+    {"12mp", 4000, 3000},
+    {"100mp", 10000, 10000}
+};
+const int BENCH_SIZE_COUNT = sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]);
+
+// Legacy processes copy the image several times, larger sizes are skipped
+const long long BENCH_LEGACY_MAX_PIXELS = 25000000;
+
+// How much slower than its filters run separately a fused pipeline may time,
+// for noise, as a share and in seconds for the cases that take microseconds
+const double BENCH_FUSED_SLACK = 1.1;
+const double BENCH_FUSED_SLACK_SECONDS = 1e-4;
+
+// Images and scratch space shared by the cases of one size
+struct BenchContext
+{
+    Image source;
+    Image layer;
+    Image work;
+    Image output;
+    PlanarImage planar;
+    vector<vector<Pixel>> legacy_source;
+    vector<vector<Pixel>> legacy_layer;
+    string io_path;             // File the I/O cases write and read
+};
+
+// One operation to time
+struct BenchCase
+{
+    string name;
+    bool legacy;                            // Uses vector<vector<Pixel>>
+    function<void(BenchContext&)> setup;    // Untimed preparation before each run, may be empty
+    function<void(BenchContext&)> run;      // The timed part
+};
+
+struct BenchResult
+{
+    string name;
+    string size;
+    int width;
+    int height;
+    int trials;
+    double median_seconds;
+    double min_seconds;
+    double allocations;         // Per run
+    double allocated_bytes;     // Per run
+};
+
+/**
+ * Stream buffer that drops everything, hides what the legacy processes print
+ */
+class NullBuffer : public streambuf
+{
+protected:
+    int overflow(int c) { return c; }
+};
+
+Image synthetic_image(int width, int height, unsigned int seed)
+/**
+ * Makes a repeatable test image of smooth gradients with noise on top,
+ * so bright, dark and middle pixels all occur
+ */
+{
+    Image image(width, height);
+    unsigned int state = seed * 2654435761u + 1;
+    for (int y = 0; y < height; y++)
+    {
+        unsigned char* p = image.row(y);
+        for (int x = 0; x < width; x++)
+        {
+            // xorshift noise
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            int noise = static_cast<int>(state & 63) - 32;
+            p[CHANNEL_RED] = static_cast<unsigned char>(min(max(x * 255 / max(width - 1, 1) + noise, 0), 255));
+            p[CHANNEL_GREEN] = static_cast<unsigned char>(min(max(y * 255 / max(height - 1, 1) + noise, 0), 255));
+            p[CHANNEL_BLUE] = static_cast<unsigned char>(min(max(((x + y) & 255) + noise, 0), 255));
+            p += image.channels;
+        }
+    }
+    return image;
+}
+
+vector<BenchCase> bench_cases()
+/**
+ * Lists every operation the benchmark can time
+ */
+{
+    vector<BenchCase> cases;
+    auto add = [&cases](const string& name, bool legacy, function<void(BenchContext&)> setup, function<void(BenchContext&)> run)
+    {
+        BenchCase bench_case = {name, legacy, setup, run};
+        cases.push_back(bench_case);
+    };
+    auto copy_source = [](BenchContext& c) { c.work = c.source; };
+
+    // BMP reading and writing
+    add("write_bmp", false, NULL, [](BenchContext& c) { write_bmp(c.io_path, c.source); });
+    add("read_bmp", false, [](BenchContext& c) { write_bmp(c.io_path, c.source); },
+        [](BenchContext& c) { c.work = read_bmp(c.io_path); });
+    add("write_image", true, NULL, [](BenchContext& c) { write_image(c.io_path, c.legacy_source); });
+    add("write_image_fast", true, NULL, [](BenchContext& c) { write_image_fast(c.io_path, c.legacy_source); });
+    add("read_image", true, [](BenchContext& c) { write_bmp(c.io_path, c.source); },
+        [](BenchContext& c) { c.legacy_source = read_image(c.io_path); });
+    add("read_image_fast", true, [](BenchContext& c) { write_bmp(c.io_path, c.source); },
+        [](BenchContext& c) { c.legacy_source = read_image_fast(c.io_path); });
+
+    // Planar layout
+    add("to_planar", false, NULL, [](BenchContext& c) { to_planar(c.source); });
+    add("to_interleaved", false, [](BenchContext& c) { c.planar = to_planar(c.source); },
+        [](BenchContext& c) { c.output = to_interleaved(c.planar); });
+
+    // Image based filters
+    add("vignette", false, copy_source, [](BenchContext& c) { vignette_in_place(c.work); });
+    add("claredon", false, copy_source, [](BenchContext& c) { claredon_in_place(c.work, .5); });
+    add("greyscale", false, copy_source, [](BenchContext& c) { greyscale_in_place(c.work); });
+    add("greyscale_rec709", false, copy_source, [](BenchContext& c) { greyscale_in_place(c.work, GREY_REC709); });
+    add("greyscale_single", false, NULL, [](BenchContext& c) { greyscale_into(c.source, c.output, GREY_REC709); });
+    add("rotate90", false, NULL, [](BenchContext& c) { rotate_90_into(c.source, c.output); });
+    add("rotate", false, NULL, [](BenchContext& c) { rotate_into(c.source, c.output, 3); });
+    add("scale", false, NULL, [](BenchContext& c) { scale_into(c.source, c.output, 1.5, 1.5); });
+    add("scale_bilinear", false, NULL, [](BenchContext& c) { scale_into(c.source, c.output, .5, .5, RESAMPLE_BILINEAR); });
+    add("scale_lanczos3", false, NULL, [](BenchContext& c) { scale_into(c.source, c.output, .5, .5, RESAMPLE_LANCZOS3); });
+    add("blackwhite", false, copy_source, [](BenchContext& c) { black_white_in_place(c.work); });
+    add("lighten", false, copy_source, [](BenchContext& c) { lighten_in_place(c.work, .5); });
+    add("darken", false, copy_source, [](BenchContext& c) { darken_in_place(c.work, .5); });
+    add("bwrgb", false, copy_source, [](BenchContext& c) { black_white_rgb_in_place(c.work); });
+    add("posterize", false, copy_source, [](BenchContext& c) { posterize_in_place(c.work, 4); });
+    add("stats", false, NULL, [](BenchContext& c) { image_stats(c.source); });
+    add("autolevels", false, copy_source, [](BenchContext& c) { auto_levels_in_place(c.work); });
+    add("equalize", false, copy_source, [](BenchContext& c) { equalize_in_place(c.work); });
+    add("clahe", false, copy_source, [](BenchContext& c) { clahe_in_place(c.work); });
+    add("blur", false, NULL, [](BenchContext& c) { gaussian_blur_into(c.source, c.output, 3); });
+    add("boxblur", false, NULL, [](BenchContext& c) { box_blur_into(c.source, c.output, 2); });
+    add("boxblur_r20", false, NULL, [](BenchContext& c) { box_blur_into(c.source, c.output, 20); });
+    add("sharpen", false, NULL, [](BenchContext& c) { convolve_into(c.source, c.output, sharpen_kernel(1)); });
+    add("edges", false, NULL, [](BenchContext& c) { sobel_into(c.source, c.output); });
+    add("layer", false, NULL, [](BenchContext& c) { layer_into(c.source, c.layer, .5, c.output); });
+    add("composite3", false, copy_source, [](BenchContext& c)
+    {
+        vector<CompositeLayer> layers;
+        CompositeLayer layer = {&c.layer, .5, 0, 0, BLEND_NORMAL};
+        for (int mode = BLEND_NORMAL; mode <= BLEND_SCREEN; mode++)
+        {
+            layer.mode = static_cast<BlendMode>(mode);
+            layer.x = centered_offset(c.work.width, c.layer.width) + mode * 8;
+            layer.y = centered_offset(c.work.height, c.layer.height);
+            layers.push_back(layer);
+        }
+        composite_in_place(c.work, layers);
+    });
+    // Fused pipelines, each with the same filters run separately to compare
+    add("pipeline", false, copy_source, [](BenchContext& c)
+    {
+        FilterPipeline pipeline;
+        pipeline.add(OP_VIGNETTE).add(OP_CLAREDON, .5).add(OP_DARKEN, .8);
+        pipeline.run(c.work);
+    });
+    add("pipeline_separate", false, copy_source, [](BenchContext& c)
+    {
+        vignette_in_place(c.work);
+        claredon_in_place(c.work, .5);
+        darken_in_place(c.work, .8);
+    });
+    add("pipeline_tone", false, copy_source, [](BenchContext& c)
+    {
+        FilterPipeline pipeline;
+        pipeline.add(OP_GREYSCALE).add(OP_DARKEN, .5).add(OP_LIGHTEN, .5);
+        pipeline.run(c.work);
+    });
+    add("pipeline_tone_separate", false, copy_source, [](BenchContext& c)
+    {
+        greyscale_in_place(c.work);
+        darken_in_place(c.work, .5);
+        lighten_in_place(c.work, .5);
+    });
+    add("pipeline_darken", false, copy_source, [](BenchContext& c)
+    {
+        FilterPipeline pipeline;
+        pipeline.add(OP_DARKEN, .5);
+        pipeline.run(c.work);
+    });
+    add("pipeline_darken_separate", false, copy_source, [](BenchContext& c) { darken_in_place(c.work, .5); });
+    add("pipeline_contrast", false, copy_source, [](BenchContext& c)
+    {
+        FilterPipeline pipeline;
+        pipeline.add(OP_BLACK_WHITE).add(OP_BLACK_WHITE_RGB);
+        pipeline.run(c.work);
+    });
+    add("pipeline_contrast_separate", false, copy_source, [](BenchContext& c)
+    {
+        black_white_in_place(c.work);
+        black_white_rgb_in_place(c.work);
+    });
+    add("pipeline_geometric", false, copy_source, [](BenchContext& c)
+    {
+        // Second images come from image_pool, so after the warm-up rounds nothing large is allocated
+        FilterPipeline pipeline;
+        pipeline.add(OP_ROTATE_90).add_scale(.5, .5, RESAMPLE_BILINEAR).add(OP_ROTATE, 3);
+        pipeline.run(c.work);
+    });
+
+    // The original processes, copies included since the menu passed them by value
+    add("process_01", true, NULL, [](BenchContext& c) { process_01(c.legacy_source); });
+    add("process_02", true, NULL, [](BenchContext& c) { process_02(c.legacy_source, .5); });
+    add("process_03", true, NULL, [](BenchContext& c) { process_03(c.legacy_source); });
+    add("process_04", true, NULL, [](BenchContext& c) { process_04(c.legacy_source); });
+    add("process_05", true, NULL, [](BenchContext& c) { process_05(c.legacy_source, 3); });
+    add("process_06", true, NULL, [](BenchContext& c) { process_06(c.legacy_source, 1.5, 1.5); });
+    add("process_07", true, NULL, [](BenchContext& c) { process_07(c.legacy_source); });
+    add("process_08", true, NULL, [](BenchContext& c) { process_08(c.legacy_source, .5); });
+    add("process_09", true, NULL, [](BenchContext& c) { process_09(c.legacy_source, .5); });
+    add("process_10", true, NULL, [](BenchContext& c) { process_10(c.legacy_source); });
+    add("process_11", true, NULL, [](BenchContext& c) { process_11(c.legacy_source, c.legacy_layer, .5); });
+    return cases;
+}
+
+BenchResult run_bench_case(const BenchCase& bench_case, BenchContext& context, const BenchSize& size, int warmups, int trials)
+/**
+ * Times one case, setup runs before every round and is not timed
+ */
+{
+    vector<double> times;
+    long long allocations = 0;
+    long long bytes = 0;
+    for (int round = 0; round < warmups + trials; round++)
+    {
+        if (bench_case.setup)
+        {
+            bench_case.setup(context);
+        }
+        long long count_before = thread_allocations;
+        long long bytes_before = thread_allocated_bytes;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bench_case.run(context);
+        double seconds = seconds_since(start);
+        if (round >= warmups)
+        {
+            times.push_back(seconds);
+            allocations += thread_allocations - count_before;
+            bytes += thread_allocated_bytes - bytes_before;
+        }
+    }
+
+    sort(times.begin(), times.end());
+    BenchResult result;
+    result.name = bench_case.name;
+    result.size = size.name;
+    result.width = size.width;
+    result.height = size.height;
+    result.trials = trials;
+    result.median_seconds = times[times.size() / 2];
+    result.min_seconds = times[0];
+    result.allocations = static_cast<double>(allocations) / trials;
+    result.allocated_bytes = static_cast<double>(bytes) / trials;
+    return result;
+}
+
+void print_bench_results(ostream& out, const vector<BenchResult>& results, bool csv)
+/**
+ * Prints results as JSON, or CSV with a header line
+ * Rates use the median time
+ */
+{
+    const char* simd_names[] = {"none", "sse2", "avx2"};
+    if (csv)
+    {
+        out << "op,size,width,height,trials,median_ms,min_ms,mp_per_s,ns_per_pixel,allocations,allocated_bytes" << endl;
+    } else
+    {
+        out << "{" << endl
+        << "  \"simd\": \"" << simd_names[active_simd_level] << "\"," << endl
+        << "  \"threads\": " << thread_pool().size() << "," << endl
+        << "  \"results\": [" << endl;
+    }
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& r = results[i];
+        double pixels = static_cast<double>(r.width) * r.height;
+        char line[512];
+        if (csv)
+        {
+            snprintf(line, sizeof(line), "%s,%s,%d,%d,%d,%.4f,%.4f,%.2f,%.3f,%.1f,%.0f",
+                     r.name.c_str(), r.size.c_str(), r.width, r.height, r.trials,
+                     r.median_seconds * 1e3, r.min_seconds * 1e3, pixels / r.median_seconds / 1e6,
+                     r.median_seconds * 1e9 / pixels, r.allocations, r.allocated_bytes);
+        } else
+        {
+            snprintf(line, sizeof(line),
+                     "    {\"op\": \"%s\", \"size\": \"%s\", \"width\": %d, \"height\": %d, \"trials\": %d, "
+                     "\"median_ms\": %.4f, \"min_ms\": %.4f, \"mp_per_s\": %.2f, \"ns_per_pixel\": %.3f, "
+                     "\"allocations\": %.1f, \"allocated_bytes\": %.0f}%s",
+                     r.name.c_str(), r.size.c_str(), r.width, r.height, r.trials,
+                     r.median_seconds * 1e3, r.min_seconds * 1e3, pixels / r.median_seconds / 1e6,
+                     r.median_seconds * 1e9 / pixels, r.allocations, r.allocated_bytes,
+                     i + 1 < results.size() ? "," : "");
+        }
+        out << line << endl;
+    }
+    if (!csv)
+    {
+        out << "  ]" << endl << "}" << endl;
+    }
+}
+
+int check_fused_results(ostream& out, const vector<BenchResult>& results)
+/**
+ * Checks that every fused pipeline case is no slower than the same filters
+ * run separately, its "_separate" case of the same size
+ * Compares the fastest runs, which vary least from run to run
+ * @param out     Stream to report the slower cases to
+ * @param results Results of the benchmark
+ * @return the number of fused cases that were slower
+ */
+{
+    int slower = 0;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        for (size_t j = 0; j < results.size(); j++)
+        {
+            const BenchResult& fused = results[i];
+            const BenchResult& separate = results[j];
+            if (separate.name != fused.name + "_separate" || separate.size != fused.size)
+            {
+                continue;
+            }
+            if (fused.min_seconds > separate.min_seconds * BENCH_FUSED_SLACK + BENCH_FUSED_SLACK_SECONDS)
+            {
+                out << "ERROR: " << fused.name << " takes " << fused.min_seconds * 1e3 << " ms at " << fused.size
+                << ", slower than the " << separate.min_seconds * 1e3 << " ms of its filters run separately" << endl;
+                slower++;
+            }
+        }
+    }
+    return slower;
+}
+
+int run_benchmark(int argc, char* argv[])
+/**
+ * Runs the benchmark mode of the command line
+ *   --sizes LIST    Sizes to run, from vga, 720p, 1080p, 4k, 12mp, 100mp or all
+ *   --ops LIST      Cases to run, default all
+ *   --trials N      Timed runs per case (default 5)
+ *   --warmup N      Untimed runs first (default 1)
+ *   --format F      json (default) or csv
+ *   --threads N     Number of threads, 0 for every core
+ *   --no-legacy     Skip the original processes
+ *   -o PATH         Write the results to a file instead of the screen
+ * Fused pipeline cases are checked against their filters run separately
+ * @return 0 on success, 1 if a fused pipeline was slower or the results
+ *         could not be written, 2 for invalid arguments
+ */
+{
+    // Every case reports its allocations
+    allocation_counting.store(true);
+    vector<string> sizes = split_values("vga,1080p,4k,12mp");
+    vector<string> ops;
+    int trials = 5;
+    int warmups = 1;
+    bool csv = false;
+    bool legacy = true;
+    string output;
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (arg == "--bench")
+        {
+            continue;
+        } else if (arg == "--sizes" && has_value)
+        {
+            string list = argv[++a];
+            sizes.clear();
+            for (int i = 0; list == "all" && i < BENCH_SIZE_COUNT; i++)
+            {
+                sizes.push_back(BENCH_SIZES[i].name);
+            }
+            if (list != "all")
+            {
+                sizes = split_values(list);
+            }
+        } else if (arg == "--ops" && has_value)
+        {
+            ops = split_values(argv[++a]);
+        } else if ((arg == "--trials" || arg == "--warmup" || arg == "--threads") && has_value)
+        {
+            double number;
+            if (!parse_number(argv[++a], number) || number < (arg == "--trials" ? 1 : 0))
+            {
+                cerr << "ERROR: invalid count for " << arg << ": " << argv[a] << endl;
+                return 2;
+            }
+            if (arg == "--trials")
+            {
+                trials = static_cast<int>(number);
+            } else if (arg == "--warmup")
+            {
+                warmups = static_cast<int>(number);
+            } else
+            {
+                set_thread_count(static_cast<int>(number));
+            }
+        } else if (arg == "--format" && has_value && (string(argv[a + 1]) == "json" || string(argv[a + 1]) == "csv"))
+        {
+            csv = string(argv[++a]) == "csv";
+        } else if (arg == "--no-legacy")
+        {
+            legacy = false;
+        } else if ((arg == "-o" || arg == "--output") && has_value)
+        {
+            output = argv[++a];
+        } else
+        {
+            cerr << "ERROR: unknown or incomplete benchmark argument: " << arg << endl;
+            return 2;
+        }
+    }
+
+    vector<const BenchSize*> chosen;
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        const BenchSize* found = NULL;
+        for (int n = 0; n < BENCH_SIZE_COUNT; n++)
+        {
+            found = sizes[i] == BENCH_SIZES[n].name ? &BENCH_SIZES[n] : found;
+        }
+        if (found == NULL)
+        {
+            cerr << "ERROR: unknown benchmark size: " << sizes[i] << endl;
+            return 2;
+        }
+        chosen.push_back(found);
+    }
+
+    vector<BenchCase> cases = bench_cases();
+    vector<BenchResult> results;
+    NullBuffer null_buffer;
+    for (size_t s = 0; s < chosen.size(); s++)
+    {
+        const BenchSize& size = *chosen[s];
+        BenchContext context;
+        context.source = synthetic_image(size.width, size.height, 1);
+        context.layer = synthetic_image(size.width / 2, size.height / 2, 2);
+        context.io_path = (output.empty() ? string("bench") : output) + ".tmp.bmp";
+        bool run_legacy = legacy && static_cast<long long>(size.width) * size.height <= BENCH_LEGACY_MAX_PIXELS;
+        if (run_legacy)
+        {
+            context.legacy_source = to_pixels(context.source);
+            context.legacy_layer = to_pixels(context.layer);
+        }
+
+        for (size_t c = 0; c < cases.size(); c++)
+        {
+            if ((cases[c].legacy && !run_legacy)
+                || (!ops.empty() && find(ops.begin(), ops.end(), cases[c].name) == ops.end()))
+            {
+                continue;
+            }
+            // Hides the "Executed Process" lines of the legacy processes
+            streambuf* screen = cout.rdbuf(&null_buffer);
+            results.push_back(run_bench_case(cases[c], context, size, warmups, trials));
+            cout.rdbuf(screen);
+        }
+        remove(context.io_path.c_str());
+    }
+
+    int slower = check_fused_results(cerr, results);
+    if (output.empty())
+    {
+        print_bench_results(cout, results, csv);
+        return slower == 0 ? 0 : 1;
+    }
+    ofstream stream(output.c_str());
+    print_bench_results(stream, results, csv);
+    return stream.good() && slower == 0 ? 0 : 1;
+}
+
+
+//
+// Verification
+// Checks the Image based filters against stored golden images and against
+// the original processes. output/ holds images made by process_01 to
+// process_11 and must match exactly; sample_images/ holds images made by
+// image_process.py, which rounds differently, so some of those are only
+// compared within a tolerance. Every fast path (each SIMD level, one or
+// many threads, lookup tables, the pipeline and streaming) is compared
+// with the original process pixel for pixel:
+//   ./main --verify
+//
+
+// Largest allowed difference between two images
+struct VerifyTolerance
+{
+    int max_difference;     // Largest difference of any channel
+    double max_fraction;    // Share of channels that may differ at all
+};
+
+const VerifyTolerance VERIFY_EXACT = {0, 0};
+
+// How two images differ
+struct ImageDifference
+{
+    bool same_size;
+    long long channels_different;
+    int max_difference;
+    double fraction;
+};
+
+ImageDifference compare_images(const Image& a, const Image& b)
+{
+    ImageDifference difference = {a.width == b.width && a.height == b.height && a.channels == b.channels, 0, 0, 0};
+    if (!difference.same_size)
+    {
+        return difference;
+    }
+    for (int y = 0; y < a.height; y++)
+    {
+        const unsigned char* p = a.row(y);
+        const unsigned char* q = b.row(y);
+        for (int i = 0; i < a.width * a.channels; i++)
+        {
+            int d = abs(p[i] - q[i]);
+            difference.channels_different += d != 0;
+            difference.max_difference = max(difference.max_difference, d);
+        }
+    }
+    difference.fraction = a.empty() ? 0 : static_cast<double>(difference.channels_different) / (a.pixel_count() * a.channels);
+    return difference;
+}
+
+bool within_tolerance(const ImageDifference& difference, const VerifyTolerance& tolerance)
+{
+    return difference.same_size && difference.max_difference <= tolerance.max_difference
+        && (difference.channels_different == 0 || difference.fraction <= tolerance.max_fraction);
+}
+
+// One operation with its settings
+struct VerifyOp
+{
+    FilterOp op;
+    double amount;
+    double amount_y;
+};
+
+Image run_legacy_op(const VerifyOp& op, const Image& image, const Image& layer)
+/**
+ * Runs the original process for an operation
+ */
+{
+    vector<vector<Pixel>> pixels = to_pixels(image);
+    switch (op.op)
+    {
+        case OP_VIGNETTE: return to_image(process_01(pixels));
+        case OP_CLAREDON: return to_image(process_02(pixels, op.amount));
+        case OP_GREYSCALE: return to_image(process_03(pixels));
+        case OP_ROTATE_90: return to_image(process_04(pixels));
+        case OP_ROTATE: return to_image(process_05(pixels, static_cast<int>(op.amount)));
+        case OP_SCALE: return to_image(process_06(pixels, op.amount, op.amount_y));
+        case OP_BLACK_WHITE: return to_image(process_07(pixels));
+        case OP_LIGHTEN: return to_image(process_08(pixels, op.amount));
+        case OP_DARKEN: return to_image(process_09(pixels, op.amount));
+        case OP_BLACK_WHITE_RGB: return to_image(process_10(pixels));
+        case OP_LAYER: return to_image(process_11(pixels, to_pixels(layer), op.amount));
+        default: return Image();
+    }
+}
+
+Image run_image_op(const VerifyOp& op, const Image& image, const Image& layer)
+/**
+ * Runs the Image based version of an operation
+ */
+{
+    Image result = image;
+    switch (op.op)
+    {
+        case OP_VIGNETTE: vignette_in_place(result); break;
+        case OP_CLAREDON: claredon_in_place(result, op.amount); break;
+        case OP_GREYSCALE: greyscale_in_place(result); break;
+        case OP_ROTATE_90: rotate_90_into(image, result); break;
+        case OP_ROTATE: rotate_into(image, result, static_cast<int>(op.amount)); break;
+        case OP_SCALE: scale_into(image, result, op.amount, op.amount_y); break;
+        case OP_BLACK_WHITE: black_white_in_place(result); break;
+        case OP_LIGHTEN: lighten_in_place(result, op.amount); break;
+        case OP_DARKEN: darken_in_place(result, op.amount); break;
+        case OP_BLACK_WHITE_RGB: black_white_rgb_in_place(result); break;
+        case OP_LAYER: layer_into(image, layer, op.amount, result); break;
+        default: break;
+    }
+    return result;
+}
+
+void add_verify_op(FilterPipeline& pipeline, const VerifyOp& op, const Image& layer)
+{
+    if (op.op == OP_LAYER)
+    {
+        pipeline.add_layer(layer, op.amount);
+    } else
+    {
+        pipeline.add(op.op, op.amount, op.amount_y);
+    }
+}
+
+// Counts and reports the checks of a verification run
+struct VerifyReport
+{
+    int passed;
+    int failed;
+    bool verbose;       // Also list the checks that pass
+    ostream& out;       // Where results go, cout is silenced while checking
+
+    explicit VerifyReport(ostream& stream) : passed(0), failed(0), verbose(false), out(stream) {}
+
+    void check(const string& name, const ImageDifference& difference, const VerifyTolerance& tolerance = VERIFY_EXACT)
+    {
+        bool ok = within_tolerance(difference, tolerance);
+        (ok ? passed : failed)++;
+        if (ok && !verbose)
+        {
+            return;
+        }
+        out << (ok ? "PASS " : "FAIL ") << name;
+        if (!difference.same_size)
+        {
+            out << ": different size";
+        } else if (difference.channels_different > 0)
+        {
+            out << ": " << difference.channels_different << " channels differ (" << difference.fraction * 100
+            << "%), by up to " << difference.max_difference;
+        }
+        out << '\n';
+    }
+    void missing(const string& name, const string& path)
+    {
+        failed++;
+        out << "FAIL " << name << ": unable to read " << path << '\n';
+    }
+};
+
+void verify_goldens(const string& root, VerifyReport& report)
+/**
+ * Compares the original and Image based filters with the stored images
+ * @param root   Directory holding output/ and sample_images/
+ * @param report Receives the results
+ */
+{
+    struct GoldenCase
+    {
+        VerifyOp op;
+        const char* golden;
+        const char* layer;
+        VerifyTolerance tolerance;
+    };
+    // Settings found by matching the stored images
+    const VerifyTolerance near_threshold = {255, 0.01};
+    const VerifyTolerance truncated = {1, 1};
+    const GoldenCase cases[] = {
+        {{OP_VIGNETTE, 0, 0}, "output/process_01.bmp", NULL, VERIFY_EXACT},
+        {{OP_CLAREDON, .3, 0}, "output/process_02.bmp", NULL, VERIFY_EXACT},
+        {{OP_GREYSCALE, 0, 0}, "output/process_03.bmp", NULL, VERIFY_EXACT},
+        {{OP_ROTATE_90, 0, 0}, "output/process_04.bmp", NULL, VERIFY_EXACT},
+        {{OP_ROTATE, 2, 0}, "output/process_05.bmp", NULL, VERIFY_EXACT},
+        {{OP_SCALE, 2, 3}, "output/process_06.bmp", NULL, VERIFY_EXACT},
+        {{OP_BLACK_WHITE, 0, 0}, "output/process_07.bmp", NULL, VERIFY_EXACT},
+        {{OP_LIGHTEN, .2, 0}, "output/process_08.bmp", NULL, VERIFY_EXACT},
+        {{OP_DARKEN, .1, 0}, "output/process_09.bmp", NULL, VERIFY_EXACT},
+        {{OP_BLACK_WHITE_RGB, 0, 0}, "output/process_10.bmp", NULL, VERIFY_EXACT},
+        {{OP_LAYER, .5, 0}, "output/process_11.bmp", "output/process_10.bmp", VERIFY_EXACT},
+        // image_process.py truncates where the processes round, and its
+        // vignette, Claredon and scale use other formulas, so they are left out
+        {{OP_GREYSCALE, 0, 0}, "sample_images/process3.bmp", NULL, VERIFY_EXACT},
+        {{OP_ROTATE_90, 0, 0}, "sample_images/process4.bmp", NULL, VERIFY_EXACT},
+        {{OP_ROTATE, 2, 0}, "sample_images/process5.bmp", NULL, VERIFY_EXACT},
+        {{OP_BLACK_WHITE, 0, 0}, "sample_images/process7.bmp", NULL, near_threshold},
+        {{OP_LIGHTEN, .5, 0}, "sample_images/process8.bmp", NULL, truncated},
+        {{OP_DARKEN, .5, 0}, "sample_images/process9.bmp", NULL, truncated},
+        {{OP_BLACK_WHITE_RGB, 0, 0}, "sample_images/process10.bmp", NULL, near_threshold}
+    };
+
+    string input_path = root + "/sample_images/sample.bmp";
+    Image input = read_bmp(input_path);
+    if (input.empty())
+    {
+        report.missing("golden input", input_path);
+        return;
+    }
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const GoldenCase& golden_case = cases[c];
+        string golden_path = root + "/" + golden_case.golden;
+        Image golden = read_bmp(golden_path);
+        Image layer;
+        if (golden_case.layer != NULL)
+        {
+            layer = read_bmp(root + "/" + golden_case.layer);
+        }
+        if (golden.empty() || (golden_case.layer != NULL && layer.empty()))
+        {
+            report.missing(golden_case.golden, golden.empty() ? golden_path : root + "/" + golden_case.layer);
+            continue;
+        }
+        report.check(string(golden_case.golden) + " legacy",
+                     compare_images(run_legacy_op(golden_case.op, input, layer), golden), golden_case.tolerance);
+        report.check(string(golden_case.golden) + " image",
+                     compare_images(run_image_op(golden_case.op, input, layer), golden), golden_case.tolerance);
+    }
+}
+
+void verify_fast_paths(const string& root, VerifyReport& report)
+/**
+ * Compares every fast path with the original process, which must match
+ * exactly, on the sample image and on synthetic images of awkward sizes
+ * @param root   Directory holding sample_images/
+ * @param report Receives the results
+ */
+{
+    vector<pair<string, Image> > inputs;
+    Image sample = read_bmp(root + "/sample_images/sample.bmp");
+    if (!sample.empty())
+    {
+        inputs.push_back(make_pair(string("sample"), sample));
+    }
+    // The vignette of process_01 divides by zero on a side of one pixel
+    const int sizes[][2] = {{2, 2}, {17, 5}, {333, 77}, {64, 129}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%dx%d", sizes[i][0], sizes[i][1]);
+        inputs.push_back(make_pair(string(name), synthetic_image(sizes[i][0], sizes[i][1], static_cast<unsigned int>(i + 3))));
+    }
+
+    // Scaling factors include ones the fixed point kernels cannot use
+    const VerifyOp ops[] = {
+        {OP_VIGNETTE, 0, 0}, {OP_CLAREDON, .3, 0}, {OP_CLAREDON, .77, 0}, {OP_GREYSCALE, 0, 0},
+        {OP_ROTATE_90, 0, 0}, {OP_ROTATE, -1, 0}, {OP_ROTATE, 2, 0}, {OP_ROTATE, 7, 0},
+        {OP_SCALE, 2, 3}, {OP_SCALE, .37f, 1.3f}, {OP_BLACK_WHITE, 0, 0}, {OP_LIGHTEN, .5, 0},
+        {OP_LIGHTEN, .123, 0}, {OP_DARKEN, .5, 0}, {OP_DARKEN, .91, 0}, {OP_BLACK_WHITE_RGB, 0, 0},
+        {OP_LAYER, .5, 0}
+    };
+    const char* simd_names[] = {"scalar", "sse2", "avx2"};
+    SimdLevel best_simd = detect_simd_level();
+    string stream_path = "verify_stream.tmp.bmp";
+    string stream_output = "verify_stream_out.tmp.bmp";
+
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        const Image& input = inputs[i].second;
+        Image layer = synthetic_image(max(input.width / 2, 1), max(input.height * 2 / 3, 1), 99);
+        write_bmp(stream_path, input);
+        for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++)
+        {
+            const VerifyOp& op = ops[o];
+            char label[96];
+            snprintf(label, sizeof(label), "%s op %d (%g, %g) ", inputs[i].first.c_str(), static_cast<int>(op.op), op.amount, op.amount_y);
+            Image expected = run_legacy_op(op, input, layer);
+            if (expected.empty())
             {
-                rgb.red = 255;
-                rgb.green = 255;
-                rgb.blue = 255;
-            } else 
+                // process_06 gives nothing when a side rounds to zero, scale_into keeps a pixel
+                continue;
+            }
+
+            // Every SIMD level, on one thread and on the pool
+            for (int level = SIMD_NONE; level <= best_simd; level++)
             {
-                rgb.red = 0;
-                rgb.green = 0;
-                rgb.blue = 0;
+                set_simd_level(static_cast<SimdLevel>(level));
+                for (int threads = 1; threads >= 0; threads--)
+                {
+                    set_thread_count(threads);
+                    report.check(string(label) + simd_names[level] + (threads == 1 ? " 1 thread" : " threaded"),
+                                 compare_images(run_image_op(op, input, layer), expected));
+                }
+            }
+            set_simd_level(best_simd);
+
+            FilterPipeline pipeline;
+            add_verify_op(pipeline, op, layer);
+            Image piped = input;
+            pipeline.run(piped);
+            report.check(string(label) + "pipeline", compare_images(piped, expected));
+
+            if (op.op == OP_LIGHTEN || op.op == OP_DARKEN)
+            {
+                Image curved = input;
+                curve_in_place(curved, *get_tone_curve(op.op == OP_LIGHTEN ? CURVE_LIGHTEN : CURVE_DARKEN, op.amount));
+                report.check(string(label) + "lookup table", compare_images(curved, expected));
+            }
+            if (op.op != OP_SCALE && op.op != OP_LAYER)
+            {
+                // A tiny memory limit makes every band a few rows
+                bool streamed = stream_pipeline_bmp(stream_path, stream_output, pipeline, 4096);
+                Image result = streamed ? read_bmp(stream_output) : Image();
+                report.check(string(label) + "stream", compare_images(result, expected));
+            }
+        }
+
+        // One fused pass against the processes run one after another
+        FilterPipeline chain;
+        chain.add(OP_GREYSCALE).add(OP_VIGNETTE).add(OP_CLAREDON, .4).add(OP_ROTATE, 1).add(OP_LIGHTEN, .6).add(OP_DARKEN, .77);
+        vector<vector<Pixel>> pixels = process_09(process_08(process_05(process_02(process_01(process_03(to_pixels(input))), .4), 1), .6), .77);
+        Image chained = input;
+        chain.run(chained);
+        report.check(inputs[i].first + " fused chain", compare_images(chained, to_image(pixels)));
+        FilterPipeline contrast_chain;
+        contrast_chain.add(OP_DARKEN, .5).add(OP_BLACK_WHITE_RGB).add(OP_VIGNETTE).add(OP_BLACK_WHITE);
+        pixels = process_07(process_01(process_10(process_09(to_pixels(input), .5))));
+        chained = input;
+        contrast_chain.run(chained);
+        report.check(inputs[i].first + " fused contrast chain", compare_images(chained, to_image(pixels)));
+
+        // A larger top image, cropped by an odd number of pixels
+        Image big = synthetic_image(input.width + 3, input.height + 5, 17);
+        Image big_layered;
+        layer_into(input, big, .4, big_layered);
+        report.check(inputs[i].first + " larger layer",
+                     compare_images(big_layered, to_image(process_11(to_pixels(input), to_pixels(big), .4))));
+
+        // Top images placed anywhere, against blending pixel by pixel
+        const int places[][2] = {{-3, -2}, {input.width / 3, input.height / 4}, {input.width - 2, input.height - 1}};
+        for (size_t p = 0; p < sizeof(places) / sizeof(places[0]); p++)
+        {
+            int x = places[p][0];
+            int y = places[p][1];
+            Image expected = input;
+            for (int ly = 0; ly < layer.height; ly++)
+            {
+                for (int lx = 0; lx < layer.width; lx++)
+                {
+                    if (y + ly < 0 || y + ly >= input.height || x + lx < 0 || x + lx >= input.width)
+                    {
+                        continue;
+                    }
+                    Pixel bottom = expected.get_pixel(y + ly, x + lx);
+                    Pixel top = layer.get_pixel(ly, lx);
+                    bottom.red = bottom.red * .4 + top.red * (1 - .4);
+                    bottom.green = bottom.green * .4 + top.green * (1 - .4);
+                    bottom.blue = bottom.blue * .4 + top.blue * (1 - .4);
+                    expected.set_pixel(y + ly, x + lx, bottom);
+                }
+            }
+            FilterPipeline placed;
+            placed.add_layer_at(layer, .4, x, y);
+            Image result = input;
+            placed.run(result);
+            char label[64];
+            snprintf(label, sizeof(label), " layer at %d, %d", x, y);
+            report.check(inputs[i].first + label, compare_images(result, expected));
+        }
+    }
+    remove(stream_path.c_str());
+    remove(stream_output.c_str());
+    set_thread_count(0);
+}
+
+string file_contents(const string& path)
+/**
+ * Reads a whole file, empty if it cannot be read
+ */
+{
+    ifstream file(path.c_str(), ios::binary);
+    return string((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+}
+
+ImageDifference compare_bytes(const string& actual, const string& expected)
+/**
+ * Compares the contents of two files byte by byte
+ */
+{
+    long long different = 0;
+    for (size_t b = 0; b < min(actual.size(), expected.size()); b++)
+    {
+        different += actual[b] != expected[b];
+    }
+    ImageDifference difference = {actual.size() == expected.size(), different, different ? 255 : 0,
+                                  expected.empty() ? 0.0 : static_cast<double>(different) / expected.size()};
+    return difference;
+}
+
+ImageDifference compare_pixels(const vector<vector<Pixel>>& a, const vector<vector<Pixel>>& b)
+/**
+ * Compares two images of the original program, which may be empty
+ */
+{
+    bool same_size = a.size() == b.size() && (a.empty() || a[0].size() == b[0].size());
+    ImageDifference difference = compare_images(to_image(a), to_image(b));
+    difference.same_size = difference.same_size && same_size;
+    return difference;
+}
+
+void verify_bmp_io(const string& root, VerifyReport& report)
+/**
+ * Checks that read_image_fast() reads every stored image exactly like
+ * read_image(), and synthetic files whose rows need padding, and that
+ * write_image_fast() writes the same bytes as write_image()
+ * @param root   Directory holding output/ and sample_images/
+ * @param report Receives the results
+ */
+{
+    vector<string> files;
+    expand_input(root + "/sample_images", files);
+    expand_input(root + "/output", files);
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        report.check("read_image_fast " + files[i], compare_pixels(read_image_fast(files[i]), read_image(files[i])));
+    }
+
+    // Every padding from none to three bytes, with and without alpha
+    string path = "verify_bmp_io.tmp.bmp";
+    const int widths[] = {1, 2, 3, 4, 5, 17};
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++)
+    {
+        for (int channels = 3; channels <= 4; channels++)
+        {
+            Image colours = synthetic_image(widths[i], 7, static_cast<unsigned int>(i + 41));
+            Image image(widths[i], 7, channels);
+            for (int y = 0; y < image.height; y++)
+            {
+                for (int x = 0; x < image.width; x++)
+                {
+                    PixelRGBA rgba = {0, 0, 0, (x * 37 + y * 11) & 255};
+                    Pixel rgb = colours.get_pixel(y, x);
+                    rgba.red = rgb.red;
+                    rgba.green = rgb.green;
+                    rgba.blue = rgb.blue;
+                    image.set_rgba(y, x, rgba);
+                }
+            }
+            write_bmp(path, image);
+            char label[64];
+            snprintf(label, sizeof(label), "read_image_fast %dx7 %d bit", widths[i], channels * 8);
+            report.check(label, compare_pixels(read_image_fast(path), read_image(path)));
+        }
+
+        // Both ways of buffering write_image_fast() uses
+        vector<vector<Pixel>> pixels = to_pixels(synthetic_image(widths[i], 7, static_cast<unsigned int>(i + 51)));
+        write_image(path, pixels);
+        string expected = file_contents(path);
+        for (int whole_file = 0; whole_file < 2; whole_file++)
+        {
+            BmpWriteOptions options;
+            options.whole_file = whole_file == 1;
+            bool written = write_image_fast(path, pixels, options);
+            ImageDifference difference = compare_bytes(file_contents(path), expected);
+            difference.same_size = difference.same_size && written;
+            char label[64];
+            snprintf(label, sizeof(label), "write_image_fast %dx7 %s file", widths[i], whole_file ? "whole" : "per row");
+            report.check(label, difference);
+        }
+    }
+    remove(path.c_str());
+}
+
+void verify_planar(VerifyReport& report)
+/**
+ * Checks that splitting an image into planes and merging them back gives
+ * the same image, and that each plane holds its own channel
+ * @param report Receives the results
+ */
+{
+    const int sizes[][2] = {{1, 1}, {3, 2}, {17, 5}, {333, 77}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        Image image = synthetic_image(sizes[i][0], sizes[i][1], static_cast<unsigned int>(i + 61));
+        PlanarImage planar = to_planar(image);
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d planar ", image.width, image.height);
+        report.check(string(label) + "round trip", compare_images(to_interleaved(planar), image));
+
+        // Each plane as the grey of a single channel image
+        const int channels[] = {CHANNEL_BLUE, CHANNEL_GREEN, CHANNEL_RED};
+        const char* channel_names[] = {"blue", "green", "red"};
+        for (int c = 0; c < 3; c++)
+        {
+            Image plane(image.width, image.height, 1);
+            Image expected(image.width, image.height, 1);
+            for (int y = 0; y < image.height; y++)
+            {
+                memcpy(plane.row(y), planar.row(channels[c], y), image.width);
+                for (int x = 0; x < image.width; x++)
+                {
+                    expected.pixel(y, x)[0] = image.pixel(y, x)[channels[c]];
+                }
+            }
+            report.check(string(label) + channel_names[c] + " plane", compare_images(plane, expected));
+        }
+    }
+}
+
+void verify_menu_sequence(VerifyReport& report)
+/**
+ * Runs menu options one after another into one reused image, the way the
+ * menu does, and checks every saved file is byte for byte the file the
+ * same option gives on a new image
+ * @param report Receives the results
+ */
+{
+    // An odd width, so every row has padding for old bytes to be left in
+    Image input = synthetic_image(37, 23, 71);
+    Image layer = synthetic_image(11, 7, 72);
+    auto run_option = [&](int option, Image& process_image)
+    {
+        switch (option)
+        {
+            case 1: process_image = input; vignette_in_place(process_image); break;
+            case 2: process_image = input; claredon_in_place(process_image, .3); break;
+            case 3: process_image = input; greyscale_in_place(process_image); break;
+            case 4: rotate_90_into(input, process_image); break;
+            case 5: rotate_into(input, process_image, 3); break;
+            case 6: scale_into(input, process_image, 1.5, .7f); break;
+            case 7: process_image = input; black_white_in_place(process_image); break;
+            case 8: process_image = input; lighten_in_place(process_image, .4); break;
+            case 9: process_image = input; darken_in_place(process_image, .4); break;
+            case 10: process_image = input; black_white_rgb_in_place(process_image); break;
+            default: layer_into(input, layer, .5, process_image); break;
+        }
+    };
+    const int sequence[] = {1, 4, 2, 5, 6, 3, 4, 7, 11, 8, 5, 9, 10, 6, 1, 11};
+    string reused_path = "verify_menu_reused.tmp.bmp";
+    string fresh_path = "verify_menu_fresh.tmp.bmp";
+    Image process_image;
+    for (size_t i = 0; i < sizeof(sequence) / sizeof(sequence[0]); i++)
+    {
+        run_option(sequence[i], process_image);
+        Image fresh;
+        run_option(sequence[i], fresh);
+        bool written = write_bmp(reused_path, process_image) && write_bmp(fresh_path, fresh);
+        ImageDifference difference = compare_bytes(file_contents(reused_path), file_contents(fresh_path));
+        difference.same_size = difference.same_size && written;
+        char label[64];
+        snprintf(label, sizeof(label), "menu sequence step %d option %d file", static_cast<int>(i + 1), sequence[i]);
+        report.check(label, difference);
+    }
+    remove(reused_path.c_str());
+    remove(fresh_path.c_str());
+}
+
+void verify_alpha(VerifyReport& report)
+/**
+ * Checks that 32 bit files keep their alpha through reading, writing and
+ * streaming, that every SIMD level blends alpha like the scalar code, and
+ * that resampling leaves no halo of the colour of clear pixels
+ * @param report Receives the results
+ */
+{
+    // Clear red on the left, opaque blue on the right, no filter may tint the visible pixels red
+    Image halves(12, 5, 4);
+    for (int y = 0; y < halves.height; y++)
+    {
+        for (int x = 0; x < halves.width; x++)
+        {
+            PixelRGBA rgba = {x < 6 ? 255 : 0, 0, x < 6 ? 0 : 255, x < 6 ? 0 : 255};
+            halves.set_rgba(y, x, rgba);
+        }
+    }
+    const char* filter_names[] = {"nearest", "bilinear", "bicubic", "lanczos3", "area"};
+    for (int f = RESAMPLE_NEAREST; f <= RESAMPLE_AREA; f++)
+    {
+        for (int grow = 0; grow < 2; grow++)
+        {
+            Image resized;
+            resize_into(halves, resized, grow ? 37 : 7, grow ? 11 : 3, static_cast<ResampleFilter>(f));
+            int halo = 0;
+            for (int y = 0; y < resized.height; y++)
+            {
+                for (int x = 0; x < resized.width; x++)
+                {
+                    PixelRGBA rgba = resized.get_rgba(y, x);
+                    halo += rgba.alpha > 0 && (rgba.red != 0 || rgba.blue != 255);
+                }
+            }
+            ImageDifference difference = {true, halo, halo ? 255 : 0, static_cast<double>(halo) / resized.pixel_count()};
+            report.check(string("alpha halo ") + filter_names[f] + (grow ? " up" : " down"), difference);
+        }
+    }
+
+    const int sizes[][2] = {{1, 1}, {17, 5}, {333, 77}};
+    string path = "verify_alpha.tmp.bmp";
+    string stream_output = "verify_alpha_out.tmp.bmp";
+    SimdLevel best_simd = detect_simd_level();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int width = sizes[i][0];
+        int height = sizes[i][1];
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d alpha ", width, height);
+
+        // Colours from a test image, alpha from a gradient with clear and opaque ends
+        Image colours = synthetic_image(width, height, static_cast<unsigned int>(i + 11));
+        Image image(width, height, 4);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                PixelRGBA rgba = {0, 0, 0, min(255, (x * 7 + y * 3) % 300)};
+                Pixel rgb = colours.get_pixel(y, x);
+                rgba.red = rgb.red;
+                rgba.green = rgb.green;
+                rgba.blue = rgb.blue;
+                image.set_rgba(y, x, rgba);
+            }
+        }
+
+        write_bmp(path, image);
+        report.check(string(label) + "round trip", compare_images(read_bmp(path), image));
+        Image rotated;
+        rotate_into(image, rotated, 1);
+        FilterPipeline pipeline;
+        pipeline.add(OP_ROTATE, 1);
+        bool streamed = stream_pipeline_bmp(path, stream_output, pipeline, 4096);
+        report.check(string(label) + "stream", compare_images(streamed ? read_bmp(stream_output) : Image(), rotated));
+
+        // Alpha layer over an opaque image and over an image with alpha
+        Image layer = synthetic_image(max(width / 2, 1), height, 5);
+        for (int bottom = 0; bottom < 2; bottom++)
+        {
+            const Image& base = bottom == 0 ? colours : image;
+            const Image& top = bottom == 0 ? image : layer;
+            set_simd_level(SIMD_NONE);
+            Image expected;
+            layer_into(base, top, .3, expected);
+            for (int level = SIMD_SSE2; level <= best_simd; level++)
+            {
+                set_simd_level(static_cast<SimdLevel>(level));
+                Image layered;
+                layer_into(base, top, .3, layered);
+                report.check(string(label) + (bottom == 0 ? "layer " : "base ") + (level == SIMD_SSE2 ? "sse2" : "avx2"),
+                             compare_images(layered, expected));
+            }
+            set_simd_level(best_simd);
+        }
+    }
+    remove(path.c_str());
+    remove(stream_output.c_str());
+}
+
+void verify_resample(VerifyReport& report)
+/**
+ * Checks that shrinking by extreme ratios still averages the source, the
+ * fixed point weights of a tap that covers one pixel in thousands round to
+ * zero on their own
+ * @param report Receives the results
+ */
+{
+    const char* filter_names[] = {"nearest", "bilinear", "bicubic", "lanczos3", "area"};
+    const int lengths[] = {12000, 20000, 40000, 100000};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        for (int vertical = 0; vertical < 2; vertical++)
+        {
+            // A gradient from 0 to 255 along a row or a column, which averages to 127.5
+            int length = lengths[i];
+            Image gradient(vertical ? 1 : length, vertical ? length : 1, 3);
+            for (int p = 0; p < length; p++)
+            {
+                unsigned char grey = static_cast<unsigned char>(lround(p * 255.0 / (length - 1)));
+                memset(gradient.pixel(vertical ? p : 0, vertical ? 0 : p), grey, 3);
+            }
+            Image average(1, 1, 3);
+            memset(average.pixel(0, 0), 128, 3);
+            const VerifyTolerance rounding = {1, 1};
+            for (int f = RESAMPLE_BILINEAR; f <= RESAMPLE_AREA; f++)
+            {
+                Image resized;
+                resize_into(gradient, resized, 1, 1, static_cast<ResampleFilter>(f));
+                char label[64];
+                snprintf(label, sizeof(label), "resample %s %d %s to 1", filter_names[f], length, vertical ? "rows" : "columns");
+                report.check(label, compare_images(resized, average), rounding);
+            }
+        }
+    }
+}
+
+void verify_composite(VerifyReport& report)
+/**
+ * Checks that compositing several layers in one pass matches laying them
+ * one at a time, every blend mode against a pixel by pixel blend, and
+ * offsets at the limits of int
+ * @param report Receives the results
+ */
+{
+    // Layers placed as far as an int goes miss the image and change nothing
+    Image bottom = synthetic_image(9, 7, 81);
+    Image top = synthetic_image(5, 4, 82);
+    const int far[] = {2147483647, -2147483647 - 1, 2147483647 - 3, -2147483647 + 3};
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            Image result = bottom;
+            vector<CompositeLayer> layers;
+            CompositeLayer layer = {&top, .5, far[i], j == 0 ? 1 : far[j], BLEND_NORMAL};
+            layers.push_back(layer);
+            composite_in_place(result, layers);
+            char label[64];
+            snprintf(label, sizeof(label), "composite offset %d,%d", layer.x, layer.y);
+            report.check(label, compare_images(result, bottom));
+        }
+    }
+
+    const int sizes[][2] = {{3, 2}, {300, 41}, {701, 129}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int width = sizes[i][0];
+        int height = sizes[i][1];
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d composite ", width, height);
+        Image base = synthetic_image(width, height, static_cast<unsigned int>(i + 21));
+        Image first = synthetic_image(width / 2 + 1, height / 2 + 1, 3);
+        Image second = synthetic_image(width + 5, height / 3 + 1, 4);
+
+        // Normal layers, over and off the edges, against one layer_in_place() each
+        CompositeLayer normal[] = {{&first, .3, width / 3, height / 4, BLEND_NORMAL},
+                                   {&second, .6, -3, height / 2, BLEND_NORMAL},
+                                   {&first, 0, -width / 3, -height / 3, BLEND_NORMAL}};
+        Image expected = base;
+        for (size_t l = 0; l < 3; l++)
+        {
+            layer_in_place(expected, *normal[l].image, normal[l].scaling, normal[l].x, normal[l].y);
+        }
+        for (int threads = 1; threads >= 0; threads--)
+        {
+            set_thread_count(threads);
+            Image composited = base;
+            composite_in_place(composited, vector<CompositeLayer>(normal, normal + 3));
+            report.check(string(label) + "normal" + (threads == 1 ? " 1 thread" : " threaded"), compare_images(composited, expected));
+        }
+
+        // Each mode over the whole image
+        for (int mode = BLEND_MULTIPLY; mode <= BLEND_DIFFERENCE; mode++)
+        {
+            CompositeLayer layer = {&second, .25, -2, 0, static_cast<BlendMode>(mode)};
+            int opacity = static_cast<int>(round(.75 * 255));
+            Image blended = base;
+            for (int y = 0; y < min(height, second.height); y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    unsigned char* bottom = blended.pixel(y, x);
+                    const unsigned char* top = second.pixel(y, x + 2);
+                    for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+                    {
+                        int value = blend_channel(layer.mode, bottom[c], top[c]);
+                        bottom[c] = div255(bottom[c] * (255 - opacity) + opacity * value);
+                    }
+                }
+            }
+            Image composited = base;
+            composite_in_place(composited, vector<CompositeLayer>(1, layer));
+            snprintf(label, sizeof(label), "%dx%d composite mode %d", width, height, mode);
+            report.check(label, compare_images(composited, blended));
+        }
+    }
+    set_thread_count(0);
+}
+
+void verify_greyscale(VerifyReport& report)
+/**
+ * Checks every greyscale mode on every SIMD level against the scalar
+ * formula, the luma against the exact weights, and 8 bit grey files
+ * @param report Receives the results
+ */
+{
+    const int sizes[][2] = {{1, 1}, {23, 7}, {517, 61}};
+    const char* mode_names[] = {"average", "rec601", "rec709"};
+    const char* simd_names[] = {"scalar", "sse2", "avx2"};
+    const double exact[3][3] = {{1 / 3., 1 / 3., 1 / 3.}, {.114, .587, .299}, {.0722, .7152, .2126}};
+    const VerifyTolerance rounding = {1, 1};
+    string path = "verify_grey.tmp.bmp";
+    string stream_output = "verify_grey_out.tmp.bmp";
+    SimdLevel best_simd = detect_simd_level();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int width = sizes[i][0];
+        int height = sizes[i][1];
+        Image colours = synthetic_image(width, height, static_cast<unsigned int>(i + 31));
+        for (int m = GREY_AVERAGE; m <= GREY_REC709; m++)
+        {
+            GreyMode mode = static_cast<GreyMode>(m);
+            char label[64];
+            snprintf(label, sizeof(label), "%dx%d greyscale %s ", width, height, mode_names[m]);
+
+            // The formula one pixel at a time, and with the exact weights
+            Image expected = colours;
+            Image weighted = colours;
+            Image single(width, height, 1);
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    Pixel rgb = colours.get_pixel(y, x);
+                    int grey = grey_value(mode, rgb.red, rgb.green, rgb.blue);
+                    int exact_grey = static_cast<int>(round(exact[m][0] * rgb.blue + exact[m][1] * rgb.green + exact[m][2] * rgb.red));
+                    if (mode == GREY_AVERAGE)
+                    {
+                        exact_grey = (rgb.red + rgb.green + rgb.blue)/3;
+                    }
+                    Pixel grey_rgb = {grey, grey, grey};
+                    Pixel exact_rgb = {exact_grey, exact_grey, exact_grey};
+                    expected.set_pixel(y, x, grey_rgb);
+                    weighted.set_pixel(y, x, exact_rgb);
+                    *single.pixel(y, x) = static_cast<unsigned char>(grey);
+                }
+            }
+            report.check(string(label) + "weights", compare_images(expected, weighted), rounding);
+
+            for (int level = SIMD_NONE; level <= best_simd; level++)
+            {
+                set_simd_level(static_cast<SimdLevel>(level));
+                Image greyed = colours;
+                greyscale_in_place(greyed, mode);
+                report.check(string(label) + simd_names[level], compare_images(greyed, expected));
+                Image dropped;
+                greyscale_into(colours, dropped, mode);
+                report.check(string(label) + simd_names[level] + " single", compare_images(dropped, single));
+            }
+            set_simd_level(best_simd);
+
+            FilterPipeline pipeline;
+            pipeline.add_greyscale(mode);
+            Image piped = colours;
+            pipeline.run(piped);
+            report.check(string(label) + "pipeline", compare_images(piped, expected));
+            FilterPipeline single_pipeline;
+            single_pipeline.add_greyscale(mode, true);
+            piped = colours;
+            single_pipeline.run(piped);
+            report.check(string(label) + "pipeline single", compare_images(piped, single));
+        }
+
+        // 8 bit files read back as three equal channels, whole and streamed
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d grey file ", width, height);
+        Image single;
+        greyscale_into(colours, single, GREY_REC709);
+        Image expanded = colours;
+        greyscale_in_place(expanded, GREY_REC709);
+        write_bmp(path, single);
+        report.check(string(label) + "round trip", compare_images(read_bmp(path), expanded));
+        FilterPipeline none;
+        bool streamed = stream_pipeline_bmp(path, stream_output, none, 4096);
+        report.check(string(label) + "stream", compare_images(streamed ? read_bmp(stream_output) : Image(), expanded));
+    }
+    remove(path.c_str());
+    remove(stream_output.c_str());
+}
+
+void verify_threshold(VerifyReport& report)
+/**
+ * Checks the black and white kernels on every SIMD level with colours
+ * chosen to tie and to sit on the thresholds, and posterize
+ * @param report Receives the results
+ */
+{
+    const char* simd_names[] = {"scalar", "sse2", "avx2"};
+    SimdLevel best_simd = detect_simd_level();
+
+    // Every mix of values around the limits of process_07 and process_10
+    const int values[] = {0, 49, 50, 51, 126, 127, 128, 149, 150, 151, 183, 184, 185, 255};
+    const int count = sizeof(values) / sizeof(values[0]);
+    Image colours(count * count, count);
+    for (int y = 0; y < count; y++)
+    {
+        for (int x = 0; x < count * count; x++)
+        {
+            Pixel rgb = {values[y], values[x / count], values[x % count]};
+            colours.set_pixel(y, x, rgb);
+        }
+    }
+
+    Image legacy = to_image(process_10(to_pixels(colours)));
+    for (int level = SIMD_NONE; level <= best_simd; level++)
+    {
+        set_simd_level(static_cast<SimdLevel>(level));
+        Image result = colours;
+        black_white_rgb_in_place(result);
+        report.check(string("ties bwrgb ") + simd_names[level], compare_images(result, legacy));
+    }
+
+    const int thresholds[] = {0, 1, 50, 127, 128, 200, 255};
+    for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++)
+    {
+        Image expected = colours;
+        for (int y = 0; y < expected.height; y++)
+        {
+            for (int x = 0; x < expected.width; x++)
+            {
+                Pixel rgb = expected.get_pixel(y, x);
+                int value = (rgb.red + rgb.green + rgb.blue)/3 >= thresholds[t] ? 255 : 0;
+                Pixel bw = {value, value, value};
+                expected.set_pixel(y, x, bw);
+            }
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "threshold %d ", thresholds[t]);
+        for (int level = SIMD_NONE; level <= best_simd; level++)
+        {
+            set_simd_level(static_cast<SimdLevel>(level));
+            Image result = colours;
+            black_white_in_place(result, thresholds[t]);
+            report.check(string(label) + simd_names[level], compare_images(result, expected));
+        }
+        FilterPipeline pipeline;
+        pipeline.add_black_white(thresholds[t]);
+        Image piped = colours;
+        pipeline.run(piped);
+        report.check(string(label) + "pipeline", compare_images(piped, expected));
+    }
+    set_simd_level(best_simd);
+
+    // Posterizing keeps only the given number of values, evenly spread
+    const int levels[] = {2, 3, 4, 16, 256};
+    Image ramp(256, 1);
+    for (int x = 0; x < 256; x++)
+    {
+        Pixel rgb = {x, x, x};
+        ramp.set_pixel(0, x, rgb);
+    }
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+    {
+        Image expected = ramp;
+        for (int x = 0; x < 256; x++)
+        {
+            int step = static_cast<int>(round(x * (levels[l] - 1) / 255.0));
+            int value = static_cast<int>(round(step * 255.0 / (levels[l] - 1)));
+            Pixel rgb = {value, value, value};
+            expected.set_pixel(0, x, rgb);
+        }
+        Image result = ramp;
+        posterize_in_place(result, levels[l]);
+        char label[64];
+        snprintf(label, sizeof(label), "posterize %d", levels[l]);
+        report.check(label, compare_images(result, expected));
+    }
+}
+
+void verify_stats(VerifyReport& report)
+/**
+ * Checks the histograms against a count on one thread, the statistics
+ * of a known image, and that the adaptive contrast filters give the same
+ * result threaded and on one thread
+ * @param report Receives the results
+ */
+{
+    const int sizes[][2] = {{1, 1}, {37, 11}, {640, 203}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int width = sizes[i][0];
+        int height = sizes[i][1];
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d stats ", width, height);
+        Image image = synthetic_image(width, height, static_cast<unsigned int>(i + 41));
+
+        ImageStats counted;
+        memset(&counted, 0, sizeof(counted));
+        for (int y = 0; y < height; y++)
+        {
+            count_row(image.row(y), width, image.channels, GREY_REC709, counted.histogram);
+        }
+        ImageStats stats = image_stats(image);
+        bool same = stats.pixels == static_cast<long long>(image.pixel_count())
+                 && memcmp(stats.histogram, counted.histogram, sizeof(counted.histogram)) == 0;
+        ImageDifference difference = {true, same ? 0 : 1, same ? 0 : 1, same ? 0.0 : 1.0};
+        report.check(string(label) + "histograms", difference);
+
+        // Each filter threaded against one thread
+        for (int op = OP_AUTO_LEVELS; op <= OP_CLAHE; op++)
+        {
+            Image results[2];
+            for (int threads = 1; threads >= 0; threads--)
+            {
+                set_thread_count(threads);
+                FilterPipeline pipeline;
+                if (op == OP_AUTO_LEVELS)
+                {
+                    pipeline.add_auto_levels(1, true);
+                } else
+                {
+                    pipeline.add(static_cast<FilterOp>(op), CLAHE_CLIP_LIMIT, 3);
+                }
+                results[threads] = image;
+                pipeline.run(results[threads]);
             }
-            image_file[y][x] = rgb;
+            snprintf(label, sizeof(label), "%dx%d op %d threaded", width, height, op);
+            report.check(label, compare_images(results[0], results[1]));
+        }
+        set_thread_count(0);
+
+        // One tile with no limit is plain equalization
+        Image equalized = image;
+        equalize_in_place(equalized);
+        Image clahe = image;
+        clahe_in_place(clahe, 0, 1);
+        snprintf(label, sizeof(label), "%dx%d clahe one tile", width, height);
+        report.check(label, compare_images(clahe, equalized));
+    }
 
+    // A ramp from 40 to 199 in each channel, 10 pixels of each value
+    Image ramp(160, 10);
+    for (int y = 0; y < ramp.height; y++)
+    {
+        for (int x = 0; x < ramp.width; x++)
+        {
+            Pixel rgb = {40 + x, 40 + x, 40 + x};
+            ramp.set_pixel(y, x, rgb);
         }
     }
-    cout << "Executed Process 07: B&W" << endl;
-    return image_file;
+    // Lowest, highest, mean rounded down, 25th and 75th percentiles
+    ImageStats stats = image_stats(ramp);
+    const int wanted[] = {40, 199, 119, 79, 159};
+    for (int c = CHANNEL_BLUE; c <= STATS_LUMA; c++)
+    {
+        int got[] = {stats.lowest(c), stats.highest(c), static_cast<int>(floor(stats.mean(c))),
+                     stats.percentile(c, 25), stats.percentile(c, 75)};
+        Image expected(5, 1, 1);
+        Image measured(5, 1, 1);
+        for (int k = 0; k < 5; k++)
+        {
+            *expected.pixel(0, k) = static_cast<unsigned char>(wanted[k]);
+            *measured.pixel(0, k) = static_cast<unsigned char>(got[k]);
+        }
+        report.check(string("ramp stats channel ") + static_cast<char>('0' + c), compare_images(measured, expected));
+    }
+
+    // Auto levels with no clipping stretches the ramp to the full range
+    Image stretched = ramp;
+    auto_levels_in_place(stretched, 0);
+    ImageStats after = image_stats(stretched);
+    Image ends(2, 1, 1);
+    Image full(2, 1, 1);
+    *ends.pixel(0, 0) = after.lowest(STATS_LUMA);
+    *ends.pixel(0, 1) = after.highest(STATS_LUMA);
+    *full.pixel(0, 0) = 0;
+    *full.pixel(0, 1) = 255;
+    report.check("auto levels range", compare_images(ends, full));
 }
 
-vector<vector<Pixel>> process_08 (vector<vector<Pixel>> image_file, double scaling)
+Image reference_convolution(const Image& image, const vector<short>& weights, int columns, int rows,
+                            BorderMode border, bool keep_alpha)
 /**
- * Lightens image by the scaling factor
- * @param image_file The image file to be editted
- * @param scaling Strength of the effect on the image
+ * Convolves one pixel at a time, looking up each neighbour through border_index()
+ * @param weights Fixed point weights, rows of columns, centred on the pixel
  */
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
+    Image result(image.width, image.height, image.channels);
+    for (int y = 0; y < image.height; y++)
     {
-        for (int x = 0; x < file_width; x++)
+        for (int x = 0; x < image.width; x++)
         {
-            Pixel rgb = image_file[y][x];
-
-            // Calculates lightened value with scaling factor
-            rgb.red = static_cast<int>(round(255-(255 - rgb.red)*scaling));
-            rgb.green = static_cast<int>(round(255-(255 - rgb.green)*scaling));
-            rgb.blue = static_cast<int>(round(255-(255 - rgb.blue)*scaling));
-
-            image_file[y][x] = rgb;
-
+            for (int c = 0; c < image.channels; c++)
+            {
+                if (keep_alpha && c == CHANNEL_ALPHA)
+                {
+                    result.pixel(y, x)[c] = image.pixel(y, x)[c];
+                    continue;
+                }
+                int sum = 0;
+                for (int ky = 0; ky < rows; ky++)
+                {
+                    for (int kx = 0; kx < columns; kx++)
+                    {
+                        int sy = border_index(y + ky - rows / 2, image.height, border);
+                        int sx = border_index(x + kx - columns / 2, image.width, border);
+                        if (sy >= 0 && sx >= 0)
+                        {
+                            sum += weights[ky * columns + kx] * image.pixel(sy, sx)[c];
+                        }
+                    }
+                }
+                result.pixel(y, x)[c] = convolve_round(sum);
+            }
         }
     }
-    cout << "Executed Process 08: Lightened by factor of " << scaling << endl;
-    return image_file;
+    return result;
 }
 
-vector<vector<Pixel>> process_09 (vector<vector<Pixel>> image_file, double scaling)
+Image reference_box_blur(const Image& image, int radius, BorderMode border, bool across)
 /**
- * Darkens image by the scaling factor
- * @param image_file The image file to be editted
- * @param scaling Strength of the effect on the image
+ * Averages a line of 2 * radius + 1 pixels, across or down, one pixel at a time
  */
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
+    Image result(image.width, image.height, image.channels);
+    unsigned int window = 2 * radius + 1;
+    unsigned int multiplier = static_cast<unsigned int>(round(static_cast<double>(1 << 23) / window));
+    for (int y = 0; y < image.height; y++)
     {
-        for (int x = 0; x < file_width; x++)
+        for (int x = 0; x < image.width; x++)
         {
-            Pixel rgb = image_file[y][x];
-
-            // Calculates darkened value with scaling factor
-            rgb.red = static_cast<int>(round(rgb.red*scaling));
-            rgb.green = static_cast<int>(round(rgb.green*scaling));
-            rgb.blue = static_cast<int>(round(rgb.blue*scaling));
-
-            image_file[y][x] = rgb;
-
+            for (int c = 0; c < image.channels; c++)
+            {
+                unsigned int sum = 0;
+                for (int k = -radius; k <= radius; k++)
+                {
+                    int sy = across ? y : border_index(y + k, image.height, border);
+                    int sx = across ? border_index(x + k, image.width, border) : x;
+                    sum += sx >= 0 && sy >= 0 ? image.pixel(sy, sx)[c] : 0;
+                }
+                result.pixel(y, x)[c] = box_average(sum, multiplier);
+            }
         }
     }
-    cout << "Executed Process 09: Darken by factor of " << scaling << endl;
-    return image_file;
+    return result;
 }
 
-vector<vector<Pixel>> process_10 (vector<vector<Pixel>> image_file)
+void verify_convolution(VerifyReport& report)
 /**
- * Extreme contrast, extreme satruation
- * Black, white, RGB
- * @param image_file The image file to be editted
+ * Checks the blurs, kernels and edges on every SIMD level and border
+ * mode against a convolution one pixel at a time, threaded against
+ * one thread, that flat images and the identity kernel stay the same,
+ * and that invisible pixels add no colour
+ * @param report Receives the results
  */
 {
-    // Get the size of the image
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-
-    // Loops through the pixels in image
-    for (int y = 0; y < file_height; y++)
+    // Clear red on the left, opaque blue on the right, blurred red must not reach any pixel that can be seen
+    Image halves(40, 9, 4);
+    for (int y = 0; y < halves.height; y++)
     {
-        for (int x = 0; x < file_width; x++)
+        for (int x = 0; x < halves.width; x++)
         {
-            Pixel rgb = image_file[y][x];
+            PixelRGBA rgba = {x < 20 ? 255 : 0, 0, x < 20 ? 0 : 255, x < 20 ? 0 : 255};
+            halves.set_rgba(y, x, rgba);
+        }
+    }
+    Image blurred;
+    const char* blur_names[] = {"gaussian", "box", "sharpen"};
+    for (int f = 0; f < 3; f++)
+    {
+        if (f == 0)
+        {
+            gaussian_blur_into(halves, blurred, 2);
+        } else if (f == 1)
+        {
+            box_blur_into(halves, blurred, 3);
+        } else
+        {
+            convolve_into(halves, blurred, sharpen_kernel(1));
+        }
+        int bled = 0;
+        for (int y = 0; y < blurred.height; y++)
+        {
+            for (int x = 0; x < blurred.width; x++)
+            {
+                PixelRGBA rgba = blurred.get_rgba(y, x);
+                bled += rgba.alpha > 0 && (rgba.red != 0 || rgba.blue != 255);
+            }
+        }
+        ImageDifference difference = {true, bled, bled ? 255 : 0, static_cast<double>(bled) / blurred.pixel_count()};
+        report.check(string("transparent colour ") + blur_names[f], difference);
+    }
 
-            // Calculates max values and combined values
-            vector <int> pixel_vector = {rgb.red, rgb.green, rgb.blue};
-            int max_color = distance(pixel_vector.begin(), 
-                                    max_element(pixel_vector.begin(), pixel_vector.end()));
-            int add_color = rgb.red + rgb.green + rgb.blue;
+    const int sizes[][2] = {{1, 1}, {2, 3}, {37, 11}, {203, 70}};
+    const char* border_names[] = {"clamp", "mirror", "wrap", "zero"};
+    const char* simd_names[] = {"scalar", "sse2", "avx2"};
+    SimdLevel best_simd = detect_simd_level();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int width = sizes[i][0];
+        int height = sizes[i][1];
+        Image colours = synthetic_image(width, height, static_cast<unsigned int>(i + 51));
 
-            // Sets B*W values for highest contrast areas 
-            if (add_color >= 550)
+        // Alpha from the red of another image, so kernels must leave it alone
+        Image alpha = synthetic_image(width, height, static_cast<unsigned int>(i + 52));
+        Image translucent(width, height, 4);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
             {
-                rgb.red = 255;
-                rgb.green = 255;
-                rgb.blue = 255;
-            } else if (add_color <= 150)
+                memcpy(translucent.pixel(y, x), colours.pixel(y, x), 3);
+                translucent.pixel(y, x)[CHANNEL_ALPHA] = alpha.pixel(y, x)[CHANNEL_RED];
+            }
+        }
+
+        for (int b = BORDER_CLAMP; b <= BORDER_ZERO; b++)
+        {
+            BorderMode border = static_cast<BorderMode>(b);
+            for (int with_alpha = 0; with_alpha <= 1; with_alpha++)
             {
-                rgb.red = 0;
-                rgb.green = 0;
-                rgb.blue = 0;                
-            } else {
-                // Sets RGB values for medium areas
-                switch (max_color) {
-                    case 0:
-                        rgb.red = 255;
-                        rgb.green = 0;
-                        rgb.blue = 0;
-                        break;  
-                    case 1:
-                        rgb.red = 0;
-                        rgb.green = 255;
-                        rgb.blue = 0;
-                        break;    
-                    case 2:
-                        rgb.red = 0;
-                        rgb.green = 0;
-                        rgb.blue = 255;  
-                        break;  
+                const Image& image = with_alpha ? translucent : colours;
+                char label[96];
+                snprintf(label, sizeof(label), "%dx%d %s %d channels ", width, height, border_names[b], image.channels);
+
+                // Images with alpha are filtered premultiplied and turned back afterwards
+                Image source = image;
+                if (with_alpha)
+                {
+                    premultiply_into(image, source);
                 }
-            }
 
-            image_file[y][x] = rgb;
+                // The same taps gaussian_blur_into() makes for sigma 1.5
+                vector<double> taps;
+                double total = 0;
+                for (int k = -5; k <= 5; k++)
+                {
+                    taps.push_back(exp(-k * k / 4.5));
+                    total += taps.back();
+                }
+                for (size_t k = 0; k < taps.size(); k++)
+                {
+                    taps[k] /= total;
+                }
+                vector<short> fixed = make_convolve_weights(taps, true).weights;
+                Image blur_expected = reference_convolution(reference_convolution(source, fixed, 11, 1, border, false),
+                                                            fixed, 1, 11, border, false);
+                Image box_expected = reference_box_blur(reference_box_blur(source, 4, border, true), 4, border, false);
+                ConvolutionKernel sharpen = sharpen_kernel(1);
+                ConvolutionKernel kernel = {5, vector<double>(25)};
+                for (int k = 0; k < 25; k++)
+                {
+                    kernel.weights[k] = (k % 7 - 3) / 4.0;
+                }
+                Image sharpen_expected = reference_convolution(source, make_convolve_weights(sharpen.weights, false).weights,
+                                                               3, 3, border, true);
+                Image kernel_expected = reference_convolution(source, make_convolve_weights(kernel.weights, false).weights,
+                                                              5, 5, border, true);
+
+                // Sobel from the two gradients, one pixel at a time
+                const short gx[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+                const short gy[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+                Image sobel_expected = source;
+                for (int y = 0; y < height; y++)
+                {
+                    for (int x = 0; x < width; x++)
+                    {
+                        for (int c = CHANNEL_BLUE; c <= CHANNEL_RED; c++)
+                        {
+                            int sums[2] = {0, 0};
+                            for (int k = 0; k < 9; k++)
+                            {
+                                int sy = border_index(y + k / 3 - 1, height, border);
+                                int sx = border_index(x + k % 3 - 1, width, border);
+                                int value = sy >= 0 && sx >= 0 ? source.pixel(sy, sx)[c] : 0;
+                                sums[0] += gx[k] * value;
+                                sums[1] += gy[k] * value;
+                            }
+                            double magnitude = sqrt(static_cast<double>(sums[0] * sums[0] + sums[1] * sums[1]));
+                            sobel_expected.pixel(y, x)[c] = static_cast<unsigned char>(min(255, static_cast<int>(magnitude)));
+                        }
+                    }
+                }
+                Image round_trip = source;
+                if (with_alpha)
+                {
+                    Image* expected[] = {&blur_expected, &box_expected, &sharpen_expected, &kernel_expected, &sobel_expected, &round_trip};
+                    for (size_t k = 0; k < sizeof(expected) / sizeof(expected[0]); k++)
+                    {
+                        unpremultiply_in_place(*expected[k]);
+                    }
+                }
+
+                for (int level = SIMD_NONE; level <= best_simd; level++)
+                {
+                    set_simd_level(static_cast<SimdLevel>(level));
+                    for (int threads = 1; threads >= 0; threads--)
+                    {
+                        set_thread_count(threads);
+                        string name = string(label) + simd_names[level] + (threads ? " 1 thread " : " threaded ");
+                        Image result;
+                        gaussian_blur_into(image, result, 1.5, border);
+                        report.check(name + "gaussian", compare_images(result, blur_expected));
+                        box_blur_into(image, result, 4, border);
+                        report.check(name + "box", compare_images(result, box_expected));
+                        convolve_into(image, result, sharpen, border);
+                        report.check(name + "sharpen", compare_images(result, sharpen_expected));
+                        convolve_into(image, result, kernel, border);
+                        report.check(name + "5x5", compare_images(result, kernel_expected));
+                        sobel_into(image, result, border);
+                        report.check(name + "sobel", compare_images(result, sobel_expected));
+                    }
+                }
+                set_simd_level(best_simd);
+                set_thread_count(0);
+
+                // The identity kernel changes nothing but the rounding of premultiplying
+                ConvolutionKernel identity = {3, vector<double>(9, 0)};
+                identity.weights[4] = 1;
+                Image same;
+                convolve_into(image, same, identity, border);
+                report.check(string(label) + "identity", compare_images(same, round_trip));
+            }
 
+            // Borders that repeat the image keep a flat image flat, even with a large radius
+            if (border != BORDER_ZERO)
+            {
+                Image flat(width, height);
+                fill(flat.data.begin(), flat.data.end(), 77);
+                Image blurred;
+                char label[96];
+                snprintf(label, sizeof(label), "%dx%d %s flat ", width, height, border_names[b]);
+                gaussian_blur_into(flat, blurred, 6, border);
+                report.check(string(label) + "gaussian", compare_images(blurred, flat));
+                box_blur_into(flat, blurred, 40, border);
+                report.check(string(label) + "box", compare_images(blurred, flat));
+                sobel_into(flat, blurred, border);
+                Image black(width, height);
+                report.check(string(label) + "sobel", compare_images(blurred, black));
+            }
         }
     }
-    cout << "Executed Process 10: Black, White and RGB" << endl;
-    return image_file;
 }
 
-vector<vector<Pixel>> process_11 (vector<vector<Pixel>> image_file, vector<vector<Pixel>> layer_image, double scaling)
-{
+void verify_allocation_counting(VerifyReport& report)
 /**
- * Layers one image on top of the other, using the scaling argument to blend the two
- * Second image will be centered on the original image
- * @param image_file The image file on the bottom
- * @param image_file The image file layers on top
- * @param scaling The transparency of the top image
+ * Checks that a thread counts the allocations of its parallel_rows() calls,
+ * wherever the rows ran, and none of another thread's
+ * @param report Receives the results
  */
-    // Get the size of the images
-    int file_height = image_file.size();
-    int file_width = image_file[0].size();
-    int layer_height = layer_image.size();
-    int layer_width = layer_image[0].size();
-    int y_difference = abs(round((layer_height-file_height)/2));
-    int x_difference = abs(round((layer_width-file_width)/2));
-
-    // Setting up image placement
-    // Layered image will be centered on bottom image
+{
+    const int rows = 2000;
+    atomic<long long> others(0);
+    atomic<bool> stopping(false);
+    atomic<int*> noise(NULL);
+    allocation_counting.store(true);
+    thread other([&]
+    {
+        // Handed through an atomic, so the compiler cannot drop the allocations
+        while (!stopping.load())
+        {
+            delete noise.exchange(new int(0));
+            others++;
+        }
+    });
 
-    // Crops the layer image to the same size as original image
-    // if it is larger. Removes pixels evenly from either side.
-    // Crops down height
-    
-    if (file_height < layer_height)
+    // One allocation a row, the pool adds a few of its own for the tasks
+    set_thread_count(4);
+    vector<unique_ptr<int> > kept(rows);
+    long long before = thread_allocations;
+    long long others_before = others.load();
+    parallel_rows(rows, 16384, [&kept](int begin, int end)
     {
-        for (int n = 0; n < y_difference; n++)
+        for (int y = begin; y < end; y++)
         {
-            layer_image.erase(layer_image.begin());
-            layer_image.erase(layer_image.end()-1);
+            kept[y].reset(new int(y));
         }
-        // Reassigns height size and recalcs height difference
-        layer_height = layer_image.size();
-        y_difference = round((layer_height-file_height)/2);
+    });
+    // Also while the other thread surely allocates
+    while (others.load() < others_before + 10000)
+    {
+        this_thread::yield();
     }
-    // Crops down width
-    if (file_width < layer_width)
+    long long counted = thread_allocations - before;
+    stopping.store(true);
+    other.join();
+    delete noise.load();
+    allocation_counting.store(false);
+    set_thread_count(0);
+
+    bool ok = counted >= rows && counted < rows + 64;
+    ImageDifference difference = {true, ok ? 0 : 1, ok ? 0 : 1, ok ? 0.0 : 1.0};
+    report.check("allocations counted per thread", difference);
+}
+
+void verify_image_pool(VerifyReport& report)
+/**
+ * Checks that the pool reuses buffers only when they fit, clears row
+ * padding, keeps a bounded number of buffers, and that pipelines give the
+ * same results with recycled buffers as with new ones
+ * @param report Receives the results
+ */
+{
+    auto expect = [&](const string& name, bool ok)
+    {
+        ImageDifference difference = {true, ok ? 0 : 1, ok ? 0 : 1, ok ? 0.0 : 1.0};
+        report.check("image pool " + name, difference);
+    };
+
+    ImagePool pool;
+    Image image = pool.acquire(100, 10);
+    const unsigned char* buffer = &image.data[0];
+    pool.release(image);
+    expect("release empties", image.empty() && image.data.capacity() == 0);
+    image = pool.acquire(100, 10);
+    ImagePoolStats stats = pool.get_stats();
+    expect("same size hit", stats.hits == 1 && stats.misses == 1 && &image.data[0] == buffer);
+    pool.release(image);
+
+    // A buffer more than twice the size needed is not used
+    Image small = pool.acquire(10, 10);
+    stats = pool.get_stats();
+    expect("small miss", stats.misses == 2 && stats.pooled_bytes == 3000);
+    Image large = pool.acquire(200, 10);
+    stats = pool.get_stats();
+    expect("large miss", stats.misses == 3);
+
+    // Dirty buffers come back with zero padding, 5 pixels of 3 channels pad one byte a row
+    fill(large.data.begin(), large.data.end(), 0xFF);
+    pool.release(large);
+    Image padded = pool.acquire(5, 300);
+    bool zero = padded.stride == 16 && pool.get_stats().hits == 2;
+    for (int y = 0; y < padded.height; y++)
+    {
+        zero = zero && padded.row(y)[15] == 0;
+    }
+    expect("padding cleared", zero);
+
+    // Image itself clears the padding when its own dirty buffer changes layout
+    Image reused(40, 30);
+    fill(reused.data.begin(), reused.data.end(), 0xFF);
+    const int layouts[][3] = {{40, 30, 3}, {5, 30, 3}, {13, 20, 4}, {7, 31, 1}, {1, 2, 3}};
+    zero = true;
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++)
     {
-        for (int y = 0; y < layer_height; y++)
+        reused.resize(layouts[i][0], layouts[i][1], layouts[i][2]);
+        for (int y = 0; y < reused.height; y++)
         {
-            for (int n = 0; n < x_difference; n++)
+            for (int b = reused.width * reused.channels; b < reused.stride; b++)
             {
-                layer_image[y].erase(layer_image[y].begin());
-                layer_image[y].erase(layer_image[y].end()-1);
+                zero = zero && reused.row(y)[b] == 0;
             }
         }
-        // Reassigns width and recalcs width difference
-        layer_width = layer_image[0].size();
-        x_difference = round((layer_width-file_width)/2);
+        fill(reused.data.begin(), reused.data.end(), 0xFF);
     }
-    
-    // Adds the nwe image on top of the old image using the scaling parameter
-    // to calculate transparency. Centers the layered image on top
-    for (int y = 0; y < layer_height; y++)
+    expect("image resize clears padding", zero);
+
+    // Growing an image that has its own buffer
+    pool.resize(small, 10, 5);
+    expect("own buffer hit", pool.get_stats().hits == 3 && small.width == 10 && small.height == 5);
+
+    // Only IMAGE_POOL_BUFFERS buffers are kept
+    pool.clear();
+    pool.reset_stats();
+    vector<Image> images;
+    for (size_t i = 0; i < IMAGE_POOL_BUFFERS + 4; i++)
     {
-        for (int x = 0; x < layer_width; x++)
-        {
-            Pixel image_rgb = image_file[y+y_difference][x+x_difference];
-            Pixel layer_rgb = layer_image[y][x];
+        images.push_back(pool.acquire(16, 16));
+    }
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        pool.release(images[i]);
+    }
+    stats = pool.get_stats();
+    expect("bounded", stats.dropped == 4 && stats.pooled_bytes == static_cast<long long>(IMAGE_POOL_BUFFERS) * 16 * 48
+           && stats.peak_pooled_bytes == stats.pooled_bytes);
 
-            image_rgb.red = image_rgb.red * (scaling) + layer_rgb.red * (1 - scaling);
-            image_rgb.green = image_rgb.green * (scaling) + layer_rgb.green * (1 - scaling);
-            image_rgb.blue = image_rgb.blue * (scaling) + layer_rgb.blue * (1 - scaling);
+    // Pipelines with every kind of second image, on images of changing sizes
+    FilterPipeline pipeline;
+    pipeline.add(OP_ROTATE_90).add_scale(1.3, .7, RESAMPLE_BILINEAR).add_convolution(OP_BLUR, 1)
+            .add(OP_ROTATE, 3).add_greyscale(GREY_REC709, true);
+    const int sizes[][2] = {{64, 48}, {17, 93}, {64, 48}, {120, 3}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        Image source = synthetic_image(sizes[i][0], sizes[i][1], static_cast<unsigned int>(i + 61));
+        Image expected;
+        rotate_90_into(source, expected);
+        Image step;
+        scale_into(expected, step, 1.3f, .7f, RESAMPLE_BILINEAR);
+        gaussian_blur_into(step, expected, 1);
+        rotate_into(expected, step, 3);
+        greyscale_into(step, expected, GREY_REC709);
 
-            image_file[y+y_difference][x+x_difference] = image_rgb;
-            
+        Image result = source;
+        long long hits = image_pool.get_stats().hits;
+        pipeline.run(result);
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d pipeline ", sizes[i][0], sizes[i][1]);
+        report.check(string(label) + "result", compare_images(result, expected));
+        expect(string(label) + "reuses", i == 0 || image_pool.get_stats().hits > hits);
+    }
+}
+
+int run_verify(int argc, char* argv[])
+/**
+ * Runs the verification mode of the command line
+ *   --root DIR      Directory holding output/ and sample_images/ (default .)
+ *   --verbose       List the checks that pass too
+ * @return 0 if every check passed, 1 if any failed, 2 for invalid arguments
+ */
+{
+    string root = ".";
+    ostream results(cout.rdbuf());
+    VerifyReport report(results);
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        if (arg == "--verify")
+        {
+            continue;
+        } else if (arg == "--root" && a + 1 < argc)
+        {
+            root = argv[++a];
+        } else if (arg == "--verbose")
+        {
+            report.verbose = true;
+        } else
+        {
+            cerr << "ERROR: unknown or incomplete verify argument: " << arg << endl;
+            return 2;
         }
     }
-    cout << "Executed Process 11: Layer Images with " << scaling << " Transparency" << endl;
-    return image_file;
+
+    // The processes print as they go, which would hide the results
+    NullBuffer null_buffer;
+    streambuf* screen = cout.rdbuf(&null_buffer);
+    verify_goldens(root, report);
+    verify_fast_paths(root, report);
+    verify_bmp_io(root, report);
+    verify_planar(report);
+    verify_menu_sequence(report);
+    verify_alpha(report);
+    verify_resample(report);
+    verify_composite(report);
+    verify_greyscale(report);
+    verify_threshold(report);
+    verify_stats(report);
+    verify_convolution(report);
+    verify_image_pool(report);
+    verify_allocation_counting(report);
+    cout.rdbuf(screen);
+    cout << report.passed << " passed, " << report.failed << " failed" << endl;
+    return report.failed == 0 ? 0 : 1;
 }
 
+void run_statistics_menu()
+/**
+ * Menu option 12, starts recording the first time and shows the results
+ * after that, with the choice of saving a trace, resetting or stopping
+ */
+{
+    if (!instrumentation_enabled.load())
+    {
+        start_instrumentation();
+        image_pool.reset_stats();
+        cout << endl << "   Recording started" << endl
+        << "Every read, filter and write is timed from now on, choose 12 again to see the results" << endl;
+        return;
+    }
+    cout << endl;
+    print_instrumentation_summary(cout);
+    print_image_pool_stats(cout);
+    cout << endl << "  Enter a file path to save a Chrome trace" << endl
+    << " -- Enter r to reset, s to stop recording or q to return to menu" << endl;
+    string choice;
+    cin >> choice;
+    if (cin.fail() || choice == "q" || choice == "Q")
+    {
+        cin.clear();
+    } else if (choice == "r" || choice == "R")
+    {
+        start_instrumentation();
+        image_pool.reset_stats();
+        cout << "   Recording restarted" << endl;
+    } else if (choice == "s" || choice == "S")
+    {
+        stop_instrumentation();
+        cout << "   Recording stopped" << endl;
+    } else if (write_chrome_trace(choice))
+    {
+        cout << "Sucessful write: " << choice << endl;
+    } else
+    {
+        cout << "Failed to output" << endl;
+    }
+}
 
-int main()
+int main(int argc, char* argv[])
 /* 
 Provides a UI for the image processing application
 Asks for a image path and then provides menu
+With arguments, runs the command line mode instead
 */
 {
+    for (int a = 1; a < argc; a++)
+    {
+        if (string(argv[a]) == "--bench")
+        {
+            return run_benchmark(argc, argv);
+        }
+        if (string(argv[a]) == "--verify")
+        {
+            return run_verify(argc, argv);
+        }
+    }
+    if (argc > 1)
+    {
+        return run_cli(argc, argv);
+    }
+
     // Initial variable set up
     string input_val;           // Checks inputs for initial file path entry
     string menu_val;            // Checks inputs for menu of imgage modifications
@@ -770,8 +10210,9 @@ Asks for a image path and then provides menu
             // Image with size 0 / unable to read will loop back to the menu
             try 
             {
-                vector<vector<Pixel>> input_image = read_image(file_path);
-                if (input_image.size() <= 0) {
+                Image input_image = read_bmp(file_path);
+                Image process_image;            // Reused by every menu option
+                if (input_image.empty()) {
                     cout << endl << "ERROR: Unable to read image, please try again" << endl
                     << "Please ensure your image is a .bmp file and the path is valid"<< endl << endl;
                     input_val = "c";
@@ -799,7 +10240,8 @@ Asks for a image path and then provides menu
                     << "8) Lighten" << endl 
                     << "9) Darken" << endl 
                     << "10) Black, White, RGB" << endl 
-                    << "11) Layer Images" << endl << endl
+                    << "11) Layer Images" << endl
+                    << "12) Performance Statistics" << endl << endl
                     << " -- Enter q to exit" << endl;
 
                     cin >> menu_val; 
@@ -812,13 +10254,16 @@ Asks for a image path and then provides menu
                     {
                         // Will attempt to convert string memu entry into a int
                         // If it fails, it will be caught and returned to the menu
-                        // On sucess, will generate an empty vector for the modified image
+                        // On sucess, the modified image is written into process_image
                         try
                         {
                             int menu = stoi(menu_val);
-                            if (menu >= 0 && menu <= 11){
+                            if (menu == 12)
+                            {
+                                // Shows timings, nothing to write afterwards
+                                run_statistics_menu();
+                            } else if (menu >= 0 && menu <= 11){
 
-                                vector<vector<Pixel>> process_image;
                                 int image_modified = 0;         // Tracks if image was sucessfully modified
                                 double scaling;                 // Strength of effect to be applied
                                 string old_path = file_path;    // Saves path before attempting file change
@@ -828,14 +10273,15 @@ Asks for a image path and then provides menu
                                     // Option to select a new image
                                         cout << endl << "  Input new file path:" << endl;
                                         cin >> file_path;
-                                        input_image = read_image(file_path);
-                                        if (input_image.size() <= 0) {
+                                        read_bmp_into(file_path, process_image, &image_pool);
+                                        if (process_image.empty()) {
                                             cout << endl << "ERROR: Unable to read image, please try again" << endl
                                             << "Please ensure your image is a .bmp file and the path is valid" << endl << endl;
                                             file_path = old_path;
                                             break;
                                         } else 
                                         {
+                                            swap(input_image, process_image);
                                             cout <<endl << "   Image read sucessfully" << endl << endl;
                                             break;
                                         }
@@ -843,7 +10289,9 @@ Asks for a image path and then provides menu
                                     case 1:
                                     // Process 01 - Adds a Vignette
                                         cout << endl << "  Running: Process 01" << endl;
-                                        process_image = process_01(input_image);
+                                        process_image = input_image;
+                                        vignette_in_place(process_image);
+                                        cout << "Executed Process 01: Add Vignette" << endl;
                                         image_modified = 1;
                                         break;
 
@@ -865,7 +10313,9 @@ Asks for a image path and then provides menu
                                         } else 
                                         {
                                         cout << endl << "  Running: Process 02" << endl;
-                                        process_image = process_02(input_image, scaling);
+                                        process_image = input_image;
+                                        claredon_in_place(process_image, scaling);
+                                        cout << "Executed Process 02: Claredon by factor of " << scaling << endl;
                                         image_modified = 1;
                                         break;
                                         }
@@ -873,14 +10323,17 @@ Asks for a image path and then provides menu
                                     case 3:
                                     // Process 3 - Greyscale Image
                                         cout << endl << "  Running: Process 03" << endl;
-                                        process_image = process_03(input_image);
+                                        process_image = input_image;
+                                        greyscale_in_place(process_image);
+                                        cout << "Executed Process 03: Greyscale" << endl;
                                         image_modified = 1;
                                         break;
 
                                     case 4:
                                     // Process 4 - Rotate by 90 Degrees
                                         cout << endl << "  Running: Process 04" << endl;
-                                        process_image = process_04(input_image);
+                                        rotate_90_into(input_image, process_image);
+                                        cout << "Executed Process 04: Rotate 90 Degrees" << endl;
                                         image_modified = 1;
                                         break;
 
@@ -902,7 +10355,8 @@ Asks for a image path and then provides menu
                                         } else 
                                         {
                                             int rotations = static_cast<int>(round(rot_input));
-                                            process_image = process_05(input_image, rotations);
+                                            rotate_into(input_image, process_image, rotations);
+                                            cout << "Executed Process 05: Rotated 90 Degrees " << rotations << " times" << endl;
                                             image_modified = 1;
                                             break;
                                         }
@@ -927,7 +10381,12 @@ Asks for a image path and then provides menu
                                             break;
                                         } else 
                                         {
-                                            process_image = process_06(input_image, x_scale, y_scale);
+                                            if (x_scale == 0 || y_scale == 0)
+                                            {
+                                                cout << "Cannot scale by 0. 0 value will default to 1." << endl;
+                                            }
+                                            scale_into(input_image, process_image, x_scale, y_scale);
+                                            cout << "Executed Process 06: Scaled image " << x_scale << " by " << y_scale << endl;
                                             image_modified = 1;
                                             break;
                                         }
@@ -936,7 +10395,9 @@ Asks for a image path and then provides menu
                                     case 7:
                                     // Process 7 - Black and White Conversion
                                         cout << endl << "  Running: Process 07" << endl;
-                                        process_image = process_07(input_image);
+                                        process_image = input_image;
+                                        black_white_in_place(process_image);
+                                        cout << "Executed Process 07: B&W" << endl;
                                         image_modified = 1;
                                         break;
 
@@ -959,7 +10420,9 @@ Asks for a image path and then provides menu
                                         } else 
                                         {
                                         cout << endl << "  Running: Process 08" << endl;
-                                        process_image = process_08(input_image, scaling);
+                                        process_image = input_image;
+                                        lighten_in_place(process_image, scaling);
+                                        cout << "Executed Process 08: Lightened by factor of " << scaling << endl;
                                         image_modified = 1;
                                         break;
                                         }
@@ -983,7 +10446,9 @@ Asks for a image path and then provides menu
                                         } else 
                                         {
                                         cout << endl << "  Running: Process 09" << endl;
-                                        process_image = process_09(input_image, scaling);
+                                        process_image = input_image;
+                                        darken_in_place(process_image, scaling);
+                                        cout << "Executed Process 09: Darken by factor of " << scaling << endl;
                                         image_modified = 1;
                                         break;
                                         }
@@ -991,7 +10456,9 @@ Asks for a image path and then provides menu
                                     case 10:
                                     // Process 10 - Black, White, RGB
                                         cout << endl << "  Running: Process 10" << endl;
-                                        process_image = process_10(input_image);
+                                        process_image = input_image;
+                                        black_white_rgb_in_place(process_image);
+                                        cout << "Executed Process 10: Black, White and RGB" << endl;
                                         image_modified = 1;
                                         break;
                                     
@@ -1010,15 +10477,18 @@ Asks for a image path and then provides menu
                                             // Loops back to menu on invalid input
                                             break;
                                         } else {
-                                            vector<vector<Pixel>> layer_image = read_image(layer_path);
-                                            if (layer_image.size() <= 0) {
+                                            Image layer_image;
+                                            read_bmp_into(layer_path, layer_image, &image_pool);
+                                            if (layer_image.empty()) {
                                                 cout << endl << "ERROR: Unable to read image, please try again" << endl
                                                 << "Please ensure your image is a .bmp file and the path is valid" << endl << endl;
                                                 break;
                                             } else 
                                             {
                                                 cout <<endl << "   Image read sucessfully" << endl << endl;
-                                                process_image = process_11(input_image, layer_image, .5);
+                                                layer_into(input_image, layer_image, .5, process_image);
+                                                image_pool.release(layer_image);
+                                                cout << "Executed Process 11: Layer Images with " << .5 << " Transparency" << endl;
                                                 image_modified = 1;
                                                 cout << endl << "Process 11 Complete, writing.." << endl;
                                         }
@@ -1044,7 +10514,7 @@ Asks for a image path and then provides menu
                                     }
                                     else
                                     {
-                                        if (write_image(output_path, process_image))
+                                        if (write_bmp(output_path, process_image))
                                         {
                                             cout << "Sucessful write: " << output_path << endl;
                                         } else 
@@ -1055,7 +10525,7 @@ Asks for a image path and then provides menu
                                 }
                             }
                             else
-                            // Error catcher for user input of integer <0 or > 10
+                            // Error catcher for user input of integer <0 or > 12
                             {
                                 cout << endl << "ERROR: Invalid menu option" << endl
                                 << "Please try again" << endl << endl;   